@@ -45,6 +45,20 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
 
 typedef void(^SDWebImageCompletionWithPossibleErrorBlock)(NSError * _Nullable error);
 
+/**
+ Return the cache key for the thumbnail of an image. Each thumbnail pixel size of the same image is cached as a separate entry.
+
+ @param key The unique image cache key, usually it's image absolute URL
+ @param thumbnailPixelSize The maximum pixel size of the thumbnail. If it's zero, the key itself is returned
+ @return The cache key for the thumbnail
+ */
+FOUNDATION_EXPORT NSString * _Nullable SDThumbnailedKeyForKey(NSString * _Nullable key, CGSize thumbnailPixelSize);
+
+/**
+ Return the thumbnail pixel size specified by `SDWebImageContextImageThumbnailPixelSize` in the context, or CGSizeZero if not provided.
+ */
+FOUNDATION_EXPORT CGSize SDThumbnailPixelSizeFromContext(SDWebImageContext * _Nullable context);
+
 /**
  * SDImageCache maintains a memory cache and an optional disk cache. Disk cache write operations are performed
  * asynchronous so it doesn’t add unnecessary latency to the UI.
@@ -149,6 +163,51 @@ typedef void(^SDWebImageCompletionWithPossibleErrorBlock)(NSError * _Nullable er
             toDisk:(BOOL)toDisk
         completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock;
 
+/**
+ * Asynchronously store an image into memory and disk cache at the given key.
+ *
+ * @param image           The image to store
+ * @param imageData       The image data as returned by the server, this representation will be used for disk storage
+ *                        instead of converting the given image object into a storable/compressed image format in order
+ *                        to save quality and CPU
+ * @param key             The unique image cache key, usually it's image absolute URL
+ * @param toMemory        Store the image to memory cache if YES
+ * @param toDisk          Store the image to disk cache if YES. If NO, the completion block is called synchronously
+ * @param completionBlock A block executed after the operation is finished
+ */
+- (void)storeImage:(nullable UIImage *)image
+         imageData:(nullable NSData *)imageData
+            forKey:(nullable NSString *)key
+          toMemory:(BOOL)toMemory
+            toDisk:(BOOL)toDisk
+        completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock;
+
+/**
+ * Asynchronously store a thumbnail image into memory and disk cache at the given key and pixel size.
+ * The thumbnail is stored under its own cache key, see `SDThumbnailedKeyForKey`, and is charged its own cost in the memory cache.
+ *
+ * @param image              The thumbnail image to store
+ * @param key                The unique image cache key of the full size image, usually it's image absolute URL
+ * @param thumbnailPixelSize The maximum pixel size the thumbnail was created for
+ * @param toDisk             Store the thumbnail to disk cache if YES. If NO, the completion block is called synchronously
+ * @param completionBlock    A block executed after the operation is finished
+ */
+- (void)storeThumbnailImage:(nullable UIImage *)image
+                     forKey:(nullable NSString *)key
+         thumbnailPixelSize:(CGSize)thumbnailPixelSize
+                     toDisk:(BOOL)toDisk
+                 completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock;
+
+/**
+ * Record that the image cached at `derivedKey`, and its thumbnails, are derived from the image at `key`, such as a transformed image.
+ * They are removed together with the image at `key`, even after a relaunch if recorded to disk.
+ *
+ * @param derivedKey The cache key of the derived image, such as the one returned by `SDTransformedKeyForKey`
+ * @param key        The unique image cache key of the original image
+ * @param toDisk     Record the derived key on disk if YES, for a derived image stored to disk
+ */
+- (void)addDerivedKey:(nonnull NSString *)derivedKey forKey:(nonnull NSString *)key toDisk:(BOOL)toDisk;
+
 /**
  * Synchronously store image NSData into disk cache at the given key.
  *
@@ -161,6 +220,28 @@ typedef void(^SDWebImageCompletionWithPossibleErrorBlock)(NSError * _Nullable er
                        error:(NSError * _Nullable * _Nullable)error;
 
 
+/**
+ * Returns the directory in the disk cache's directory for the downloads to write their bodies to, see `SDWebImageContextDownloadDirectory`.
+ * It is on the same volume as the cache files, so that a complete file can be linked or moved into the cache without copying it.
+ */
+- (nonnull NSString *)downloadDirectoryPath;
+
+/**
+ * Returns a new path in `downloadDirectoryPath`, such as to link the file of a download to.
+ */
+- (nonnull NSString *)makeDownloadFilePath;
+
+/**
+ * Asynchronously moves a complete image data file, made with `makeDownloadFilePath`, into the disk cache for the given key. The file is removed if it can not be moved.
+ *
+ * @param path            The path of the file
+ * @param key             The unique image cache key, usually it's image absolute URL
+ * @param completionBlock A block executed after the operation is finished
+ */
+- (void)storeImageDataFileAtPath:(nonnull NSString *)path
+                          forKey:(nullable NSString *)key
+                      completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock;
+
 #pragma mark - Query and Retrieve Ops
 
 /**
@@ -207,6 +288,7 @@ typedef void(^SDWebImageCompletionWithPossibleErrorBlock)(NSError * _Nullable er
  * @param options   A mask to specify options to use for this cache query
  * @param doneBlock The completion block. Will not get called if the operation is cancelled
  * @param context   A context contains different options to perform specify changes or processes, see `SDWebImageContextOption`. This hold the extra objects which `options` enum can not hold.
+ *                  If `SDWebImageContextImageThumbnailPixelSize` is provided, the thumbnail of that size is queried instead of the full size image.
  *
  * @return a NSOperation instance containing the cache op
  */
@@ -219,6 +301,35 @@ typedef void(^SDWebImageCompletionWithPossibleErrorBlock)(NSError * _Nullable er
  */
 - (nullable UIImage *)imageFromMemoryCacheForKey:(nullable NSString *)key;
 
+/**
+ * Synchronously query the memory cache for a thumbnail of the image.
+ * If the thumbnail is not cached but a larger thumbnail or the full size image is in memory, the thumbnail is derived from it and cached.
+ *
+ * @param key                The unique key used to store the full size image
+ * @param thumbnailPixelSize The maximum pixel size of the thumbnail. If it's zero, this is the same as `imageFromMemoryCacheForKey:`
+ */
+- (nullable UIImage *)imageFromMemoryCacheForKey:(nullable NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize;
+
+/**
+ * Synchronously query the cache (memory and or disk) for a thumbnail of the image.
+ * If the thumbnail is not cached, it's derived from a larger thumbnail or the full size image in memory or on disk.
+ *
+ * @param key                The unique key used to store the full size image
+ * @param thumbnailPixelSize The maximum pixel size of the thumbnail. If it's zero, this is the same as `imageFromCacheForKey:`
+ */
+- (nullable UIImage *)imageFromCacheForKey:(nullable NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize;
+
+/**
+ * Synchronously create a thumbnail of an image, scaled for the key like the cached images. This does not cache the thumbnail.
+ *
+ * @param key                The unique key used to store the full size image
+ * @param image              The full size image
+ * @param thumbnailPixelSize The maximum pixel size of the thumbnail
+ *
+ * @return The thumbnail, or the image itself if it already fits in the pixel size
+ */
+- (nullable UIImage *)thumbnailImageForKey:(nullable NSString *)key image:(nullable UIImage *)image thumbnailPixelSize:(CGSize)thumbnailPixelSize;
+
 /**
  * Synchronously query the disk cache.
  *
@@ -236,7 +347,7 @@ typedef void(^SDWebImageCompletionWithPossibleErrorBlock)(NSError * _Nullable er
 #pragma mark - Remove Ops
 
 /**
- * Asynchronously remove the image from memory and disk cache
+ * Asynchronously remove the image and all its thumbnails and derived images from memory and disk cache
  *
  * @param key             The unique image cache key
  * @param completion      A block that should be executed after the image has been removed (optional)
@@ -10,8 +10,90 @@
 #import <CommonCrypto/CommonDigest.h>
 #import "NSImage+Additions.h"
 #import "SDWebImageCodersManager.h"
+#import "SDWebImageCoderHelper.h"
+#import "SDWebImageTracer.h"
+#import <sys/xattr.h>
+#import <objc/runtime.h>
+#if defined(__ARM_FEATURE_CRC32)
+#import <arm_acle.h>
+#endif
+
+#define LOCK(lock) dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
+#define UNLOCK(lock) dispatch_semaphore_signal(lock);
 
 static void * SDImageCacheContext = &SDImageCacheContext;
+// The key and derived key of a thumbnail in the memory cache, to forget the thumbnail once evicted
+static void * SDImageCacheDerivedKeysKey = &SDImageCacheDerivedKeysKey;
+
+// Hidden directories inside the disk cache path, skipped when enumerating cache files
+static NSString * const kSDImageCacheStagingDirectoryName = @".staging";
+static NSString * const kSDImageCacheQuarantineDirectoryName = @".quarantine";
+static NSString * const kSDImageCacheDownloadsDirectoryName = @".downloads";
+// The keys cached from each image, such as its thumbnails, so that they are removed with it after a relaunch
+static NSString * const kSDImageCacheDerivedKeysDirectoryName = @".derived";
+// A download file not written for this long has been abandoned
+static const NSTimeInterval kSDImageCacheAbandonedDownloadAge = 60 * 60;
+// The extended attribute holding the length and CRC32C checksum of a cache file
+static const char * const kSDImageCacheChecksumAttributeName = "com.hackemist.SDImageCache.checksum";
+
+typedef struct __attribute__((packed)) SDImageCacheChecksum {
+    uint64_t length;
+    uint32_t crc;
+} SDImageCacheChecksum;
+
+static uint32_t SDCRC32C(const void *bytes, size_t length) {
+    const uint8_t *p = bytes;
+    uint32_t crc = 0xFFFFFFFF;
+#if defined(__ARM_FEATURE_CRC32)
+    while (length >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += sizeof(word);
+        length -= sizeof(word);
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *p++);
+    }
+#else
+    static uint32_t table[256];
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        // Castagnoli polynomial, reversed
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int j = 0; j < 8; j++) {
+                value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : (value >> 1);
+            }
+            table[i] = value;
+        }
+    });
+    while (length--) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+#endif
+    return crc ^ 0xFFFFFFFF;
+}
+
+static BOOL SDImageCacheSetChecksumForFile(NSString *path, NSData *data) {
+    SDImageCacheChecksum checksum;
+    checksum.length = OSSwapHostToLittleInt64(data.length);
+    checksum.crc = OSSwapHostToLittleInt32(SDCRC32C(data.bytes, data.length));
+    return setxattr(path.fileSystemRepresentation, kSDImageCacheChecksumAttributeName, &checksum, sizeof(checksum), 0, 0) == 0;
+}
+
+// Return NO only if the file has a checksum and the data does not match it. Files written by previous versions have no checksum and are trusted
+static BOOL SDImageCacheVerifyChecksumForFile(NSString *path, NSData *data) {
+    SDImageCacheChecksum checksum;
+    if (getxattr(path.fileSystemRepresentation, kSDImageCacheChecksumAttributeName, &checksum, sizeof(checksum), 0, 0) != sizeof(checksum)) {
+        return YES;
+    }
+    // Check the length first, which is enough to detect a truncated file
+    if (OSSwapLittleToHostInt64(checksum.length) != data.length) {
+        return NO;
+    }
+    return OSSwapLittleToHostInt32(checksum.crc) == SDCRC32C(data.bytes, data.length);
+}
 
 FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 #if SD_MAC
@@ -21,13 +103,38 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 #endif
 }
 
-@interface SDImageCache ()
+FOUNDATION_STATIC_INLINE BOOL SDIsValidThumbnailPixelSize(CGSize thumbnailPixelSize) {
+    return thumbnailPixelSize.width >= 1 && thumbnailPixelSize.height >= 1;
+}
+
+NSString * SDThumbnailedKeyForKey(NSString * _Nullable key, CGSize thumbnailPixelSize) {
+    if (!key || !SDIsValidThumbnailPixelSize(thumbnailPixelSize)) {
+        return key;
+    }
+    // Use an URL fragment so that the path extension of the key is kept in the disk file name
+    return [key stringByAppendingFormat:@"#SDThumbnail(%ld,%ld)", (long)round(thumbnailPixelSize.width), (long)round(thumbnailPixelSize.height)];
+}
+
+CGSize SDThumbnailPixelSizeFromContext(SDWebImageContext * _Nullable context) {
+    CGSize thumbnailPixelSize = CGSizeZero;
+    NSValue *value = [context valueForKey:SDWebImageContextImageThumbnailPixelSize];
+    // NSNumber is a subclass of NSValue, check the encoded type before reading the raw value
+    if ([value isKindOfClass:[NSValue class]] && strcmp(value.objCType, @encode(CGSize)) == 0) {
+        [value getValue:&thumbnailPixelSize];
+    }
+    return thumbnailPixelSize;
+}
+
+@interface SDImageCache () <NSCacheDelegate>
 
 #pragma mark - Properties
 @property (strong, nonatomic, nonnull) NSCache *memCache;
 @property (strong, nonatomic, nonnull) NSString *diskCachePath;
 @property (strong, nonatomic, nullable) NSMutableArray<NSString *> *customPaths;
 @property (strong, nonatomic, nullable) dispatch_queue_t ioQueue;
+// The keys in the memory cache derived from each key, with the pixel sizes of the thumbnails used to derive a smaller thumbnail from a larger one, and CGSizeZero for the others
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSString *, NSMutableDictionary<NSString *, NSValue *> *> *derivedKeys;
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t derivedKeysLock; // a lock to keep the access to `derivedKeys` thread-safe
 
 @end
 
@@ -78,6 +185,9 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         // Init the memory cache
         _memCache = [[NSCache alloc] init];
         _memCache.name = fullNamespace;
+        _memCache.delegate = self;
+        _derivedKeys = [NSMutableDictionary new];
+        _derivedKeysLock = dispatch_semaphore_create(1);
 
         // Init the disk cache
         if (directory != nil) {
@@ -180,6 +290,15 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
             forKey:(nullable NSString *)key
             toDisk:(BOOL)toDisk
         completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock {
+    [self storeImage:image imageData:imageData forKey:key toMemory:YES toDisk:toDisk completion:completionBlock];
+}
+
+- (void)storeImage:(nullable UIImage *)image
+         imageData:(nullable NSData *)imageData
+            forKey:(nullable NSString *)key
+          toMemory:(BOOL)toMemory
+            toDisk:(BOOL)toDisk
+        completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock {
     if (!image || !key) {
         if (completionBlock) {
             completionBlock(nil);
@@ -187,7 +306,7 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         return;
     }
     // if memory cache is enabled
-    if (self.config.shouldCacheImagesInMemory) {
+    if (toMemory && self.config.shouldCacheImagesInMemory) {
         NSUInteger cost = SDCacheCostForImage(image);
         [self.memCache setObject:image forKey:key cost:cost];
     }
@@ -223,6 +342,34 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     }
 }
 
+- (void)storeThumbnailImage:(nullable UIImage *)image
+                     forKey:(nullable NSString *)key
+         thumbnailPixelSize:(CGSize)thumbnailPixelSize
+                     toDisk:(BOOL)toDisk
+                 completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock {
+    if (!image || !key || !SDIsValidThumbnailPixelSize(thumbnailPixelSize)) {
+        [self storeImage:image imageData:nil forKey:key toDisk:toDisk completion:completionBlock];
+        return;
+    }
+    NSString *thumbnailKey = SDThumbnailedKeyForKey(key, thumbnailPixelSize);
+    [self storeThumbnailImageToMemory:image forKey:key thumbnailPixelSize:thumbnailPixelSize];
+    if (toDisk) {
+        dispatch_async(self.ioQueue, ^{
+            [self _addDerivedKey:thumbnailKey pixelSize:thumbnailPixelSize forKey:key];
+        });
+    }
+    [self storeImage:image imageData:nil forKey:thumbnailKey toMemory:NO toDisk:toDisk completion:completionBlock];
+}
+
+- (void)addDerivedKey:(nonnull NSString *)derivedKey forKey:(nonnull NSString *)key toDisk:(BOOL)toDisk {
+    [self addDerivedKey:derivedKey pixelSize:CGSizeZero forKey:key];
+    if (toDisk) {
+        dispatch_async(self.ioQueue, ^{
+            [self _addDerivedKey:derivedKey pixelSize:CGSizeZero forKey:key];
+        });
+    }
+}
+
 - (BOOL)storeImageDataToDisk:(nullable NSData *)imageData
                       forKey:(nullable NSString *)key
                        error:(NSError * _Nullable __autoreleasing * _Nullable)error {
@@ -254,14 +401,47 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         }
     }
     
-    // get cache Path for image key
-    NSString *cachePathForKey = [self defaultCachePathForKey:key];
-    // transform to NSUrl
-    NSURL *fileURL = [NSURL fileURLWithPath:cachePathForKey];
+    // Write to a temporary file in the staging directory, then rename it into place. A process killed during the write leaves an orphaned temporary file rather than a truncated cache file
+    NSString *stagingPath = [_diskCachePath stringByAppendingPathComponent:kSDImageCacheStagingDirectoryName];
+    if (![_fileManager fileExistsAtPath:stagingPath]) {
+        if (![_fileManager createDirectoryAtPath:stagingPath withIntermediateDirectories:YES attributes:nil error:error]) {
+            return NO;
+        }
+    }
+    NSString *temporaryPath = [stagingPath stringByAppendingPathComponent:[NSUUID UUID].UUIDString];
     
     // NSFileManager's `createFileAtPath:` is used just for old code compatibility and will not trigger any delegate methods, so it's useless for custom NSFileManager at all.
     // And also, NSFileManager's `createFileAtPath:` can only grab underlying POSIX errno, but NSData can grab errors defined in NSCocoaErrorDomain, which is better for user to check.
-    if (![imageData writeToURL:fileURL options:self.config.diskCacheWritingOptions error:error]) {
+    // The rename is already atomic, and `NSDataWritingWithoutOverwriting` applies to the cache file, not the temporary file
+    NSDataWritingOptions writingOptions = self.config.diskCacheWritingOptions & ~(NSDataWritingAtomic | NSDataWritingWithoutOverwriting);
+    if (![imageData writeToURL:[NSURL fileURLWithPath:temporaryPath] options:writingOptions error:error]) {
+        return NO;
+    }
+    
+    if (self.config.shouldVerifyDiskCacheIntegrity) {
+        // ignore checksum error, a cache file without checksum is just not verified
+        SDImageCacheSetChecksumForFile(temporaryPath, imageData);
+    }
+    
+    return [self _moveFileAtPath:temporaryPath toDiskForKey:key error:error];
+}
+
+// Rename a complete file on the same volume into place for the key. Make sure to call from io queue by caller
+- (BOOL)_moveFileAtPath:(nonnull NSString *)temporaryPath toDiskForKey:(nonnull NSString *)key error:(NSError * _Nullable __autoreleasing * _Nonnull)error {
+    NSString *cachePathForKey = [self defaultCachePathForKey:key];
+    NSURL *fileURL = [NSURL fileURLWithPath:cachePathForKey];
+    
+    BOOL moved;
+    if (self.config.diskCacheWritingOptions & NSDataWritingWithoutOverwriting) {
+        moved = [_fileManager moveItemAtPath:temporaryPath toPath:cachePathForKey error:error];
+    } else {
+        moved = rename(temporaryPath.fileSystemRepresentation, cachePathForKey.fileSystemRepresentation) == 0;
+        if (!moved && error) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        }
+    }
+    if (!moved) {
+        [_fileManager removeItemAtPath:temporaryPath error:nil];
         return NO;
     }
     
@@ -274,6 +454,42 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     return YES;
 }
 
+- (nonnull NSString *)downloadDirectoryPath {
+    return [self.diskCachePath stringByAppendingPathComponent:kSDImageCacheDownloadsDirectoryName];
+}
+
+- (nonnull NSString *)makeDownloadFilePath {
+    return [self.downloadDirectoryPath stringByAppendingPathComponent:[NSUUID UUID].UUIDString];
+}
+
+- (void)storeImageDataFileAtPath:(nonnull NSString *)path
+                          forKey:(nullable NSString *)key
+                      completion:(nullable SDWebImageCompletionWithPossibleErrorBlock)completionBlock {
+    dispatch_async(self.ioQueue, ^{
+        NSError *writeError = nil;
+        if (!key) {
+            [_fileManager removeItemAtPath:path error:nil];
+        } else if ([_fileManager fileExistsAtPath:_diskCachePath] || [_fileManager createDirectoryAtPath:_diskCachePath withIntermediateDirectories:YES attributes:nil error:&writeError]) {
+            if (self.config.shouldVerifyDiskCacheIntegrity) {
+                @autoreleasepool {
+                    // The file may be large, checksum it mapped rather than read
+                    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:nil];
+                    if (data) {
+                        SDImageCacheSetChecksumForFile(path, data);
+                    }
+                }
+            }
+            [self _moveFileAtPath:path toDiskForKey:key error:&writeError];
+        }
+        
+        if (completionBlock) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                completionBlock(writeError);
+            });
+        }
+    });
+}
+
 #pragma mark - Query and Retrieve Ops
 
 - (void)diskImageExistsWithKey:(nullable NSString *)key completion:(nullable SDWebImageCheckCacheCompletionBlock)completionBlock {
@@ -342,16 +558,67 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     return image;
 }
 
+- (nullable UIImage *)imageFromMemoryCacheForKey:(nullable NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize {
+    if (!SDIsValidThumbnailPixelSize(thumbnailPixelSize)) {
+        return [self imageFromMemoryCacheForKey:key];
+    }
+    if (!key) {
+        return nil;
+    }
+    UIImage *image = [self.memCache objectForKey:SDThumbnailedKeyForKey(key, thumbnailPixelSize)];
+    if (image) {
+        return image;
+    }
+    
+    // Derive the thumbnail from the smallest larger thumbnail, or from the full size image
+    UIImage *sourceImage = nil;
+    for (NSString *thumbnailKey in [self largerThumbnailKeysForKey:key thumbnailPixelSize:thumbnailPixelSize]) {
+        sourceImage = [self.memCache objectForKey:thumbnailKey];
+        if (sourceImage) {
+            break;
+        }
+    }
+    if (!sourceImage) {
+        sourceImage = [self.memCache objectForKey:key];
+    }
+    if (!sourceImage) {
+        return nil;
+    }
+    image = [self thumbnailImageForKey:key image:sourceImage thumbnailPixelSize:thumbnailPixelSize];
+    if (image != sourceImage) {
+        [self storeThumbnailImageToMemory:image forKey:key thumbnailPixelSize:thumbnailPixelSize];
+    }
+    return image;
+}
+
+- (nullable UIImage *)imageFromCacheForKey:(nullable NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize {
+    if (!SDIsValidThumbnailPixelSize(thumbnailPixelSize)) {
+        return [self imageFromCacheForKey:key];
+    }
+    // First check the in-memory cache...
+    UIImage *image = [self imageFromMemoryCacheForKey:key thumbnailPixelSize:thumbnailPixelSize];
+    if (image) {
+        return image;
+    }
+    
+    // Second check the disk cache...
+    image = [self diskThumbnailImageForKey:key thumbnailPixelSize:thumbnailPixelSize data:NULL];
+    if (image) {
+        [self storeThumbnailImageToMemory:image forKey:key thumbnailPixelSize:thumbnailPixelSize];
+    }
+    return image;
+}
+
 - (nullable NSData *)diskImageDataBySearchingAllPathsForKey:(nullable NSString *)key {
     NSString *defaultPath = [self defaultCachePathForKey:key];
-    NSData *data = [NSData dataWithContentsOfFile:defaultPath options:self.config.diskCacheReadingOptions error:nil];
+    NSData *data = [self diskImageDataAtPath:defaultPath];
     if (data) {
         return data;
     }
 
     // fallback because of https://github.com/rs/SDWebImage/pull/976 that added the extension to the disk file name
     // checking the key with and without the extension
-    data = [NSData dataWithContentsOfFile:defaultPath.stringByDeletingPathExtension options:self.config.diskCacheReadingOptions error:nil];
+    data = [self diskImageDataAtPath:defaultPath.stringByDeletingPathExtension];
     if (data) {
         return data;
     }
@@ -359,14 +626,14 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     NSArray<NSString *> *customPaths = [self.customPaths copy];
     for (NSString *path in customPaths) {
         NSString *filePath = [self cachePathForKey:key inPath:path];
-        NSData *imageData = [NSData dataWithContentsOfFile:filePath options:self.config.diskCacheReadingOptions error:nil];
+        NSData *imageData = [self diskImageDataAtPath:filePath];
         if (imageData) {
             return imageData;
         }
 
         // fallback because of https://github.com/rs/SDWebImage/pull/976 that added the extension to the disk file name
         // checking the key with and without the extension
-        imageData = [NSData dataWithContentsOfFile:filePath.stringByDeletingPathExtension options:self.config.diskCacheReadingOptions error:nil];
+        imageData = [self diskImageDataAtPath:filePath.stringByDeletingPathExtension];
         if (imageData) {
             return imageData;
         }
@@ -375,9 +642,47 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     return nil;
 }
 
+// The checksum is verified lazily here, only when the file is actually read
+- (nullable NSData *)diskImageDataAtPath:(nonnull NSString *)path {
+    NSData *data = [NSData dataWithContentsOfFile:path options:self.config.diskCacheReadingOptions error:nil];
+    if (data && self.config.shouldVerifyDiskCacheIntegrity && !SDImageCacheVerifyChecksumForFile(path, data)) {
+        [self quarantineDiskImageAtPath:path];
+        return nil;
+    }
+    return data;
+}
+
+// Move the corrupted file out of the cache at once, so it is never read again, and remove it in background
+- (void)quarantineDiskImageAtPath:(nonnull NSString *)path {
+    NSString *quarantinePath = [self.diskCachePath stringByAppendingPathComponent:kSDImageCacheQuarantineDirectoryName];
+    [_fileManager createDirectoryAtPath:quarantinePath withIntermediateDirectories:YES attributes:nil error:nil];
+    NSString *quarantineFilePath = [quarantinePath stringByAppendingPathComponent:[NSUUID UUID].UUIDString];
+    // files in custom paths on another volume or read-only can not be moved, and are kept as they are
+    if (rename(path.fileSystemRepresentation, quarantineFilePath.fileSystemRepresentation) != 0) {
+        return;
+    }
+    dispatch_async(self.ioQueue, ^{
+        [_fileManager removeItemAtPath:quarantineFilePath error:nil];
+    });
+}
+
+// The cache file can not be decoded, remove it so that the image is downloaded again instead of failing on each query, a file kept in place could never be replaced with `NSDataWritingWithoutOverwriting`
+- (void)quarantineDiskImageForKey:(nonnull NSString *)key {
+    NSString *defaultPath = [self defaultCachePathForKey:key];
+    if ([_fileManager fileExistsAtPath:defaultPath]) {
+        [self quarantineDiskImageAtPath:defaultPath];
+    } else if ([_fileManager fileExistsAtPath:defaultPath.stringByDeletingPathExtension]) {
+        [self quarantineDiskImageAtPath:defaultPath.stringByDeletingPathExtension];
+    }
+}
+
 - (nullable UIImage *)diskImageForKey:(nullable NSString *)key {
     NSData *data = [self diskImageDataBySearchingAllPathsForKey:key];
-    return [self diskImageForKey:key data:data];
+    UIImage *image = [self diskImageForKey:key data:data];
+    if (data && !image) {
+        [self quarantineDiskImageForKey:key];
+    }
+    return image;
 }
 
 - (nullable UIImage *)diskImageForKey:(nullable NSString *)key data:(nullable NSData *)data {
@@ -397,6 +702,216 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     return SDScaledImageForKey(key, image);
 }
 
+#pragma mark - Thumbnail
+
+- (void)addDerivedKey:(nonnull NSString *)derivedKey pixelSize:(CGSize)pixelSize forKey:(nonnull NSString *)key {
+    NSValue *value = [NSValue valueWithBytes:&pixelSize objCType:@encode(CGSize)];
+    LOCK(self.derivedKeysLock);
+    NSMutableDictionary<NSString *, NSValue *> *pixelSizes = self.derivedKeys[key];
+    if (!pixelSizes) {
+        pixelSizes = [NSMutableDictionary dictionary];
+        self.derivedKeys[key] = pixelSizes;
+    }
+    pixelSizes[derivedKey] = value;
+    UNLOCK(self.derivedKeysLock);
+}
+
+- (void)removeDerivedKey:(nonnull NSString *)derivedKey forKey:(nonnull NSString *)key {
+    LOCK(self.derivedKeysLock);
+    NSMutableDictionary<NSString *, NSValue *> *pixelSizes = self.derivedKeys[key];
+    [pixelSizes removeObjectForKey:derivedKey];
+    if (pixelSizes.count == 0) {
+        [self.derivedKeys removeObjectForKey:key];
+    }
+    UNLOCK(self.derivedKeysLock);
+}
+
+// Return the keys of the thumbnails in memory which are large enough to derive the thumbnail of the given pixel size, smallest first
+- (nonnull NSArray<NSString *> *)largerThumbnailKeysForKey:(nonnull NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize {
+    LOCK(self.derivedKeysLock);
+    NSDictionary<NSString *, NSValue *> *pixelSizes = [self.derivedKeys[key] copy];
+    UNLOCK(self.derivedKeysLock);
+    return [self thumbnailKeysInPixelSizes:pixelSizes forKey:key largerThanPixelSize:thumbnailPixelSize];
+}
+
+// Return the keys of the thumbnails on disk which are large enough to derive the thumbnail of the given pixel size, smallest first
+- (nonnull NSArray<NSString *> *)largerDiskThumbnailKeysForKey:(nonnull NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize {
+    NSMutableDictionary<NSString *, NSValue *> *pixelSizes = [NSMutableDictionary dictionary];
+    [[self diskDerivedKeysForKey:key] enumerateKeysAndObjectsUsingBlock:^(NSString * _Nonnull derivedKey, NSArray<NSNumber *> * _Nonnull size, BOOL * _Nonnull stop) {
+        if ([size isKindOfClass:[NSArray class]] && size.count == 2) {
+            CGSize pixelSize = CGSizeMake(size[0].doubleValue, size[1].doubleValue);
+            pixelSizes[derivedKey] = [NSValue valueWithBytes:&pixelSize objCType:@encode(CGSize)];
+        }
+    }];
+    return [self thumbnailKeysInPixelSizes:pixelSizes forKey:key largerThanPixelSize:thumbnailPixelSize];
+}
+
+- (nonnull NSArray<NSString *> *)thumbnailKeysInPixelSizes:(nullable NSDictionary<NSString *, NSValue *> *)pixelSizes forKey:(nonnull NSString *)key largerThanPixelSize:(CGSize)thumbnailPixelSize {
+    if (pixelSizes.count == 0) {
+        return @[];
+    }
+    NSString *thumbnailKey = SDThumbnailedKeyForKey(key, thumbnailPixelSize);
+    NSMutableDictionary<NSString *, NSNumber *> *areas = [NSMutableDictionary dictionaryWithCapacity:pixelSizes.count];
+    [pixelSizes enumerateKeysAndObjectsUsingBlock:^(NSString * _Nonnull largerKey, NSValue * _Nonnull value, BOOL * _Nonnull stop) {
+        CGSize pixelSize = CGSizeZero;
+        [value getValue:&pixelSize];
+        if (pixelSize.width >= thumbnailPixelSize.width && pixelSize.height >= thumbnailPixelSize.height && ![largerKey isEqualToString:thumbnailKey]) {
+            areas[largerKey] = @(pixelSize.width * pixelSize.height);
+        }
+    }];
+    return [areas keysSortedByValueUsingSelector:@selector(compare:)];
+}
+
+// Return the keys derived from the key, and from those in turn, such as the thumbnails of a transformed image
+- (nonnull NSArray<NSString *> *)removeDerivedKeysForKey:(nonnull NSString *)key {
+    LOCK(self.derivedKeysLock);
+    NSArray<NSString *> *derivedKeys = self.derivedKeys[key].allKeys;
+    [self.derivedKeys removeObjectForKey:key];
+    UNLOCK(self.derivedKeysLock);
+    NSMutableArray<NSString *> *allDerivedKeys = [NSMutableArray arrayWithArray:derivedKeys ?: @[]];
+    for (NSString *derivedKey in derivedKeys) {
+        [allDerivedKeys addObjectsFromArray:[self removeDerivedKeysForKey:derivedKey]];
+    }
+    return allDerivedKeys;
+}
+
+- (void)storeThumbnailImageToMemory:(nullable UIImage *)image forKey:(nonnull NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize {
+    if (!image || !self.config.shouldCacheImagesInMemory) {
+        return;
+    }
+    // Each thumbnail is charged its own cost
+    NSUInteger cost = SDCacheCostForImage(image);
+    NSString *thumbnailKey = SDThumbnailedKeyForKey(key, thumbnailPixelSize);
+    objc_setAssociatedObject(image, SDImageCacheDerivedKeysKey, @[key, thumbnailKey], OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    [self.memCache setObject:image forKey:thumbnailKey cost:cost];
+    // Added after, as replacing a thumbnail in memory evicts the previous one
+    [self addDerivedKey:thumbnailKey pixelSize:thumbnailPixelSize forKey:key];
+}
+
+#pragma mark - NSCacheDelegate
+
+- (void)cache:(NSCache *)cache willEvictObject:(id)obj {
+    NSArray<NSString *> *derivedKeys = objc_getAssociatedObject(obj, SDImageCacheDerivedKeysKey);
+    if (derivedKeys.count == 2) {
+        [self removeDerivedKey:derivedKeys[1] forKey:derivedKeys[0]];
+    }
+}
+
+#pragma mark - Derived keys
+
+- (nonnull NSString *)derivedKeysPathForKey:(nonnull NSString *)key {
+    NSString *filename = [self cachedFileNameForKey:key].stringByDeletingPathExtension;
+    return [[self.diskCachePath stringByAppendingPathComponent:kSDImageCacheDerivedKeysDirectoryName] stringByAppendingPathComponent:filename];
+}
+
+// The keys cached on disk from the image for the key, with their pixel sizes
+- (nonnull NSDictionary<NSString *, NSArray<NSNumber *> *> *)diskDerivedKeysForKey:(nonnull NSString *)key {
+    NSDictionary<NSString *, NSArray<NSNumber *> *> *derivedKeys = [NSDictionary dictionaryWithContentsOfFile:[self derivedKeysPathForKey:key]];
+    return derivedKeys ?: @{};
+}
+
+// Make sure to call from io queue by caller
+- (void)_addDerivedKey:(nonnull NSString *)derivedKey pixelSize:(CGSize)pixelSize forKey:(nonnull NSString *)key {
+    NSDictionary<NSString *, NSArray<NSNumber *> *> *derivedKeys = [self diskDerivedKeysForKey:key];
+    NSArray<NSNumber *> *size = @[@(pixelSize.width), @(pixelSize.height)];
+    if ([derivedKeys[derivedKey] isEqual:size]) {
+        return;
+    }
+    NSMutableDictionary<NSString *, NSArray<NSNumber *> *> *mutableDerivedKeys = [derivedKeys mutableCopy];
+    mutableDerivedKeys[derivedKey] = size;
+    NSString *path = [self derivedKeysPathForKey:key];
+    [_fileManager createDirectoryAtPath:path.stringByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+    [mutableDerivedKeys writeToFile:path atomically:YES];
+}
+
+// Remove the image file for the key and the files cached from it. Make sure to call from io queue by caller
+- (void)_removeDiskImageForKey:(nonnull NSString *)key {
+    [_fileManager removeItemAtPath:[self defaultCachePathForKey:key] error:nil];
+    NSDictionary<NSString *, NSArray<NSNumber *> *> *derivedKeys = [self diskDerivedKeysForKey:key];
+    [_fileManager removeItemAtPath:[self derivedKeysPathForKey:key] error:nil];
+    for (NSString *derivedKey in derivedKeys) {
+        [self _removeDiskImageForKey:derivedKey];
+    }
+}
+
+// Remove the lists of derived keys whose files have all been removed, such as by the expiration. Make sure to call from io queue by caller
+- (void)_removeStaleDerivedKeys {
+    NSString *derivedKeysDirectory = [self.diskCachePath stringByAppendingPathComponent:kSDImageCacheDerivedKeysDirectoryName];
+    for (NSString *filename in [_fileManager contentsOfDirectoryAtPath:derivedKeysDirectory error:nil]) {
+        NSString *path = [derivedKeysDirectory stringByAppendingPathComponent:filename];
+        NSDictionary<NSString *, NSArray<NSNumber *> *> *derivedKeys = [NSDictionary dictionaryWithContentsOfFile:path];
+        BOOL isStale = YES;
+        for (NSString *derivedKey in derivedKeys) {
+            if ([_fileManager fileExistsAtPath:[self defaultCachePathForKey:derivedKey]]) {
+                isStale = NO;
+                break;
+            }
+        }
+        if (isStale) {
+            [_fileManager removeItemAtPath:path error:nil];
+        }
+    }
+}
+
+- (nullable UIImage *)thumbnailImageForKey:(nullable NSString *)key image:(nullable UIImage *)image thumbnailPixelSize:(CGSize)thumbnailPixelSize {
+    UIImage *thumbnailImage = [SDWebImageCoderHelper thumbnailImageWithImage:image pixelSize:thumbnailPixelSize];
+    if (thumbnailImage != image) {
+        thumbnailImage = [self scaledImageForKey:key image:thumbnailImage];
+    }
+    return thumbnailImage;
+}
+
+- (nullable UIImage *)thumbnailImageForKey:(nullable NSString *)key data:(nullable NSData *)data thumbnailPixelSize:(CGSize)thumbnailPixelSize {
+    if (!data) {
+        return nil;
+    }
+    UIImage *image = [SDWebImageCoderHelper thumbnailImageWithData:data pixelSize:thumbnailPixelSize];
+    if (image) {
+        return [self scaledImageForKey:key image:image];
+    }
+    // Image/IO can not decode a thumbnail from this data (such as WebP or animated images), decode the full size image instead
+    image = [self diskImageForKey:key data:data];
+    return [self thumbnailImageForKey:key image:image thumbnailPixelSize:thumbnailPixelSize];
+}
+
+// Look for the thumbnail itself, then a larger thumbnail, then the full size image on disk
+- (nullable UIImage *)diskThumbnailImageForKey:(nonnull NSString *)key thumbnailPixelSize:(CGSize)thumbnailPixelSize data:(NSData * _Nullable * _Nullable)dataPtr {
+    NSString *thumbnailKey = SDThumbnailedKeyForKey(key, thumbnailPixelSize);
+    NSData *data = [self diskImageDataBySearchingAllPathsForKey:thumbnailKey];
+    UIImage *image = nil;
+    if (data) {
+        image = [self diskImageForKey:thumbnailKey data:data];
+        if (!image) {
+            [self quarantineDiskImageForKey:thumbnailKey];
+        }
+    } else {
+        NSString *sourceKey = nil;
+        for (NSString *largerKey in [self largerDiskThumbnailKeysForKey:key thumbnailPixelSize:thumbnailPixelSize]) {
+            data = [self diskImageDataBySearchingAllPathsForKey:largerKey];
+            if (data) {
+                sourceKey = largerKey;
+                break;
+            }
+        }
+        if (!data) {
+            data = [self diskImageDataBySearchingAllPathsForKey:key];
+            sourceKey = key;
+        }
+        image = [self thumbnailImageForKey:key data:data thumbnailPixelSize:thumbnailPixelSize];
+        if (data && !image) {
+            [self quarantineDiskImageForKey:sourceKey];
+        }
+    }
+    if (!image) {
+        // undecodable data counts as a miss
+        data = nil;
+    }
+    if (dataPtr) {
+        *dataPtr = data;
+    }
+    return image;
+}
+
 - (nullable NSOperation *)queryCacheOperationForKey:(NSString *)key done:(SDCacheQueryCompletedBlock)doneBlock {
     return [self queryCacheOperationForKey:key options:0 done:doneBlock];
 }
@@ -413,8 +928,14 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         return nil;
     }
     
+    CGSize thumbnailPixelSize = SDThumbnailPixelSizeFromContext(context);
+    BOOL isThumbnail = SDIsValidThumbnailPixelSize(thumbnailPixelSize);
+    NSNumber *traceIdentifier = SDTraceIdentifierFromContext(context);
+    
     // First check the in-memory cache...
-    UIImage *image = [self imageFromMemoryCacheForKey:key];
+    SD_TRACE_BEGIN(@"memory lookup", traceIdentifier);
+    UIImage *image = [self imageFromMemoryCacheForKey:key thumbnailPixelSize:thumbnailPixelSize];
+    SD_TRACE_END(@"memory lookup", traceIdentifier);
     BOOL shouldQueryMemoryOnly = (image && !(options & SDImageCacheQueryDataWhenInMemory));
     if (shouldQueryMemoryOnly) {
         if (doneBlock) {
@@ -425,20 +946,40 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     
     NSOperation *operation = [NSOperation new];
     void(^queryDiskBlock)(void) =  ^{
+        SD_TRACE_END(@"io queue wait", traceIdentifier);
         if (operation.isCancelled) {
             // do not call the completion if cancelled
             return;
         }
         
         @autoreleasepool {
-            NSData *diskData = [self diskImageDataBySearchingAllPathsForKey:key];
+            NSData *diskData = nil;
             UIImage *diskImage = image;
-            if (!diskImage && diskData) {
+            // the thumbnails are read and downsampled in one go
+            SD_TRACE_BEGIN(@"disk read", traceIdentifier);
+            if (isThumbnail) {
+                if (diskImage) {
+                    diskData = [self diskImageDataBySearchingAllPathsForKey:key];
+                } else {
+                    diskImage = [self diskThumbnailImageForKey:key thumbnailPixelSize:thumbnailPixelSize data:&diskData];
+                    [self storeThumbnailImageToMemory:diskImage forKey:key thumbnailPixelSize:thumbnailPixelSize];
+                }
+            } else {
+                diskData = [self diskImageDataBySearchingAllPathsForKey:key];
+            }
+            SD_TRACE_END(@"disk read", traceIdentifier);
+            if (!diskImage && diskData && !isThumbnail) {
                 // decode image data only if in-memory cache missed
+                SD_TRACE_BEGIN(@"decode", traceIdentifier);
                 diskImage = [self diskImageForKey:key data:diskData];
+                SD_TRACE_END(@"decode", traceIdentifier);
                 if (diskImage && self.config.shouldCacheImagesInMemory) {
                     NSUInteger cost = SDCacheCostForImage(diskImage);
                     [self.memCache setObject:diskImage forKey:key cost:cost];
+                } else if (!diskImage) {
+                    // undecodable data counts as a miss, so the image is downloaded again
+                    [self quarantineDiskImageForKey:key];
+                    diskData = nil;
                 }
             }
             
@@ -454,6 +995,7 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         }
     };
     
+    SD_TRACE_BEGIN(@"io queue wait", traceIdentifier);
     if (options & SDImageCacheQueryDiskSync) {
         queryDiskBlock();
     } else {
@@ -474,13 +1016,21 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         return;
     }
 
+    NSArray<NSString *> *derivedKeys = [self removeDerivedKeysForKey:key];
     if (self.config.shouldCacheImagesInMemory) {
         [self.memCache removeObjectForKey:key];
+        for (NSString *derivedKey in derivedKeys) {
+            [self.memCache removeObjectForKey:derivedKey];
+        }
     }
 
     if (fromDisk) {
         dispatch_async(self.ioQueue, ^{
-            [_fileManager removeItemAtPath:[self defaultCachePathForKey:key] error:nil];
+            // The derived images on disk are listed with the key, even those cached before a relaunch
+            [self _removeDiskImageForKey:key];
+            for (NSString *derivedKey in derivedKeys) {
+                [_fileManager removeItemAtPath:[self defaultCachePathForKey:derivedKey] error:nil];
+            }
             
             if (completion) {
                 dispatch_async(dispatch_get_main_queue(), ^{
@@ -512,9 +1062,19 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 
 - (void)clearMemory {
     [self.memCache removeAllObjects];
+    // The evicted thumbnails are forgotten one by one, but not the keys derived without an image in memory
+    [self removeAllDerivedKeys];
+}
+
+- (void)removeAllDerivedKeys {
+    LOCK(self.derivedKeysLock);
+    [self.derivedKeys removeAllObjects];
+    UNLOCK(self.derivedKeysLock);
 }
 
 - (void)clearDiskOnCompletion:(nullable SDWebImageNoParamsBlock)completion {
+    // The thumbnails still in memory can not be found from the full size image key any more, they will be evicted by the memory cache
+    [self removeAllDerivedKeys];
     dispatch_async(self.ioQueue, ^{
         [_fileManager removeItemAtPath:self.diskCachePath error:nil];
         [_fileManager createDirectoryAtPath:self.diskCachePath
@@ -536,6 +1096,20 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 
 - (void)deleteOldFilesWithCompletionBlock:(nullable SDWebImageNoParamsBlock)completionBlock {
     dispatch_async(self.ioQueue, ^{
+        // Remove the temporary files left by interrupted writes and the quarantined files not removed yet, writes are serialized on the io queue so none is in progress
+        [_fileManager removeItemAtPath:[self.diskCachePath stringByAppendingPathComponent:kSDImageCacheStagingDirectoryName] error:nil];
+        [_fileManager removeItemAtPath:[self.diskCachePath stringByAppendingPathComponent:kSDImageCacheQuarantineDirectoryName] error:nil];
+        // Downloads may still be writing to their files, only remove the abandoned ones
+        NSURL *downloadsURL = [NSURL fileURLWithPath:[self.diskCachePath stringByAppendingPathComponent:kSDImageCacheDownloadsDirectoryName] isDirectory:YES];
+        NSDate *abandonedDate = [NSDate dateWithTimeIntervalSinceNow:-kSDImageCacheAbandonedDownloadAge];
+        for (NSURL *downloadURL in [_fileManager contentsOfDirectoryAtURL:downloadsURL includingPropertiesForKeys:@[NSURLContentModificationDateKey] options:0 error:nil]) {
+            NSDate *modificationDate;
+            [downloadURL getResourceValue:&modificationDate forKey:NSURLContentModificationDateKey error:nil];
+            if (!modificationDate || [modificationDate compare:abandonedDate] == NSOrderedAscending) {
+                [_fileManager removeItemAtURL:downloadURL error:nil];
+            }
+        }
+        
         NSURL *diskCacheURL = [NSURL fileURLWithPath:self.diskCachePath isDirectory:YES];
         NSArray<NSString *> *resourceKeys = @[NSURLIsDirectoryKey, NSURLContentModificationDateKey, NSURLTotalFileAllocatedSizeKey];
 
@@ -605,6 +1179,7 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
                 }
             }
         }
+        [self _removeStaleDerivedKeys];
         if (completionBlock) {
             dispatch_async(dispatch_get_main_queue(), ^{
                 completionBlock();
@@ -640,11 +1215,10 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 - (NSUInteger)getSize {
     __block NSUInteger size = 0;
     dispatch_sync(self.ioQueue, ^{
-        NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtPath:self.diskCachePath];
-        for (NSString *fileName in fileEnumerator) {
-            NSString *filePath = [self.diskCachePath stringByAppendingPathComponent:fileName];
-            NSDictionary<NSString *, id> *attrs = [_fileManager attributesOfItemAtPath:filePath error:nil];
-            size += [attrs fileSize];
+        for (NSURL *fileURL in [self diskCacheFileURLsWithPropertiesForKeys:@[NSURLFileSizeKey]]) {
+            NSNumber *fileSize;
+            [fileURL getResourceValue:&fileSize forKey:NSURLFileSizeKey error:NULL];
+            size += fileSize.unsignedIntegerValue;
         }
     });
     return size;
@@ -653,25 +1227,35 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 - (NSUInteger)getDiskCount {
     __block NSUInteger count = 0;
     dispatch_sync(self.ioQueue, ^{
-        NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtPath:self.diskCachePath];
-        count = fileEnumerator.allObjects.count;
+        count = [self diskCacheFileURLsWithPropertiesForKeys:@[]].count;
     });
     return count;
 }
 
-- (void)calculateSizeWithCompletionBlock:(nullable SDWebImageCalculateSizeBlock)completionBlock {
+// The cache files, without the hidden staging, quarantine, downloads and derived keys directories
+- (nonnull NSArray<NSURL *> *)diskCacheFileURLsWithPropertiesForKeys:(nonnull NSArray<NSURLResourceKey> *)keys {
     NSURL *diskCacheURL = [NSURL fileURLWithPath:self.diskCachePath isDirectory:YES];
+    NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtURL:diskCacheURL
+                                               includingPropertiesForKeys:[keys arrayByAddingObject:NSURLIsRegularFileKey]
+                                                                  options:NSDirectoryEnumerationSkipsHiddenFiles
+                                                             errorHandler:NULL];
+    NSMutableArray<NSURL *> *fileURLs = [NSMutableArray array];
+    for (NSURL *fileURL in fileEnumerator) {
+        NSNumber *isRegularFile;
+        [fileURL getResourceValue:&isRegularFile forKey:NSURLIsRegularFileKey error:NULL];
+        if (isRegularFile.boolValue) {
+            [fileURLs addObject:fileURL];
+        }
+    }
+    return fileURLs;
+}
 
+- (void)calculateSizeWithCompletionBlock:(nullable SDWebImageCalculateSizeBlock)completionBlock {
     dispatch_async(self.ioQueue, ^{
         NSUInteger fileCount = 0;
         NSUInteger totalSize = 0;
 
-        NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtURL:diskCacheURL
-                                                   includingPropertiesForKeys:@[NSFileSize]
-                                                                      options:NSDirectoryEnumerationSkipsHiddenFiles
-                                                                 errorHandler:NULL];
-
-        for (NSURL *fileURL in fileEnumerator) {
+        for (NSURL *fileURL in [self diskCacheFileURLsWithPropertiesForKeys:@[NSURLFileSizeKey]]) {
             NSNumber *fileSize;
             [fileURL getResourceValue:&fileSize forKey:NSURLFileSizeKey error:NULL];
             totalSize += fileSize.unsignedIntegerValue;
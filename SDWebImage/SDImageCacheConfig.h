@@ -29,6 +29,13 @@
  */
 @property (assign, nonatomic) BOOL shouldCacheImagesInMemory;
 
+/**
+ * Whether or not to store a checksum along with each disk cache file, and verify it when the file is read.
+ * A file which does not match its checksum is removed and counts as a cache miss, like a file whose data can not be decoded.
+ * Defaults to YES.
+ */
+@property (assign, nonatomic) BOOL shouldVerifyDiskCacheIntegrity;
+
 /**
  * The reading options while reading cache from disk.
  * Defaults to 0. You can set this to `NSDataReadingMappedIfSafe` to improve performance.
@@ -38,6 +45,7 @@
 /**
  * The writing options while writing cache to disk.
  * Defaults to `NSDataWritingAtomic`. You can set this to `NSDataWritingWithoutOverwriting` to prevent overwriting an existing file.
+ * @note Cache files are always written to a temporary file then moved into place, so the write is atomic regardless of `NSDataWritingAtomic`.
  */
 @property (assign, nonatomic) NSDataWritingOptions diskCacheWritingOptions;
 
@@ -32,6 +32,26 @@
  */
 + (NSArray<SDWebImageFrame *> * _Nullable)framesFromAnimatedImage:(UIImage * _Nullable)animatedImage;
 
+/**
+ Return a thumbnail of the image which fits in the given pixel size, keeping the aspect ratio. The image is never scaled up.
+ For animated images, the image itself is returned because frames are not thumbnailed.
+
+ @param image The full size image
+ @param pixelSize The maximum pixel size of the thumbnail
+ @return The thumbnail image with scale 1, or the image itself if it already fits
+ */
++ (UIImage * _Nullable)thumbnailImageWithImage:(UIImage * _Nullable)image pixelSize:(CGSize)pixelSize;
+
+/**
+ Decode a thumbnail from the image data which fits in the given pixel size, keeping the aspect ratio. This uses Image/IO to decode the thumbnail directly, without decoding the full size bitmap first.
+ Return nil when the data can not be decoded by Image/IO (such as WebP) or contains multiple frames, the caller should fall back to a full decode.
+
+ @param data The image data
+ @param pixelSize The maximum pixel size of the thumbnail
+ @return The thumbnail image with scale 1
+ */
++ (UIImage * _Nullable)thumbnailImageWithData:(NSData * _Nullable)data pixelSize:(CGSize)pixelSize;
+
 #if SD_UIKIT || SD_WATCH
 /**
  Convert an EXIF image orientation to an iOS one.
@@ -7,6 +7,7 @@
  */
 
 #import "SDWebImageCoderHelper.h"
+#import "SDWebImageCoder.h"
 #import "SDWebImageFrame.h"
 #import "NSImage+Additions.h"
 #import "NSData+ImageContentType.h"
@@ -156,6 +157,111 @@
     return frames;
 }
 
++ (UIImage *)thumbnailImageWithImage:(UIImage *)image pixelSize:(CGSize)pixelSize {
+    if (!image || image.images.count > 0) {
+        return image;
+    }
+    CGImageRef imageRef = image.CGImage;
+    if (!imageRef) {
+        return image;
+    }
+    
+    size_t width = CGImageGetWidth(imageRef);
+    size_t height = CGImageGetHeight(imageRef);
+#if SD_UIKIT || SD_WATCH
+    // The pixel size is specified for the displayed orientation, but the CGImage is not rotated yet
+    switch (image.imageOrientation) {
+        case UIImageOrientationLeft:
+        case UIImageOrientationRight:
+        case UIImageOrientationLeftMirrored:
+        case UIImageOrientationRightMirrored:
+            pixelSize = CGSizeMake(pixelSize.height, pixelSize.width);
+            break;
+        default:
+            break;
+    }
+#endif
+    CGSize thumbnailSize = SDThumbnailSizeFittingPixelSize(CGSizeMake(width, height), pixelSize);
+    if (thumbnailSize.width >= width && thumbnailSize.height >= height) {
+        return image;
+    }
+    
+    // autorelease the bitmap context and all vars to help system to free memory when there are memory warning.
+    @autoreleasepool {
+        BOOL hasAlpha = SDCGImageRefContainsAlpha(imageRef);
+        CGBitmapInfo bitmapInfo = kCGBitmapByteOrder32Host;
+        bitmapInfo |= hasAlpha ? kCGImageAlphaPremultipliedFirst : kCGImageAlphaNoneSkipFirst;
+        CGContextRef context = CGBitmapContextCreate(NULL, thumbnailSize.width, thumbnailSize.height, 8, 0, SDCGColorSpaceGetDeviceRGB(), bitmapInfo);
+        if (!context) {
+            return image;
+        }
+        CGContextSetInterpolationQuality(context, kCGInterpolationHigh);
+        CGContextDrawImage(context, CGRectMake(0, 0, thumbnailSize.width, thumbnailSize.height), imageRef);
+        CGImageRef thumbnailImageRef = CGBitmapContextCreateImage(context);
+        CGContextRelease(context);
+        if (!thumbnailImageRef) {
+            return image;
+        }
+#if SD_UIKIT || SD_WATCH
+        UIImage *thumbnailImage = [[UIImage alloc] initWithCGImage:thumbnailImageRef scale:1 orientation:image.imageOrientation];
+#else
+        UIImage *thumbnailImage = [[UIImage alloc] initWithCGImage:thumbnailImageRef scale:1];
+#endif
+        CGImageRelease(thumbnailImageRef);
+        return thumbnailImage;
+    }
+}
+
++ (UIImage *)thumbnailImageWithData:(NSData *)data pixelSize:(CGSize)pixelSize {
+    if (!data) {
+        return nil;
+    }
+    CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL);
+    if (!source) {
+        return nil;
+    }
+    UIImage *thumbnailImage = nil;
+    // Do not thumbnail animated images
+    if (CGImageSourceGetCount(source) == 1) {
+        NSUInteger width = 0, height = 0;
+        NSInteger exifOrientation = 1;
+        CFDictionaryRef properties = CGImageSourceCopyPropertiesAtIndex(source, 0, NULL);
+        if (properties) {
+            CFTypeRef val = CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
+            if (val) CFNumberGetValue(val, kCFNumberLongType, &width);
+            val = CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
+            if (val) CFNumberGetValue(val, kCFNumberLongType, &height);
+            val = CFDictionaryGetValue(properties, kCGImagePropertyOrientation);
+            if (val) CFNumberGetValue(val, kCFNumberNSIntegerType, &exifOrientation);
+            CFRelease(properties);
+        }
+        if (width > 0 && height > 0) {
+            // EXIF orientation 5-8 swap the width and height when displayed, and the thumbnail is created with the transform applied
+            if (exifOrientation >= 5 && exifOrientation <= 8) {
+                NSUInteger temp = width;
+                width = height;
+                height = temp;
+            }
+            CGSize thumbnailSize = SDThumbnailSizeFittingPixelSize(CGSizeMake(width, height), pixelSize);
+            NSDictionary *options = @{(__bridge NSString *)kCGImageSourceCreateThumbnailFromImageAlways : @(YES),
+                                      (__bridge NSString *)kCGImageSourceCreateThumbnailWithTransform : @(YES),
+                                      (__bridge NSString *)kCGImageSourceShouldCacheImmediately : @(YES),
+                                      (__bridge NSString *)kCGImageSourceThumbnailMaxPixelSize : @(MAX(thumbnailSize.width, thumbnailSize.height))};
+            CGImageRef thumbnailImageRef = CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+            if (thumbnailImageRef) {
+#if SD_UIKIT || SD_WATCH
+                thumbnailImage = [[UIImage alloc] initWithCGImage:thumbnailImageRef scale:1 orientation:UIImageOrientationUp];
+#else
+                thumbnailImage = [[UIImage alloc] initWithCGImage:thumbnailImageRef scale:1];
+#endif
+                CGImageRelease(thumbnailImageRef);
+            }
+        }
+    }
+    CFRelease(source);
+    return thumbnailImage;
+}
+
 #if SD_UIKIT || SD_WATCH
 // Convert an EXIF image orientation to an iOS one.
 + (UIImageOrientation)imageOrientationFromEXIFOrientation:(NSInteger)exifOrientation {
@@ -229,6 +335,17 @@
 #endif
 
 #pragma mark - Helper Fuction
+static CGSize SDThumbnailSizeFittingPixelSize(CGSize imageSize, CGSize pixelSize) {
+    if (imageSize.width <= 0 || imageSize.height <= 0 || pixelSize.width <= 0 || pixelSize.height <= 0) {
+        return imageSize;
+    }
+    CGFloat ratio = MIN(pixelSize.width / imageSize.width, pixelSize.height / imageSize.height);
+    if (ratio >= 1) {
+        return imageSize;
+    }
+    return CGSizeMake(MAX(floor(imageSize.width * ratio), 1), MAX(floor(imageSize.height * ratio), 1));
+}
+
 #if SD_UIKIT || SD_WATCH
 static NSUInteger gcd(NSUInteger a, NSUInteger b) {
     NSUInteger c;
@@ -84,6 +84,20 @@ FOUNDATION_EXPORT UIImage * _Nullable SDScaledImageForKey(NSString * _Nullable k
 
 FOUNDATION_EXPORT NSString *const _Nonnull SDWebImageErrorDomain;
 
+/**
+ The codes of the `SDWebImageErrorDomain` errors the caller may handle differently.
+ */
+typedef NS_ENUM(NSInteger, SDWebImageErrorCode) {
+    /**
+     * The download has been aborted because the image exceeds the pixel budget of the request, see `SDWebImageContextImagePixelBudget`.
+     */
+    SDWebImageErrorPixelBudgetExceeded = 1000,
+    /**
+     * The probed bytes do not contain the header of an image, see `-[SDWebImageDownloader probeImageWithURL:completed:]`.
+     */
+    SDWebImageErrorMetadataNotFound = 1001
+};
+
 #ifndef dispatch_queue_async_safe
 #define dispatch_queue_async_safe(queue, block)\
     if (strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), dispatch_queue_get_label(queue)) == 0) {\
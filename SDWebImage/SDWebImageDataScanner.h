@@ -0,0 +1,36 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+#import "NSData+ImageContentType.h"
+
+/**
+ Scans the received data incrementally, each byte once, to find the boundaries worth a new progressive decode: the completed scans of a progressive JPEG, the restart markers (rows) of a baseline JPEG, and the completed image data chunks of a PNG.
+ It also reads the pixel size and the frame count from the headers of JPEG, PNG, GIF and WebP, usually within the first few KB.
+ Used by the download operations while the data comes, and by `SDWebImageMetadata` to read the header of a probe.
+ */
+@interface SDWebImageDataScanner : NSObject
+
+@property (assign, nonatomic, readonly) SDImageFormat format;
+// Whether the boundaries of the data are known, if NO any new data can be decoded
+@property (assign, nonatomic, readonly) BOOL hasBoundaries;
+@property (assign, nonatomic, readonly) NSUInteger boundaryCount;
+// The pixel size, 0 until the header has been read
+@property (assign, nonatomic, readonly) NSUInteger pixelWidth;
+@property (assign, nonatomic, readonly) NSUInteger pixelHeight;
+// The frames declared by the header, or seen so far for GIF and animated WebP
+@property (assign, nonatomic, readonly) NSUInteger frameCount;
+// Whether the header declares an animation (the looping extension of a GIF, the animation control of an APNG or the animation flag of a WebP), even if its second frame has not been seen yet
+@property (assign, nonatomic, readonly, getter = isAnimated) BOOL animated;
+// Whether the data scanned so far tells if the image is animated: the frame header of a JPEG, the animation control or the first image data chunk of a PNG, the looping extension, the second frame or the trailer of a GIF, the first image chunk of a WebP
+@property (assign, nonatomic, readonly, getter = isAnimationKnown) BOOL animationKnown;
+
+- (void)scanData:(nonnull NSData *)data;
+
+@end
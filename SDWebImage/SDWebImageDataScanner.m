@@ -0,0 +1,491 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageDataScanner.h"
+
+typedef NS_ENUM(NSInteger, SDWebImageDataScannerState) {
+    SDWebImageDataScannerStateSignature,
+    SDWebImageDataScannerStateJPEGMarkerPrefix,
+    SDWebImageDataScannerStateJPEGMarker,
+    SDWebImageDataScannerStateJPEGSegmentLength,
+    SDWebImageDataScannerStateJPEGEntropyData,
+    SDWebImageDataScannerStateJPEGEntropyMarker,
+    SDWebImageDataScannerStatePNGChunkHeader,
+    SDWebImageDataScannerStateGIFBlock,
+    SDWebImageDataScannerStateGIFSubBlockSize,
+    SDWebImageDataScannerStateField,
+    SDWebImageDataScannerStateSkip,
+    SDWebImageDataScannerStateDone
+};
+
+// The fixed size headers read in full before being parsed
+typedef NS_ENUM(NSInteger, SDWebImageDataScannerField) {
+    SDWebImageDataScannerFieldJPEGFrameHeader,
+    SDWebImageDataScannerFieldPNGImageHeader,
+    SDWebImageDataScannerFieldPNGAnimationControl,
+    SDWebImageDataScannerFieldGIFScreenDescriptor,
+    SDWebImageDataScannerFieldGIFImageDescriptor,
+    SDWebImageDataScannerFieldGIFExtensionLabel,
+    SDWebImageDataScannerFieldGIFApplicationIdentifier,
+    SDWebImageDataScannerFieldWebPFileHeader,
+    SDWebImageDataScannerFieldWebPChunkHeader,
+    SDWebImageDataScannerFieldWebPLossyHeader,
+    SDWebImageDataScannerFieldWebPLosslessHeader,
+    SDWebImageDataScannerFieldWebPExtendedHeader
+};
+
+static const uint8_t kPNGSignatureBytes[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+
+static inline uint32_t SDReadBigEndian32(const uint8_t *bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static inline uint32_t SDReadLittleEndian16(const uint8_t *bytes) {
+    return bytes[0] | ((uint32_t)bytes[1] << 8);
+}
+
+static inline uint32_t SDReadLittleEndian24(const uint8_t *bytes) {
+    return bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16);
+}
+
+static inline uint32_t SDReadLittleEndian32(const uint8_t *bytes) {
+    return SDReadLittleEndian24(bytes) | ((uint32_t)bytes[3] << 24);
+}
+
+// SOF0 to SOF15, except DHT, JPG and DAC which share the range
+static inline BOOL SDIsJPEGFrameMarker(uint8_t marker) {
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+}
+
+@implementation SDWebImageDataScanner {
+    SDWebImageDataScannerState _state;
+    SDWebImageDataScannerState _stateAfterSkip; // for GIF
+    SDWebImageDataScannerField _field;
+    uint8_t _header[16];
+    NSUInteger _headerLength;
+    NSUInteger _fieldLength;
+    NSUInteger _skipLength;
+    uint8_t _marker; // the JPEG marker of the current segment
+    BOOL _isImageDataChunk; // whether the current PNG chunk is IDAT
+    BOOL _isProgressiveJPEG;
+    BOOL _isAnimatedWebP;
+    BOOL _isAnimatedPNG;
+    BOOL _isLoopingGIF;
+    NSUInteger _scanCount;
+    NSUInteger _restartCount;
+    NSUInteger _imageDataChunkCount;
+}
+
+- (instancetype)init {
+    if (self = [super init]) {
+        _format = SDImageFormatUndefined;
+    }
+    return self;
+}
+
+- (BOOL)hasBoundaries {
+    switch (_format) {
+        case SDImageFormatJPEG:
+            return _isProgressiveJPEG || _restartCount > 0;
+        case SDImageFormatPNG:
+            // Some encoders write all the image data in one chunk, which can not wait for its end
+            return _imageDataChunkCount > 0;
+        default:
+            return NO;
+    }
+}
+
+- (NSUInteger)boundaryCount {
+    switch (_format) {
+        case SDImageFormatJPEG:
+            return _isProgressiveJPEG ? _scanCount : _restartCount;
+        case SDImageFormatPNG:
+            return _imageDataChunkCount;
+        default:
+            return 0;
+    }
+}
+
+- (BOOL)isAnimated {
+    return _isLoopingGIF || _isAnimatedPNG || _isAnimatedWebP || _frameCount > 1;
+}
+
+- (BOOL)isAnimationKnown {
+    if (_state == SDWebImageDataScannerStateDone) {
+        return YES;
+    }
+    switch (_format) {
+        case SDImageFormatJPEG:
+            return _frameCount > 0;
+        case SDImageFormatPNG:
+            // The animation control must come before the image data
+            return _isAnimatedPNG || _isImageDataChunk || _imageDataChunkCount > 0;
+        case SDImageFormatGIF:
+            // A still GIF is only known at its trailer
+            return self.isAnimated;
+        case SDImageFormatWebP:
+            // The extended header has the animation flag, a simple WebP is a still image
+            return _pixelWidth > 0;
+        default:
+            return NO;
+    }
+}
+
+- (void)scanData:(nonnull NSData *)data {
+    [data enumerateByteRangesUsingBlock:^(const void * _Nonnull bytes, NSRange byteRange, BOOL * _Nonnull stop) {
+        [self scanBytes:bytes length:byteRange.length];
+    }];
+}
+
+- (void)scanBytes:(const uint8_t *)bytes length:(size_t)length {
+    size_t i = 0;
+    while (i < length && _state != SDWebImageDataScannerStateDone) {
+        switch (_state) {
+            case SDWebImageDataScannerStateSignature: {
+                _header[_headerLength++] = bytes[i++];
+                if (_headerLength == 1 && _header[0] == 'G') {
+                    // The GIF signature is followed by the logical screen descriptor
+                    [self readField:SDWebImageDataScannerFieldGIFScreenDescriptor length:13];
+                } else if (_headerLength == 1 && _header[0] == 'R') {
+                    [self readField:SDWebImageDataScannerFieldWebPFileHeader length:12];
+                } else if (_header[0] == 0xFF && _headerLength == 2) {
+                    // JPEG starts with SOI
+                    if (_header[1] == 0xD8) {
+                        _format = SDImageFormatJPEG;
+                        _state = SDWebImageDataScannerStateJPEGMarkerPrefix;
+                    } else {
+                        _state = SDWebImageDataScannerStateDone;
+                    }
+                    _headerLength = 0;
+                } else if (_header[0] == kPNGSignatureBytes[0] && _headerLength == sizeof(kPNGSignatureBytes)) {
+                    if (memcmp(_header, kPNGSignatureBytes, sizeof(kPNGSignatureBytes)) == 0) {
+                        _format = SDImageFormatPNG;
+                        _state = SDWebImageDataScannerStatePNGChunkHeader;
+                    } else {
+                        _state = SDWebImageDataScannerStateDone;
+                    }
+                    _headerLength = 0;
+                } else if (_header[0] != 0xFF && _header[0] != kPNGSignatureBytes[0]) {
+                    // Other formats are not known
+                    _state = SDWebImageDataScannerStateDone;
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateJPEGMarkerPrefix: {
+                // Ignore any garbage between segments
+                if (bytes[i++] == 0xFF) {
+                    _state = SDWebImageDataScannerStateJPEGMarker;
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateJPEGMarker: {
+                [self scanJPEGMarker:bytes[i++]];
+                break;
+            }
+            case SDWebImageDataScannerStateJPEGSegmentLength: {
+                _header[_headerLength++] = bytes[i++];
+                if (_headerLength == 2) {
+                    NSUInteger segmentLength = (_header[0] << 8) | _header[1];
+                    _headerLength = 0;
+                    if (SDIsJPEGFrameMarker(_marker) && segmentLength >= 2 + 5) {
+                        // The frame header starts with the precision, the height and the width
+                        _skipLength = segmentLength - 2 - 5;
+                        [self readField:SDWebImageDataScannerFieldJPEGFrameHeader length:5];
+                    } else {
+                        _skipLength = segmentLength > 2 ? segmentLength - 2 : 0;
+                        _state = SDWebImageDataScannerStateSkip;
+                    }
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateJPEGEntropyData: {
+                // Entropy coded data can only contain 0xFF as part of a marker or a stuffed byte
+                const uint8_t *found = memchr(bytes + i, 0xFF, length - i);
+                if (found) {
+                    i = found - bytes + 1;
+                    _state = SDWebImageDataScannerStateJPEGEntropyMarker;
+                } else {
+                    i = length;
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateJPEGEntropyMarker: {
+                uint8_t byte = bytes[i++];
+                if (byte == 0x00) {
+                    // stuffed byte
+                    _state = SDWebImageDataScannerStateJPEGEntropyData;
+                } else if (byte >= 0xD0 && byte <= 0xD7) {
+                    // RSTn, a new restart interval of rows begins
+                    _restartCount++;
+                    _state = SDWebImageDataScannerStateJPEGEntropyData;
+                } else if (byte != 0xFF) {
+                    // Any other marker ends the scan
+                    _scanCount++;
+                    [self scanJPEGMarker:byte];
+                }
+                break;
+            }
+            case SDWebImageDataScannerStatePNGChunkHeader: {
+                _header[_headerLength++] = bytes[i++];
+                if (_headerLength == 8) {
+                    NSUInteger chunkLength = SDReadBigEndian32(_header);
+                    _headerLength = 0;
+                    _isImageDataChunk = memcmp(_header + 4, "IDAT", 4) == 0;
+                    if (memcmp(_header + 4, "IEND", 4) == 0) {
+                        _state = SDWebImageDataScannerStateDone;
+                    } else if (memcmp(_header + 4, "IHDR", 4) == 0 && chunkLength >= 8) {
+                        // The width and the height, then the rest of the chunk data and CRC
+                        _skipLength = chunkLength - 8 + 4;
+                        [self readField:SDWebImageDataScannerFieldPNGImageHeader length:8];
+                    } else if (memcmp(_header + 4, "acTL", 4) == 0 && chunkLength >= 4) {
+                        // An animated PNG declares its frame count before the image data
+                        _skipLength = chunkLength - 4 + 4;
+                        [self readField:SDWebImageDataScannerFieldPNGAnimationControl length:4];
+                    } else {
+                        // Chunk data and CRC
+                        _skipLength = chunkLength + 4;
+                        _state = SDWebImageDataScannerStateSkip;
+                    }
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateGIFBlock: {
+                uint8_t byte = bytes[i++];
+                if (byte == 0x2C) {
+                    // Image descriptor, a new frame
+                    [self readField:SDWebImageDataScannerFieldGIFImageDescriptor length:9];
+                } else if (byte == 0x21) {
+                    // Extension, the label then the sub-blocks
+                    [self readField:SDWebImageDataScannerFieldGIFExtensionLabel length:1];
+                } else {
+                    // Trailer
+                    _state = SDWebImageDataScannerStateDone;
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateGIFSubBlockSize: {
+                uint8_t size = bytes[i++];
+                if (size == 0) {
+                    // Block terminator
+                    _state = SDWebImageDataScannerStateGIFBlock;
+                } else {
+                    _skipLength = size;
+                    _stateAfterSkip = SDWebImageDataScannerStateGIFSubBlockSize;
+                    _state = SDWebImageDataScannerStateSkip;
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateField: {
+                size_t readLength = MIN(_fieldLength - _headerLength, length - i);
+                memcpy(_header + _headerLength, bytes + i, readLength);
+                i += readLength;
+                _headerLength += readLength;
+                if (_headerLength == _fieldLength) {
+                    _headerLength = 0;
+                    [self didReadField];
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateSkip: {
+                size_t skipLength = MIN(_skipLength, length - i);
+                i += skipLength;
+                _skipLength -= skipLength;
+                if (_skipLength == 0) {
+                    [self didSkipSegment];
+                }
+                break;
+            }
+            case SDWebImageDataScannerStateDone:
+                break;
+        }
+    }
+    if (_state == SDWebImageDataScannerStateSkip && _skipLength == 0) {
+        [self didSkipSegment];
+    }
+}
+
+- (void)scanJPEGMarker:(uint8_t)marker {
+    if (marker == 0xFF) {
+        // fill byte, the marker follows
+        _state = SDWebImageDataScannerStateJPEGMarker;
+    } else if (marker == 0xD9) {
+        // EOI
+        _state = SDWebImageDataScannerStateDone;
+    } else if (marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+        // Standalone markers without length
+        _state = SDWebImageDataScannerStateJPEGMarkerPrefix;
+    } else {
+        // SOF2, SOF6, SOF10 and SOF14 are progressive
+        if (marker == 0xC2 || marker == 0xC6 || marker == 0xCA || marker == 0xCE) {
+            _isProgressiveJPEG = YES;
+        }
+        _marker = marker;
+        _state = SDWebImageDataScannerStateJPEGSegmentLength;
+    }
+}
+
+// The bytes already in the header count toward the length
+- (void)readField:(SDWebImageDataScannerField)field length:(NSUInteger)length {
+    _field = field;
+    _fieldLength = length;
+    _state = SDWebImageDataScannerStateField;
+}
+
+- (void)didReadField {
+    const uint8_t *header = _header;
+    switch (_field) {
+        case SDWebImageDataScannerFieldJPEGFrameHeader: {
+            _pixelHeight = (header[1] << 8) | header[2];
+            _pixelWidth = (header[3] << 8) | header[4];
+            _frameCount = 1;
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+        case SDWebImageDataScannerFieldPNGImageHeader: {
+            _pixelWidth = SDReadBigEndian32(header);
+            _pixelHeight = SDReadBigEndian32(header + 4);
+            _frameCount = MAX(_frameCount, 1);
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+        case SDWebImageDataScannerFieldPNGAnimationControl: {
+            _isAnimatedPNG = YES;
+            _frameCount = MAX(SDReadBigEndian32(header), 1);
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+        case SDWebImageDataScannerFieldGIFScreenDescriptor: {
+            if (memcmp(header, "GIF8", 4) != 0) {
+                _state = SDWebImageDataScannerStateDone;
+                break;
+            }
+            _format = SDImageFormatGIF;
+            _pixelWidth = SDReadLittleEndian16(header + 6);
+            _pixelHeight = SDReadLittleEndian16(header + 8);
+            // The global color table follows if any
+            uint8_t flags = header[10];
+            _skipLength = (flags & 0x80) ? 3 << ((flags & 0x07) + 1) : 0;
+            _stateAfterSkip = SDWebImageDataScannerStateGIFBlock;
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+        case SDWebImageDataScannerFieldGIFImageDescriptor: {
+            _frameCount++;
+            // The local color table if any and the LZW minimum code size, then the image data sub-blocks
+            uint8_t flags = header[8];
+            _skipLength = ((flags & 0x80) ? 3 << ((flags & 0x07) + 1) : 0) + 1;
+            _stateAfterSkip = SDWebImageDataScannerStateGIFSubBlockSize;
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+        case SDWebImageDataScannerFieldGIFExtensionLabel: {
+            if (header[0] == 0xFF) {
+                // Application extension, its first sub-block is the 11 bytes identifier
+                [self readField:SDWebImageDataScannerFieldGIFApplicationIdentifier length:12];
+            } else {
+                _state = SDWebImageDataScannerStateGIFSubBlockSize;
+            }
+            break;
+        }
+        case SDWebImageDataScannerFieldGIFApplicationIdentifier: {
+            // The looping extension comes before the second frame
+            if (header[0] == 11 && memcmp(header + 1, "NETSCAPE2.0", 11) == 0) {
+                _isLoopingGIF = YES;
+            }
+            _state = SDWebImageDataScannerStateGIFSubBlockSize;
+            break;
+        }
+        case SDWebImageDataScannerFieldWebPFileHeader: {
+            if (memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WEBP", 4) != 0) {
+                _state = SDWebImageDataScannerStateDone;
+                break;
+            }
+            _format = SDImageFormatWebP;
+            [self readField:SDWebImageDataScannerFieldWebPChunkHeader length:8];
+            break;
+        }
+        case SDWebImageDataScannerFieldWebPChunkHeader: {
+            uint32_t chunkLength = SDReadLittleEndian32(header + 4);
+            // Chunks are padded to an even size
+            NSUInteger paddedLength = (NSUInteger)chunkLength + (chunkLength & 1);
+            SDWebImageDataScannerField field = _field;
+            NSUInteger fieldLength = 0;
+            if (memcmp(header, "VP8 ", 4) == 0) {
+                field = SDWebImageDataScannerFieldWebPLossyHeader;
+                fieldLength = 10;
+            } else if (memcmp(header, "VP8L", 4) == 0) {
+                field = SDWebImageDataScannerFieldWebPLosslessHeader;
+                fieldLength = 5;
+            } else if (memcmp(header, "VP8X", 4) == 0) {
+                field = SDWebImageDataScannerFieldWebPExtendedHeader;
+                fieldLength = 10;
+            } else if (memcmp(header, "ANMF", 4) == 0) {
+                _frameCount++;
+            }
+            if (fieldLength > 0 && paddedLength >= fieldLength) {
+                _skipLength = paddedLength - fieldLength;
+                [self readField:field length:fieldLength];
+            } else {
+                _skipLength = paddedLength;
+                _state = SDWebImageDataScannerStateSkip;
+            }
+            break;
+        }
+        case SDWebImageDataScannerFieldWebPLossyHeader: {
+            // The frame tag, then the start code and the 14 bits dimensions
+            if (_pixelWidth == 0 && header[3] == 0x9D && header[4] == 0x01 && header[5] == 0x2A) {
+                _pixelWidth = SDReadLittleEndian16(header + 6) & 0x3FFF;
+                _pixelHeight = SDReadLittleEndian16(header + 8) & 0x3FFF;
+                _frameCount = 1;
+            }
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+        case SDWebImageDataScannerFieldWebPLosslessHeader: {
+            // The signature, then the 14 bits dimensions minus one
+            if (_pixelWidth == 0 && header[0] == 0x2F) {
+                uint32_t bits = SDReadLittleEndian32(header + 1);
+                _pixelWidth = (bits & 0x3FFF) + 1;
+                _pixelHeight = ((bits >> 14) & 0x3FFF) + 1;
+                _frameCount = 1;
+            }
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+        case SDWebImageDataScannerFieldWebPExtendedHeader: {
+            // The flags, then the 24 bits canvas dimensions minus one
+            _isAnimatedWebP = (header[0] & 0x02) != 0;
+            _pixelWidth = SDReadLittleEndian24(header + 4) + 1;
+            _pixelHeight = SDReadLittleEndian24(header + 7) + 1;
+            _frameCount = _isAnimatedWebP ? 0 : 1;
+            _state = SDWebImageDataScannerStateSkip;
+            break;
+        }
+    }
+}
+
+- (void)didSkipSegment {
+    if (_format == SDImageFormatPNG) {
+        if (_isImageDataChunk) {
+            _imageDataChunkCount++;
+        }
+        _state = SDWebImageDataScannerStatePNGChunkHeader;
+    } else if (_format == SDImageFormatGIF) {
+        _state = _stateAfterSkip;
+    } else if (_format == SDImageFormatWebP) {
+        // The next chunk header
+        [self readField:SDWebImageDataScannerFieldWebPChunkHeader length:8];
+    } else if (_marker == 0xDA) {
+        // The SOS header is followed by the entropy coded data of the scan
+        _state = SDWebImageDataScannerStateJPEGEntropyData;
+    } else {
+        _state = SDWebImageDataScannerStateJPEGMarkerPrefix;
+    }
+}
+
+@end
@@ -20,3 +20,31 @@ FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextSetIma
  A SDWebImageManager instance to control the image download and cache process using in UIImageView+WebCache category and likes. If not provided, use the shared manager (SDWebImageManager)
  */
 FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextCustomManager;
+/**
+ A CGSize raw value which specify the maximum pixel size the image should be cached and returned at, keeping the aspect ratio. Different pixel sizes of the same URL are cached as separate entries, and a smaller one can be derived from a larger cached one without network. If not provided or zero, the full size image is used. (NSValue)
+ */
+FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextImageThumbnailPixelSize;
+/**
+ A directory the downloader writes the body of a large response to as it arrives, instead of keeping it in memory, see `-[SDWebImageDownloader diskStreamingThreshold]`. The file is named and owned by the download, which may be shared by several requests, and is removed once the completion blocks have been called. A completion block may link it from `-[SDWebImageDownloadToken downloadFilePath]` to keep it, such as to move it into the disk cache. If not provided, the temporary directory is used. (NSString)
+ */
+FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextDownloadDirectory;
+/**
+ The maximum number of pixels, of all the frames together, the downloaded image may decode to. The pixel size and the frame count are read from the first bytes of the body, and the download is aborted with `SDWebImageErrorPixelBudgetExceeded` as soon as the image is known to exceed the budget, unless `SDWebImageDownloaderScaleDownLargeImages` is set and the image is a still one, which is then decoded downsampled to fit the budget. If not provided or zero, there is no budget. (NSNumber)
+ */
+FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextImagePixelBudget;
+/**
+ A transformer applied to the loaded image, see `SDWebImageTransformer`. The transformed image is cached under its own key, see `SDTransformedKeyForKey`, so that a transformed image in the cache skips both the download and the transform. It takes precedence over `-[SDWebImageManagerDelegate imageManager:transformDownloadedImage:withURL:]`. (id<SDWebImageTransformer>)
+ */
+FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextImageTransformer;
+/**
+ Whether the original image downloaded for `SDWebImageContextImageTransformer` is also stored under its own key, on disk only, so that other transformers can be applied to it without network. If not provided, defaults to YES. (NSNumber)
+ */
+FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextStoreOriginalImage;
+/**
+ The group of the load, so that the loads of one group, such as the loads of a prefetcher or of a screen, are cancelled together with `-[SDWebImageManager cancelOperationsInGroup:]`. (NSString)
+ */
+FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextOperationGroup;
+/**
+ The identifier of the timeline of the load in `SDWebImageTracer`. The manager sets a new one for each load while the tracing is enabled, pass one to trace several loads as one. (NSNumber)
+ */
+FOUNDATION_EXPORT SDWebImageContextOption _Nonnull const SDWebImageContextTraceIdentifier;
@@ -10,3 +10,10 @@
 
 SDWebImageContextOption const SDWebImageContextSetImageGroup = @"setImageGroup";
 SDWebImageContextOption const SDWebImageContextCustomManager = @"customManager";
+SDWebImageContextOption const SDWebImageContextImageThumbnailPixelSize = @"imageThumbnailPixelSize";
+SDWebImageContextOption const SDWebImageContextDownloadDirectory = @"downloadDirectory";
+SDWebImageContextOption const SDWebImageContextImagePixelBudget = @"imagePixelBudget";
+SDWebImageContextOption const SDWebImageContextImageTransformer = @"imageTransformer";
+SDWebImageContextOption const SDWebImageContextStoreOriginalImage = @"storeOriginalImage";
+SDWebImageContextOption const SDWebImageContextOperationGroup = @"operationGroup";
+SDWebImageContextOption const SDWebImageContextTraceIdentifier = @"traceIdentifier";
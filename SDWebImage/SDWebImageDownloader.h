@@ -10,6 +10,8 @@
 #import "SDWebImageCompat.h"
 #import "SDWebImageDefine.h"
 #import "SDWebImageOperation.h"
+#import "SDWebImageDownloaderConcurrencyController.h"
+#import "SDWebImageMetadata.h"
 
 typedef NS_OPTIONS(NSUInteger, SDWebImageDownloaderOptions) {
     SDWebImageDownloaderLowPriority = 1 << 0,
@@ -54,8 +56,36 @@ typedef NS_OPTIONS(NSUInteger, SDWebImageDownloaderOptions) {
      * Scale down the image
      */
     SDWebImageDownloaderScaleDownLargeImages = 1 << 8,
+    
+    /**
+     * Among the pending downloads of the same priority, start this one before those added earlier (last-in-first-out),
+     * whatever `executionOrder` is. Useful for the images currently visible.
+     */
+    SDWebImageDownloaderLIFOExecution = 1 << 9,
+    
+    /**
+     * Among the pending downloads of the same priority, start this one after those added earlier (first-in-first-out),
+     * whatever `executionOrder` is. Useful for prefetching.
+     * @note At the same priority, the last-in-first-out downloads start before the first-in-first-out ones.
+     */
+    SDWebImageDownloaderFIFOExecution = 1 << 10,
 };
 
+@class SDWebImageDownloader;
+@class SDWebImageDownloaderMetrics;
+
+@protocol SDWebImageDownloaderMetricsDelegate <NSObject>
+
+/**
+ * Called on the main queue for each download which delivered its image or its error.
+ *
+ * @param downloader The downloader
+ * @param metrics    The timings of the download, per phase
+ */
+- (void)imageDownloader:(nonnull SDWebImageDownloader *)downloader didCollectMetrics:(nonnull SDWebImageDownloaderMetrics *)metrics;
+
+@end
+
 typedef NS_ENUM(NSInteger, SDWebImageDownloaderExecutionOrder) {
     /**
      * Default value. All download operations will execute in queue style (first-in-first-out).
@@ -80,6 +110,10 @@ typedef NSMutableDictionary<NSString *, NSString *> SDHTTPHeadersMutableDictiona
 
 typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterBlock)(NSURL * _Nullable url, SDHTTPHeadersDictionary * _Nullable headers);
 
+typedef NSString * _Nullable (^SDWebImageDownloaderCoalescingKeyFilterBlock)(NSURL * _Nonnull url);
+
+typedef void(^SDWebImageMetadataCompletedBlock)(SDWebImageMetadata * _Nullable metadata, NSError * _Nullable error);
+
 /**
  *  A token associated with each download. Can be used to cancel a download
  */
@@ -94,6 +128,17 @@ typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterB
  @note use `-[SDWebImageDownloadToken cancel]` to cancel the token
  */
 @property (nonatomic, strong, nullable) id downloadOperationCancelToken;
+/**
+ The file the body of the download is written to, see `-[SDWebImageDownloaderOperation downloadFilePath]`. The download may be shared with other tokens, link the file from the completion block to keep it
+ */
+@property (nonatomic, copy, readonly, nullable) NSString *downloadFilePath;
+
+/**
+ * Changes the priority of the download, for example when its image becomes visible again.
+ * @note the download is shared by the tokens of the same URL and takes the priority set last
+ * @see -[SDWebImageDownloader setPriority:forToken:]
+ */
+- (void)setPriority:(NSOperationQueuePriority)priority;
 
 @end
 
@@ -109,11 +154,82 @@ typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterB
  */
 @property (assign, nonatomic) BOOL shouldDecompressImages;
 
+/**
+ * The minimum time interval between two progress block calls of a download while receiving the data, in seconds. The last chunk is always notified.
+ * Defaults to 0.05.
+ */
+@property (assign, nonatomic) NSTimeInterval minimumProgressInterval;
+
+/**
+ * The minimum time interval between two progressive decodes of a download with `SDWebImageDownloaderProgressiveDownload`, in seconds.
+ * Defaults to 0.1.
+ */
+@property (assign, nonatomic) NSTimeInterval minimumProgressiveDecodeInterval;
+
+/**
+ * The minimum number of bytes received since the previous progressive decode of a download to decode again.
+ * Defaults to 32 KB.
+ */
+@property (assign, nonatomic) NSUInteger minimumProgressiveDecodeBytes;
+
+/**
+ * The maximum total size of the partially received bodies kept on disk to resume the downloads cancelled or failed midway.
+ * Defaults to 20 MB. Set to 0 to always download from the start.
+ * @see -[SDWebImageDownloaderOperation maxPartialDataCacheSize]
+ */
+@property (assign, nonatomic) NSUInteger maxPartialDataCacheSize;
+
+/**
+ * The expected size from which a response body is written to a file as it arrives, instead of being kept in memory, and the image decoded from the file mapped in memory.
+ * `SDWebImageManager` has the file written in the disk cache's directory and moves it into the cache once the download succeeded.
+ * Defaults to 8 MB. Set to 0 to always keep the body in memory.
+ * @see -[SDWebImageDownloaderOperation diskStreamingThreshold]
+ */
+@property (assign, nonatomic) NSUInteger diskStreamingThreshold;
+
 /**
  *  The maximum number of concurrent downloads
  */
 @property (assign, nonatomic) NSInteger maxConcurrentDownloads;
 
+/**
+ * The controller adjusting `maxConcurrentDownloads` from the observed network conditions.
+ * When set, the downloader adds a sample of each finished download to it and follows its `currentLimit`.
+ * Defaults to nil, which means `maxConcurrentDownloads` stays as set.
+ */
+@property (strong, nonatomic, nullable) SDWebImageDownloaderConcurrencyController *concurrencyController;
+
+/**
+ * The delegate receiving the timings of each download, such as the time waited for a slot, the network phases, the decode and the delivery.
+ */
+@property (weak, nonatomic, nullable) id<SDWebImageDownloaderMetricsDelegate> metricsDelegate;
+
+/**
+ * The memory budget of the downloads, in bytes: the bodies buffered in memory, counted at `inFlightBytesEstimate` until the response and at their expected size from the response on, until they have been decoded.
+ * A waiting download is admitted only while the downloads running use less than the budget, but one download is always admitted so that a body larger than the budget still completes.
+ * The bodies streamed to a file, see `diskStreamingThreshold`, do not count.
+ * Defaults to 0, which means no budget.
+ */
+@property (assign, nonatomic) NSUInteger maxInFlightBytes;
+
+/**
+ * The bytes counted against `maxInFlightBytes` for an admitted download until its response tells the expected size.
+ * Defaults to 512 KB.
+ */
+@property (assign, nonatomic) NSUInteger inFlightBytesEstimate;
+
+/**
+ * The bytes of the running downloads counted against `maxInFlightBytes`.
+ */
+@property (assign, nonatomic, readonly) NSUInteger currentInFlightBytes;
+
+/**
+ * The maximum number of concurrent downloads to the same host, for the hosts without a limit set by `setMaxConcurrentDownloads:forHostPattern:`.
+ * Defaults to 0, which means no limit other than `maxConcurrentDownloads`.
+ * @note The waiting downloads are admitted by turns across hosts, so that the downloads to a slow host can not take all the slots.
+ */
+@property (assign, nonatomic) NSInteger maxConcurrentDownloadsPerHost;
+
 /**
  * Shows the current amount of downloads that still need to be downloaded
  */
@@ -124,6 +240,18 @@ typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterB
  */
 @property (assign, nonatomic) NSTimeInterval downloadTimeout;
 
+/**
+ * The number of bytes a probe requests from the start of the image, see `probeImageWithURL:completed:`.
+ * The pixel size comes within the first few hundred bytes of most images, but a JPEG may have large EXIF metadata before it, and a still GIF is only known at its end.
+ * Defaults to 16 KB.
+ */
+@property (assign, nonatomic) NSUInteger probeSize;
+
+/**
+ * The metadata of the images probed, by URL. Defaults to a cache of 500 entries.
+ */
+@property (strong, nonatomic, nonnull, readonly) NSCache<NSURL *, SDWebImageMetadata *> *metadataCache;
+
 /**
  * The configuration in use by the internal NSURLSession.
  * Mutating this object directly has no effect.
@@ -168,6 +296,25 @@ typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterB
  */
 @property (nonatomic, copy, nullable) SDWebImageDownloaderHeadersFilterBlock headersFilter;
 
+/**
+ * Set filter to pick the key by which the concurrent downloads are coalesced.
+ *
+ * By default only the downloads of equal URLs share one transfer and one decode. This block maps the URLs which
+ * lead to the same image to the same key, for example by stripping tracking or signature query parameters the same
+ * way as `-[SDWebImageManager cacheKeyFilter]`. Return nil to coalesce by URL.
+ * The shared download requests the URL of the first download of the key, and reports it to the progress blocks.
+ * The downloads with different `SDWebImageContextImagePixelBudget` are never shared.
+ *
+ * @code
+
+[[SDWebImageDownloader sharedDownloader] setCoalescingKeyFilter:^NSString *(NSURL *url) {
+    return [[SDWebImageManager sharedManager] cacheKeyForURL:url];
+}];
+
+ * @endcode
+ */
+@property (nonatomic, copy, nullable) SDWebImageDownloaderCoalescingKeyFilterBlock coalescingKeyFilter;
+
 /**
  * Creates an instance of a downloader with specified session configuration.
  * @note `timeoutIntervalForRequest` is going to be overwritten.
@@ -190,6 +337,22 @@ typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterB
  */
 - (nullable NSString *)valueForHTTPHeaderField:(nullable NSString *)field;
 
+/**
+ * Sets the maximum number of concurrent downloads to the hosts matching a pattern.
+ *
+ * @param maxConcurrentDownloads The maximum number of concurrent downloads for each matching host, 0 removes the limit set for the pattern
+ * @param hostPattern            A host name such as `images.example.com`, or a wildcard pattern such as `*.example.com` which matches `example.com` and all its subdomains.
+ *                               The exact host name takes precedence over the longest matching wildcard.
+ */
+- (void)setMaxConcurrentDownloads:(NSInteger)maxConcurrentDownloads forHostPattern:(nonnull NSString *)hostPattern;
+
+/**
+ * Returns the maximum number of concurrent downloads to a host, 0 means no limit.
+ *
+ * @param host The host name
+ */
+- (NSInteger)maxConcurrentDownloadsForHost:(nullable NSString *)host;
+
 /**
  * Sets a subclass of `SDWebImageDownloaderOperation` as the default
  * `NSOperation` to be used each time SDWebImage constructs a request
@@ -249,6 +412,20 @@ typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterB
                                                  completed:(nullable SDWebImageDownloaderCompletedBlock)completedBlock
                                                    context:(nullable SDWebImageContext *)context;
 
+/**
+ * Reads the format, the pixel size, the orientation and whether the image is animated from its header, without downloading the image.
+ * This requests the first `probeSize` bytes with a `Range` header, and completes as soon as the pixel size and whether the image is animated are known, cancelling the rest of the request.
+ * If the animation is still not known after `probeSize` bytes, the metadata reports the image as still.
+ * The metadata is kept in `metadataCache`, so that probing the same URL again does not hit the network.
+ * The probes do not wait for the download queue.
+ *
+ * @param url            The URL to the image to probe
+ * @param completedBlock A block called on the main queue once the metadata is read, or with an error. Not called once the probe has been cancelled
+ *
+ * @return An operation to cancel the probe, or nil if the metadata was cached
+ */
+- (nullable id<SDWebImageOperation>)probeImageWithURL:(nullable NSURL *)url completed:(nullable SDWebImageMetadataCompletedBlock)completedBlock;
+
 /**
  * Cancels a download that was previously queued using -downloadImageWithURL:options:progress:completed:
  *
@@ -256,6 +433,15 @@ typedef SDHTTPHeadersDictionary * _Nullable (^SDWebImageDownloaderHeadersFilterB
  */
 - (void)cancel:(nullable SDWebImageDownloadToken *)token;
 
+/**
+ * Changes the priority of a download that was previously queued using -downloadImageWithURL:options:progress:completed:
+ * A download waiting for its turn is reordered at once, in O(log n) of the pending downloads of its host.
+ *
+ * @param priority The new priority
+ * @param token    The token received from -downloadImageWithURL:options:progress:completed:
+ */
+- (void)setPriority:(NSOperationQueuePriority)priority forToken:(nullable SDWebImageDownloadToken *)token;
+
 /**
  * Sets the download queue suspension state
  */
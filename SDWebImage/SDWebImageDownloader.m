@@ -8,40 +8,261 @@
 
 #import "SDWebImageDownloader.h"
 #import "SDWebImageDownloaderOperation.h"
+#import "SDWebImageTracer.h"
+#import "SDWebImageDataScanner.h"
 
 #define LOCK(lock) dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
 #define UNLOCK(lock) dispatch_semaphore_signal(lock);
 
+// The timing of one download, from its admission to the download queue
+@interface SDWebImageDownloadSample : NSObject
+
+@property (assign, nonatomic) NSTimeInterval startTime;
+@property (assign, nonatomic) NSTimeInterval timeToFirstByte;
+
+@end
+
+@implementation SDWebImageDownloadSample
+@end
+
+// A download waiting for its turn, with the ordering keys of the pending queue
+@interface SDWebImageDownloaderPendingEntry : NSObject
+
+@property (strong, nonatomic, nonnull) SDWebImageDownloaderOperation *operation;
+@property (copy, nonatomic, nonnull) NSString *host;
+@property (assign, nonatomic) NSOperationQueuePriority priority;
+@property (assign, nonatomic) BOOL lastInFirstOut;
+@property (assign, nonatomic) BOOL cancelled;
+@property (assign, nonatomic) NSUInteger sequence;
+@property (assign, nonatomic) NSUInteger heapIndex;
+
+@end
+
+@implementation SDWebImageDownloaderPendingEntry
+@end
+
+// A binary heap of the pending downloads of one host. The cancelled entries come first since they finish at once, then the higher priorities, then at the same priority the LIFO entries (newest first) before the FIFO entries (oldest first)
+@interface SDWebImageDownloaderPendingQueue : NSObject
+
+@property (assign, nonatomic, readonly) NSUInteger count;
+@property (strong, nonatomic, readonly, nullable) SDWebImageDownloaderPendingEntry *firstEntry;
+
+- (void)addEntry:(nonnull SDWebImageDownloaderPendingEntry *)entry;
+- (void)removeEntry:(nonnull SDWebImageDownloaderPendingEntry *)entry;
+// Call after changing the ordering keys of an entry
+- (void)updateEntry:(nonnull SDWebImageDownloaderPendingEntry *)entry;
+
+@end
+
+@implementation SDWebImageDownloaderPendingQueue {
+    NSMutableArray<SDWebImageDownloaderPendingEntry *> *_heap;
+}
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _heap = [NSMutableArray array];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    return _heap.count;
+}
+
+- (SDWebImageDownloaderPendingEntry *)firstEntry {
+    return _heap.firstObject;
+}
+
+static inline BOOL SDPendingEntryPrecedes(SDWebImageDownloaderPendingEntry *entry, SDWebImageDownloaderPendingEntry *otherEntry) {
+    if (entry.cancelled != otherEntry.cancelled) {
+        return entry.cancelled;
+    }
+    if (entry.priority != otherEntry.priority) {
+        return entry.priority > otherEntry.priority;
+    }
+    if (entry.lastInFirstOut != otherEntry.lastInFirstOut) {
+        return entry.lastInFirstOut;
+    }
+    return entry.lastInFirstOut ? entry.sequence > otherEntry.sequence : entry.sequence < otherEntry.sequence;
+}
+
+- (void)swapEntryAtIndex:(NSUInteger)index withEntryAtIndex:(NSUInteger)otherIndex {
+    [_heap exchangeObjectAtIndex:index withObjectAtIndex:otherIndex];
+    _heap[index].heapIndex = index;
+    _heap[otherIndex].heapIndex = otherIndex;
+}
+
+- (void)siftUpFromIndex:(NSUInteger)index {
+    while (index > 0) {
+        NSUInteger parentIndex = (index - 1) / 2;
+        if (!SDPendingEntryPrecedes(_heap[index], _heap[parentIndex])) {
+            break;
+        }
+        [self swapEntryAtIndex:index withEntryAtIndex:parentIndex];
+        index = parentIndex;
+    }
+}
+
+- (void)siftDownFromIndex:(NSUInteger)index {
+    NSUInteger count = _heap.count;
+    while (YES) {
+        NSUInteger firstIndex = index;
+        NSUInteger leftIndex = index * 2 + 1;
+        NSUInteger rightIndex = leftIndex + 1;
+        if (leftIndex < count && SDPendingEntryPrecedes(_heap[leftIndex], _heap[firstIndex])) {
+            firstIndex = leftIndex;
+        }
+        if (rightIndex < count && SDPendingEntryPrecedes(_heap[rightIndex], _heap[firstIndex])) {
+            firstIndex = rightIndex;
+        }
+        if (firstIndex == index) {
+            break;
+        }
+        [self swapEntryAtIndex:index withEntryAtIndex:firstIndex];
+        index = firstIndex;
+    }
+}
+
+- (void)addEntry:(nonnull SDWebImageDownloaderPendingEntry *)entry {
+    entry.heapIndex = _heap.count;
+    [_heap addObject:entry];
+    [self siftUpFromIndex:entry.heapIndex];
+}
+
+- (void)removeEntry:(nonnull SDWebImageDownloaderPendingEntry *)entry {
+    NSUInteger index = entry.heapIndex;
+    if (index >= _heap.count || _heap[index] != entry) {
+        return;
+    }
+    NSUInteger lastIndex = _heap.count - 1;
+    if (index != lastIndex) {
+        [self swapEntryAtIndex:index withEntryAtIndex:lastIndex];
+    }
+    [_heap removeLastObject];
+    if (index < _heap.count) {
+        [self updateEntry:_heap[index]];
+    }
+}
+
+- (void)updateEntry:(nonnull SDWebImageDownloaderPendingEntry *)entry {
+    NSUInteger index = entry.heapIndex;
+    if (index >= _heap.count || _heap[index] != entry) {
+        return;
+    }
+    [self siftUpFromIndex:index];
+    [self siftDownFromIndex:entry.heapIndex];
+}
+
+@end
+
+// A request of the first bytes of an image, run by the session of the downloader outside of the download queue
+@interface SDWebImageDownloaderProbe : NSObject <SDWebImageOperation>
+
+@property (strong, nonatomic, nonnull) NSURL *url;
+@property (strong, nonatomic, nullable) NSURLSessionTask *dataTask;
+@property (copy, nonatomic, nullable) SDWebImageMetadataCompletedBlock completedBlock;
+@property (assign, nonatomic) NSUInteger probeSize;
+// Only accessed on the delegate queue
+@property (strong, nonatomic, nonnull) NSMutableData *data;
+@property (strong, nonatomic, nonnull) SDWebImageDataScanner *dataScanner; // scans the data as it comes, to know when the header has been read
+@property (assign, nonatomic, getter = isFinished) BOOL finished;
+@property (assign, atomic, getter = isCancelled) BOOL cancelled;
+
+@end
+
+@implementation SDWebImageDownloaderProbe
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _data = [NSMutableData new];
+        _dataScanner = [SDWebImageDataScanner new];
+    }
+    return self;
+}
+
+- (void)cancel {
+    self.cancelled = YES;
+    [self.dataTask cancel];
+}
+
+@end
+
+static inline NSString * _Nonnull SDHostForURL(NSURL * _Nullable url) {
+    return url.host.lowercaseString ?: @"";
+}
+
+@interface SDWebImageDownloader ()
+
+- (void)didCancelOperation:(nonnull NSOperation *)operation;
+
+@end
+
 @interface SDWebImageDownloadToken ()
 
 @property (nonatomic, weak, nullable) NSOperation<SDWebImageDownloaderOperationInterface> *downloadOperation;
+@property (nonatomic, weak, nullable) SDWebImageDownloader *downloader;
+@property (nonatomic, strong, nullable) id<NSCopying> operationKey; // the key of the download in `URLOperations`
 
 @end
 
 @implementation SDWebImageDownloadToken
 
 - (void)cancel {
-    if (self.downloadOperation) {
+    NSOperation<SDWebImageDownloaderOperationInterface> *downloadOperation = self.downloadOperation;
+    if (downloadOperation) {
         SDWebImageDownloadToken *cancelToken = self.downloadOperationCancelToken;
-        if (cancelToken) {
-            [self.downloadOperation cancel:cancelToken];
+        if (cancelToken && [downloadOperation cancel:cancelToken]) {
+            [self.downloader didCancelOperation:downloadOperation];
         }
     }
 }
 
+- (void)setPriority:(NSOperationQueuePriority)priority {
+    [self.downloader setPriority:priority forToken:self];
+}
+
+- (nullable NSString *)downloadFilePath {
+    NSOperation<SDWebImageDownloaderOperationInterface> *downloadOperation = self.downloadOperation;
+    if (![downloadOperation respondsToSelector:@selector(downloadFilePath)]) {
+        return nil;
+    }
+    return ((SDWebImageDownloaderOperation *)downloadOperation).downloadFilePath;
+}
+
 @end
 
 
 @interface SDWebImageDownloader () <NSURLSessionTaskDelegate, NSURLSessionDataDelegate>
 
 @property (strong, nonatomic, nonnull) NSOperationQueue *downloadQueue;
-@property (weak, nonatomic, nullable) NSOperation *lastAddedOperation;
 @property (assign, nonatomic, nullable) Class operationClass;
-@property (strong, nonatomic, nonnull) NSMutableDictionary<NSURL *, SDWebImageDownloaderOperation *> *URLOperations;
+@property (strong, nonatomic, nonnull) NSMutableDictionary<id<NSCopying>, SDWebImageDownloaderOperation *> *URLOperations; // by URL, or by coalescing key
 @property (strong, nonatomic, nullable) SDHTTPHeadersMutableDictionary *HTTPHeaders;
+@property (strong, nonatomic, nonnull) NSMapTable<NSNumber *, SDWebImageDownloaderOperation *> *taskOperations; // task identifier to the operation running it, the operation is weakly referenced
 @property (strong, nonatomic, nonnull) dispatch_semaphore_t operationsLock; // a lock to keep the access to `URLOperations` thread-safe
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSNumber *, SDWebImageDownloaderProbe *> *taskProbes; // task identifier to the probe running it
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t taskOperationsLock; // a lock to keep the access to `taskOperations` and `taskProbes` thread-safe
+@property (strong, nonatomic, nonnull, readwrite) NSCache<NSURL *, SDWebImageMetadata *> *metadataCache;
 @property (strong, nonatomic, nonnull) dispatch_semaphore_t headersLock; // a lock to keep the access to `HTTPHeaders` thread-safe
 
+// The operations waiting for admission to the download queue, by host, and the hosts in the order they take turns
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSString *, SDWebImageDownloaderPendingQueue *> *pendingQueues;
+@property (strong, nonatomic, nonnull) NSMapTable<NSOperation *, SDWebImageDownloaderPendingEntry *> *pendingEntries;
+@property (strong, nonatomic, nonnull) NSMutableArray<NSString *> *pendingHosts;
+@property (assign, nonatomic) NSUInteger pendingSequence;
+@property (assign, nonatomic) NSUInteger nextHostIndex;
+// The admitted operations not finished yet, in total and by host
+@property (assign, nonatomic) NSUInteger runningOperationCount;
+@property (assign, nonatomic) int64_t inFlightBytes;
+@property (strong, nonatomic, nonnull) NSHashTable<NSOperation *> *estimatedOperations; // the admitted operations counted at `inFlightBytesEstimate`, until their response
+@property (strong, nonatomic, nonnull) NSCountedSet<NSString *> *runningHosts;
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSString *, NSNumber *> *hostPatternLimits;
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSString *, NSNumber *> *hostLimits; // the limits resolved from the patterns for each host
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t schedulerLock; // a lock to keep the access to the pending and running operations thread-safe
+// The samples of the running downloads for the concurrency controller
+@property (strong, nonatomic, nonnull) NSMapTable<NSOperation *, SDWebImageDownloadSample *> *downloadSamples;
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t downloadSamplesLock; // a lock to keep the access to `downloadSamples` thread-safe
+
 // The session in which data tasks will run
 @property (strong, nonatomic) NSURLSession *session;
 
@@ -94,14 +315,36 @@
         _downloadQueue.maxConcurrentOperationCount = 6;
         _downloadQueue.name = @"com.hackemist.SDWebImageDownloader";
         _URLOperations = [NSMutableDictionary new];
+        _taskOperations = [NSMapTable strongToWeakObjectsMapTable];
+        _taskProbes = [NSMutableDictionary new];
+        _metadataCache = [NSCache new];
+        _metadataCache.countLimit = 500;
+        _probeSize = 16 * 1024;
 #ifdef SD_WEBP
         _HTTPHeaders = [@{@"Accept": @"image/webp,image/*;q=0.8"} mutableCopy];
 #else
         _HTTPHeaders = [@{@"Accept": @"image/*;q=0.8"} mutableCopy];
 #endif
         _operationsLock = dispatch_semaphore_create(1);
+        _taskOperationsLock = dispatch_semaphore_create(1);
         _headersLock = dispatch_semaphore_create(1);
+        _pendingQueues = [NSMutableDictionary new];
+        _pendingEntries = [NSMapTable strongToStrongObjectsMapTable];
+        _pendingHosts = [NSMutableArray new];
+        _runningHosts = [NSCountedSet new];
+        _estimatedOperations = [NSHashTable weakObjectsHashTable];
+        _inFlightBytesEstimate = 512 * 1024;
+        _hostPatternLimits = [NSMutableDictionary new];
+        _hostLimits = [NSMutableDictionary new];
+        _schedulerLock = dispatch_semaphore_create(1);
+        _downloadSamples = [NSMapTable weakToStrongObjectsMapTable];
+        _downloadSamplesLock = dispatch_semaphore_create(1);
         _downloadTimeout = 15.0;
+        _minimumProgressInterval = 0.05;
+        _minimumProgressiveDecodeInterval = 0.1;
+        _minimumProgressiveDecodeBytes = 32 * 1024;
+        _maxPartialDataCacheSize = 20 * 1024 * 1024;
+        _diskStreamingThreshold = 8 * 1024 * 1024;
 
         [self createNewSessionWithConfiguration:sessionConfiguration];
     }
@@ -171,10 +414,69 @@
 
 - (void)setMaxConcurrentDownloads:(NSInteger)maxConcurrentDownloads {
     _downloadQueue.maxConcurrentOperationCount = maxConcurrentDownloads;
+    [self admitPendingOperations];
+}
+
+- (void)setConcurrencyController:(SDWebImageDownloaderConcurrencyController *)concurrencyController {
+    _concurrencyController = concurrencyController;
+    if (concurrencyController) {
+        self.maxConcurrentDownloads = concurrencyController.currentLimit;
+    }
+}
+
+- (void)setMaxConcurrentDownloadsPerHost:(NSInteger)maxConcurrentDownloadsPerHost {
+    LOCK(self.schedulerLock);
+    _maxConcurrentDownloadsPerHost = maxConcurrentDownloadsPerHost;
+    [self.hostLimits removeAllObjects];
+    UNLOCK(self.schedulerLock);
+    [self admitPendingOperations];
+}
+
+- (void)setMaxConcurrentDownloads:(NSInteger)maxConcurrentDownloads forHostPattern:(nonnull NSString *)hostPattern {
+    LOCK(self.schedulerLock);
+    if (maxConcurrentDownloads > 0) {
+        self.hostPatternLimits[hostPattern.lowercaseString] = @(maxConcurrentDownloads);
+    } else {
+        [self.hostPatternLimits removeObjectForKey:hostPattern.lowercaseString];
+    }
+    [self.hostLimits removeAllObjects];
+    UNLOCK(self.schedulerLock);
+    [self admitPendingOperations];
+}
+
+- (NSInteger)maxConcurrentDownloadsForHost:(nullable NSString *)host {
+    LOCK(self.schedulerLock);
+    NSInteger limit = [self limitForHost:host.lowercaseString ?: @""];
+    UNLOCK(self.schedulerLock);
+    return limit;
+}
+
+- (void)setMaxInFlightBytes:(NSUInteger)maxInFlightBytes {
+    LOCK(self.schedulerLock);
+    _maxInFlightBytes = maxInFlightBytes;
+    UNLOCK(self.schedulerLock);
+    [self admitPendingOperations];
+}
+
+- (void)setInFlightBytesEstimate:(NSUInteger)inFlightBytesEstimate {
+    LOCK(self.schedulerLock);
+    _inFlightBytesEstimate = inFlightBytesEstimate;
+    UNLOCK(self.schedulerLock);
+    [self admitPendingOperations];
+}
+
+- (NSUInteger)currentInFlightBytes {
+    LOCK(self.schedulerLock);
+    int64_t inFlightBytes = [self countedInFlightBytes];
+    UNLOCK(self.schedulerLock);
+    return (NSUInteger)MAX(inFlightBytes, 0);
 }
 
 - (NSUInteger)currentDownloadCount {
-    return _downloadQueue.operationCount;
+    LOCK(self.schedulerLock);
+    NSUInteger pendingOperationCount = self.pendingEntries.count;
+    UNLOCK(self.schedulerLock);
+    return _downloadQueue.operationCount + pendingOperationCount;
 }
 
 - (NSInteger)maxConcurrentDownloads {
@@ -204,7 +506,7 @@
                                                    context:(nullable SDWebImageContext *)context {
     __weak SDWebImageDownloader *wself = self;
 
-    return [self addProgressCallback:progressBlock completedBlock:completedBlock forURL:url createCallback:^SDWebImageDownloaderOperation *{
+    return [self addProgressCallback:progressBlock completedBlock:completedBlock forURL:url context:context createCallback:^SDWebImageDownloaderOperation *{
         __strong __typeof (wself) sself = wself;
         NSTimeInterval timeoutInterval = sself.downloadTimeout;
         if (timeoutInterval == 0.0) {
@@ -227,7 +529,35 @@
         }
         SDWebImageDownloaderOperation *operation = [[sself.operationClass alloc] initWithRequest:request inSession:sself.session options:options];
         operation.shouldDecompressImages = sself.shouldDecompressImages;
+        if ([operation respondsToSelector:@selector(setMinimumProgressInterval:)]) {
+            operation.minimumProgressInterval = sself.minimumProgressInterval;
+        }
+        if ([operation respondsToSelector:@selector(setMinimumProgressiveDecodeInterval:)]) {
+            operation.minimumProgressiveDecodeInterval = sself.minimumProgressiveDecodeInterval;
+        }
+        if ([operation respondsToSelector:@selector(setMinimumProgressiveDecodeBytes:)]) {
+            operation.minimumProgressiveDecodeBytes = sself.minimumProgressiveDecodeBytes;
+        }
+        if ([operation respondsToSelector:@selector(setMaxPartialDataCacheSize:)]) {
+            operation.maxPartialDataCacheSize = sself.maxPartialDataCacheSize;
+        }
+        if ([operation respondsToSelector:@selector(setDiskStreamingThreshold:)]) {
+            operation.diskStreamingThreshold = sself.diskStreamingThreshold;
+        }
+        if ([operation respondsToSelector:@selector(setInFlightBytesBlock:)]) {
+            operation.inFlightBytesBlock = ^(int64_t deltaBytes) {
+                __strong __typeof (wself) strongSelf = wself;
+                [strongSelf addInFlightBytes:deltaBytes];
+            };
+        }
+        if ([operation respondsToSelector:@selector(setMetricsBlock:)]) {
+            operation.metricsBlock = ^(SDWebImageDownloaderMetrics * _Nonnull metrics) {
+                __strong __typeof (wself) strongSelf = wself;
+                [strongSelf.metricsDelegate imageDownloader:strongSelf didCollectMetrics:metrics];
+            };
+        }
         operation.context = context;
+        SD_TRACE_BEGIN(@"download queue wait", SDTraceIdentifierFromContext(context));
         
         if (sself.urlCredential) {
             operation.credential = sself.urlCredential;
@@ -241,36 +571,33 @@
             operation.queuePriority = NSOperationQueuePriorityLow;
         }
 
-        [sself.downloadQueue addOperation:operation];
-        if (sself.executionOrder == SDWebImageDownloaderLIFOExecutionOrder) {
-            // Emulate LIFO execution order by systematically adding new operations as last operation's dependency
-            [sself.lastAddedOperation addDependency:operation];
-            sself.lastAddedOperation = operation;
-        }
-
         return operation;
     }];
 }
 
 - (void)cancel:(nullable SDWebImageDownloadToken *)token {
-    NSURL *url = token.url;
-    if (!url) {
+    id<NSCopying> operationKey = token.operationKey ?: token.url;
+    if (!operationKey) {
         return;
     }
     LOCK(self.operationsLock);
-    SDWebImageDownloaderOperation *operation = [self.URLOperations objectForKey:url];
+    SDWebImageDownloaderOperation *operation = [self.URLOperations objectForKey:operationKey];
     if (operation) {
         BOOL canceled = [operation cancel:token.downloadOperationCancelToken];
         if (canceled) {
-            [self.URLOperations removeObjectForKey:url];
+            [self.URLOperations removeObjectForKey:operationKey];
         }
     }
     UNLOCK(self.operationsLock);
+    if (operation) {
+        [self didCancelOperation:operation];
+    }
 }
 
 - (nullable SDWebImageDownloadToken *)addProgressCallback:(SDWebImageDownloaderProgressBlock)progressBlock
                                            completedBlock:(SDWebImageDownloaderCompletedBlock)completedBlock
                                                    forURL:(nullable NSURL *)url
+                                                  context:(nullable SDWebImageContext *)context
                                            createCallback:(SDWebImageDownloaderOperation *(^)(void))createCallback {
     // The URL will be used as the key to the callbacks dictionary so it cannot be nil. If it is nil immediately call the completed block with no image or data.
     if (url == nil) {
@@ -280,29 +607,53 @@
         return nil;
     }
     
+    // The downloads of equivalent URLs share one operation
+    id<NSCopying> operationKey = url;
+    if (self.coalescingKeyFilter) {
+        operationKey = self.coalescingKeyFilter(url) ?: url;
+    }
+    // The operation aborts or downsamples the image for the pixel budget of its context, only the requests of the same budget can share it
+    NSNumber *pixelBudget = context[SDWebImageContextImagePixelBudget];
+    if ([pixelBudget isKindOfClass:[NSNumber class]] && pixelBudget.unsignedLongLongValue > 0) {
+        operationKey = @[operationKey, pixelBudget];
+    }
+    
+    BOOL isNewOperation = NO;
     LOCK(self.operationsLock);
-    SDWebImageDownloaderOperation *operation = [self.URLOperations objectForKey:url];
-    if (!operation) {
+    SDWebImageDownloaderOperation *operation = [self.URLOperations objectForKey:operationKey];
+    // A cancelled operation may still wait for its turn, do not reuse it
+    if (!operation || operation.isFinished || operation.isCancelled) {
+        isNewOperation = YES;
         operation = createCallback();
         __weak typeof(self) wself = self;
+        __weak typeof(operation) woperation = operation;
         operation.completionBlock = ^{
             __strong typeof(wself) sself = wself;
             if (!sself) {
                 return;
             }
             LOCK(sself.operationsLock);
-            [sself.URLOperations removeObjectForKey:url];
+            if ([sself.URLOperations objectForKey:operationKey] == woperation) {
+                [sself.URLOperations removeObjectForKey:operationKey];
+            }
             UNLOCK(sself.operationsLock);
+            [sself didFinishOperation:woperation forHost:SDHostForURL(url)];
         };
-        [self.URLOperations setObject:operation forKey:url];
+        [self.URLOperations setObject:operation forKey:operationKey];
     }
     UNLOCK(self.operationsLock);
 
     id downloadOperationCancelToken = [operation addHandlersForProgress:progressBlock completed:completedBlock];
+    // The admission takes the scheduler lock and hands operations to the download queue, it's not done with the operations lock held
+    if (isNewOperation) {
+        [self enqueueOperation:operation forHost:SDHostForURL(url)];
+    }
     
     SDWebImageDownloadToken *token = [SDWebImageDownloadToken new];
     token.downloadOperation = operation;
+    token.downloader = self;
     token.url = url;
+    token.operationKey = operationKey;
     token.downloadOperationCancelToken = downloadOperationCancelToken;
 
     return token;
@@ -312,23 +663,420 @@
     self.downloadQueue.suspended = suspended;
 }
 
+- (void)setPriority:(NSOperationQueuePriority)priority forToken:(nullable SDWebImageDownloadToken *)token {
+    NSOperation *operation = token.downloadOperation;
+    if (!operation) {
+        return;
+    }
+    LOCK(self.schedulerLock);
+    SDWebImageDownloaderPendingEntry *entry = [self.pendingEntries objectForKey:operation];
+    if (entry && entry.priority != priority) {
+        entry.priority = priority;
+        [self.pendingQueues[entry.host] updateEntry:entry];
+    }
+    UNLOCK(self.schedulerLock);
+    // Still applies to an admitted operation which has not started yet
+    operation.queuePriority = priority;
+}
+
 - (void)cancelAllDownloads {
+    LOCK(self.schedulerLock);
+    NSMutableArray<SDWebImageDownloaderOperation *> *pendingOperations = [NSMutableArray arrayWithCapacity:self.pendingEntries.count];
+    for (SDWebImageDownloaderPendingEntry *entry in self.pendingEntries.objectEnumerator) {
+        // Every entry is marked, so the heaps keep their order
+        entry.cancelled = YES;
+        [pendingOperations addObject:entry.operation];
+    }
+    UNLOCK(self.schedulerLock);
+    [pendingOperations makeObjectsPerformSelector:@selector(cancel)];
     [self.downloadQueue cancelAllOperations];
+    // The cancelled operations are admitted at once so that they finish
+    [self admitPendingOperations];
+}
+
+#pragma mark Admission
+
+// Call with the scheduler lock held
+- (NSInteger)limitForHost:(nonnull NSString *)host {
+    NSNumber *cachedLimit = self.hostLimits[host];
+    if (cachedLimit) {
+        return cachedLimit.integerValue;
+    }
+    NSNumber *limit = self.hostPatternLimits[host];
+    if (!limit) {
+        // The longest matching wildcard is the most specific
+        NSUInteger matchedLength = 0;
+        for (NSString *hostPattern in self.hostPatternLimits) {
+            if (![hostPattern hasPrefix:@"*."] || hostPattern.length <= matchedLength) {
+                continue;
+            }
+            NSString *domain = [hostPattern substringFromIndex:2];
+            if ([host isEqualToString:domain] || [host hasSuffix:[@"." stringByAppendingString:domain]]) {
+                limit = self.hostPatternLimits[hostPattern];
+                matchedLength = hostPattern.length;
+            }
+        }
+    }
+    if (!limit) {
+        limit = @(MAX(self.maxConcurrentDownloadsPerHost, 0));
+    }
+    self.hostLimits[host] = limit;
+    return limit.integerValue;
+}
+
+- (void)enqueueOperation:(nonnull SDWebImageDownloaderOperation *)operation forHost:(nonnull NSString *)host {
+    SDWebImageDownloaderOptions options = [operation respondsToSelector:@selector(options)] ? operation.options : 0;
+    SDWebImageDownloaderPendingEntry *entry = [SDWebImageDownloaderPendingEntry new];
+    entry.operation = operation;
+    entry.host = host;
+    entry.priority = operation.queuePriority;
+    if (options & SDWebImageDownloaderLIFOExecution) {
+        entry.lastInFirstOut = YES;
+    } else if (options & SDWebImageDownloaderFIFOExecution) {
+        entry.lastInFirstOut = NO;
+    } else {
+        entry.lastInFirstOut = self.executionOrder == SDWebImageDownloaderLIFOExecutionOrder;
+    }
+    
+    LOCK(self.schedulerLock);
+    // It may have been cancelled since it was created, checked with the lock held so that `didCancelOperation:` either sees the entry or is seen here
+    entry.cancelled = operation.isCancelled;
+    entry.sequence = self.pendingSequence++;
+    SDWebImageDownloaderPendingQueue *queue = self.pendingQueues[host];
+    if (!queue) {
+        queue = [SDWebImageDownloaderPendingQueue new];
+        self.pendingQueues[host] = queue;
+        [self.pendingHosts addObject:host];
+    }
+    [queue addEntry:entry];
+    [self.pendingEntries setObject:entry forKey:operation];
+    UNLOCK(self.schedulerLock);
+    [self admitPendingOperations];
+}
+
+- (void)didCancelOperation:(nonnull NSOperation *)operation {
+    if (!operation.isCancelled) {
+        return;
+    }
+    LOCK(self.schedulerLock);
+    SDWebImageDownloaderPendingEntry *entry = [self.pendingEntries objectForKey:operation];
+    if (entry && !entry.cancelled) {
+        entry.cancelled = YES;
+        [self.pendingQueues[entry.host] updateEntry:entry];
+    }
+    UNLOCK(self.schedulerLock);
+    // A cancelled operation still waiting for its turn is admitted at once so that it finishes
+    [self admitPendingOperations];
+}
+
+- (void)addInFlightBytes:(int64_t)deltaBytes {
+    LOCK(self.schedulerLock);
+    self.inFlightBytes += deltaBytes;
+    UNLOCK(self.schedulerLock);
+    if (deltaBytes < 0) {
+        [self admitPendingOperations];
+    }
+}
+
+// The estimate of an operation is replaced by the size it reports once it has handled its response
+- (void)didHandleResponseForOperation:(nullable NSOperation *)operation {
+    if (!operation) {
+        return;
+    }
+    LOCK(self.schedulerLock);
+    BOOL wasEstimated = [self.estimatedOperations containsObject:operation];
+    [self.estimatedOperations removeObject:operation];
+    UNLOCK(self.schedulerLock);
+    if (wasEstimated) {
+        [self admitPendingOperations];
+    }
+}
+
+// Call with the scheduler lock held
+- (int64_t)countedInFlightBytes {
+    // The weak table drops the operations gone, `allObjects` only returns the alive ones
+    return self.inFlightBytes + (int64_t)(self.estimatedOperations.allObjects.count * _inFlightBytesEstimate);
+}
+
+- (void)didFinishOperation:(nullable NSOperation *)operation forHost:(nonnull NSString *)host {
+    LOCK(self.schedulerLock);
+    if (operation) {
+        // Such as a download failed before its response
+        [self.estimatedOperations removeObject:operation];
+    }
+    self.runningOperationCount--;
+    [self.runningHosts removeObject:host];
+    UNLOCK(self.schedulerLock);
+    [self admitPendingOperations];
+}
+
+// Admit the pending operations to the download queue while slots and memory budget are left, taking one operation from each host in turn
+- (void)admitPendingOperations {
+    NSMutableArray<SDWebImageDownloaderOperation *> *admittedOperations = [NSMutableArray array];
+    NSInteger maxConcurrentDownloads = self.downloadQueue.maxConcurrentOperationCount;
+    NSUInteger maxRunningCount = maxConcurrentDownloads > 0 ? maxConcurrentDownloads : NSUIntegerMax;
+    
+    LOCK(self.schedulerLock);
+    BOOL admitted = YES;
+    while (admitted && self.pendingHosts.count > 0) {
+        admitted = NO;
+        NSUInteger hostCount = self.pendingHosts.count;
+        for (NSUInteger i = 0; i < hostCount; i++) {
+            NSUInteger index = (self.nextHostIndex + i) % hostCount;
+            NSString *host = self.pendingHosts[index];
+            SDWebImageDownloaderPendingQueue *queue = self.pendingQueues[host];
+            SDWebImageDownloaderPendingEntry *entry = queue.firstEntry;
+            if (!entry.cancelled) {
+                NSInteger limit = [self limitForHost:host];
+                if (self.runningOperationCount >= maxRunningCount || (limit > 0 && [self.runningHosts countForObject:host] >= (NSUInteger)limit)) {
+                    continue;
+                }
+                // Hold back while the running downloads use the budget up, a lone download is always admitted
+                if (_maxInFlightBytes > 0 && self.runningOperationCount > 0 && [self countedInFlightBytes] >= (int64_t)_maxInFlightBytes) {
+                    continue;
+                }
+            }
+            
+            [queue removeEntry:entry];
+            [self.pendingEntries removeObjectForKey:entry.operation];
+            self.runningOperationCount++;
+            [self.runningHosts addObject:host];
+            [admittedOperations addObject:entry.operation];
+            if (!entry.cancelled) {
+                // Its response is not known yet, this keeps the next ones from being admitted all at once
+                [self.estimatedOperations addObject:entry.operation];
+            }
+            if (queue.count == 0) {
+                [self.pendingQueues removeObjectForKey:host];
+                [self.pendingHosts removeObjectAtIndex:index];
+                // The next host has moved to this index
+                self.nextHostIndex = self.pendingHosts.count > 0 ? index % self.pendingHosts.count : 0;
+            } else {
+                self.nextHostIndex = (index + 1) % hostCount;
+            }
+            admitted = YES;
+            break;
+        }
+    }
+    UNLOCK(self.schedulerLock);
+    
+    if (admittedOperations.count > 0) {
+        if (self.concurrencyController) {
+            NSTimeInterval startTime = [NSProcessInfo processInfo].systemUptime;
+            LOCK(self.downloadSamplesLock);
+            for (SDWebImageDownloaderOperation *operation in admittedOperations) {
+                SDWebImageDownloadSample *sample = [SDWebImageDownloadSample new];
+                sample.startTime = startTime;
+                sample.timeToFirstByte = -1;
+                [self.downloadSamples setObject:sample forKey:operation];
+            }
+            UNLOCK(self.downloadSamplesLock);
+        }
+        [self.downloadQueue addOperations:admittedOperations waitUntilFinished:NO];
+    }
+}
+
+#pragma mark Probing
+
+- (nullable id<SDWebImageOperation>)probeImageWithURL:(nullable NSURL *)url completed:(nullable SDWebImageMetadataCompletedBlock)completedBlock {
+    if (!url) {
+        if (completedBlock) {
+            NSError *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadURL userInfo:nil];
+            dispatch_main_async_safe(^{
+                completedBlock(nil, error);
+            });
+        }
+        return nil;
+    }
+    SDWebImageMetadata *metadata = [self.metadataCache objectForKey:url];
+    if (metadata) {
+        if (completedBlock) {
+            dispatch_main_async_safe(^{
+                completedBlock(metadata, nil);
+            });
+        }
+        return nil;
+    }
+    
+    NSTimeInterval timeoutInterval = self.downloadTimeout;
+    if (timeoutInterval == 0.0) {
+        timeoutInterval = 15.0;
+    }
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:url
+                                                                cachePolicy:NSURLRequestReloadIgnoringLocalCacheData
+                                                            timeoutInterval:timeoutInterval];
+    request.HTTPShouldUsePipelining = YES;
+    if (self.headersFilter) {
+        request.allHTTPHeaderFields = self.headersFilter(url, [self allHTTPHeaderFields]);
+    } else {
+        request.allHTTPHeaderFields = [self allHTTPHeaderFields];
+    }
+    NSUInteger probeSize = MAX(self.probeSize, 1);
+    [request setValue:[NSString stringWithFormat:@"bytes=0-%lu", (unsigned long)(probeSize - 1)] forHTTPHeaderField:@"Range"];
+    
+    SDWebImageDownloaderProbe *probe = [SDWebImageDownloaderProbe new];
+    probe.url = url;
+    probe.completedBlock = completedBlock;
+    probe.probeSize = probeSize;
+    probe.dataTask = [self.session dataTaskWithRequest:request];
+    if (!probe.dataTask) {
+        return nil;
+    }
+    LOCK(self.taskOperationsLock);
+    self.taskProbes[@(probe.dataTask.taskIdentifier)] = probe;
+    UNLOCK(self.taskOperationsLock);
+    [probe.dataTask resume];
+    return probe;
+}
+
+- (nullable SDWebImageDownloaderProbe *)probeWithTask:(NSURLSessionTask *)task {
+    LOCK(self.taskOperationsLock);
+    SDWebImageDownloaderProbe *probe = self.taskProbes[@(task.taskIdentifier)];
+    UNLOCK(self.taskOperationsLock);
+    // Task identifiers are only unique in one session
+    return probe.dataTask == task ? probe : nil;
+}
+
+- (void)removeProbeWithTask:(NSURLSessionTask *)task {
+    LOCK(self.taskOperationsLock);
+    if (self.taskProbes[@(task.taskIdentifier)].dataTask == task) {
+        [self.taskProbes removeObjectForKey:@(task.taskIdentifier)];
+    }
+    UNLOCK(self.taskOperationsLock);
+}
+
+- (void)probe:(nonnull SDWebImageDownloaderProbe *)probe didReceiveResponse:(NSURLResponse *)response completionHandler:(void (^)(NSURLSessionResponseDisposition disposition))completionHandler {
+    NSURLSessionResponseDisposition disposition = NSURLSessionResponseAllow;
+    if ([response respondsToSelector:@selector(statusCode)] && ((NSHTTPURLResponse *)response).statusCode >= 400) {
+        [self finishProbe:probe metadata:nil error:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadServerResponse userInfo:@{NSURLErrorFailingURLErrorKey : probe.url}]];
+        disposition = NSURLSessionResponseCancel;
+    }
+    if (completionHandler) {
+        completionHandler(disposition);
+    }
+}
+
+- (void)probe:(nonnull SDWebImageDownloaderProbe *)probe didReceiveData:(NSData *)data {
+    if (probe.isFinished) {
+        return;
+    }
+    [probe.data appendData:data];
+    [probe.dataScanner scanData:data];
+    // The pixel size comes before whether the image is animated, wait for both unless the scanner does not read the format
+    BOOL headerRead = probe.dataScanner.format == SDImageFormatUndefined || probe.dataScanner.isAnimationKnown;
+    if (!headerRead && probe.data.length < probe.probeSize) {
+        return;
+    }
+    SDWebImageMetadata *metadata = [SDWebImageMetadata metadataWithData:probe.data];
+    if (metadata || probe.data.length >= probe.probeSize) {
+        [self finishProbe:probe metadata:metadata error:nil];
+    } else {
+        return;
+    }
+    // The server ignored the range, or the header came first
+    [probe.dataTask cancel];
+}
+
+- (void)probe:(nonnull SDWebImageDownloaderProbe *)probe didCompleteWithError:(NSError *)error {
+    if (probe.isFinished) {
+        return;
+    }
+    SDWebImageMetadata *metadata = error ? nil : [SDWebImageMetadata metadataWithData:probe.data];
+    [self finishProbe:probe metadata:metadata error:error];
+}
+
+- (void)finishProbe:(nonnull SDWebImageDownloaderProbe *)probe metadata:(nullable SDWebImageMetadata *)metadata error:(nullable NSError *)error {
+    probe.finished = YES;
+    if (metadata) {
+        [self.metadataCache setObject:metadata forKey:probe.url];
+    } else if (!error) {
+        error = [NSError errorWithDomain:SDWebImageErrorDomain code:SDWebImageErrorMetadataNotFound userInfo:@{NSLocalizedDescriptionKey : @"The probed bytes do not contain the image header"}];
+    }
+    SDWebImageMetadataCompletedBlock completedBlock = probe.completedBlock;
+    probe.completedBlock = nil;
+    if (!completedBlock) {
+        return;
+    }
+    dispatch_main_async_safe(^{
+        if (!probe.isCancelled) {
+            completedBlock(metadata, error);
+        }
+    });
+}
+
+#pragma mark Concurrency control
+
+- (void)recordResponseForOperation:(nullable NSOperation *)operation {
+    if (!operation || !self.concurrencyController) {
+        return;
+    }
+    LOCK(self.downloadSamplesLock);
+    SDWebImageDownloadSample *sample = [self.downloadSamples objectForKey:operation];
+    if (sample && sample.timeToFirstByte < 0) {
+        sample.timeToFirstByte = [NSProcessInfo processInfo].systemUptime - sample.startTime;
+    }
+    UNLOCK(self.downloadSamplesLock);
+}
+
+- (void)recordCompletionForOperation:(nullable NSOperation *)operation task:(nonnull NSURLSessionTask *)task error:(nullable NSError *)error {
+    if (!operation) {
+        return;
+    }
+    LOCK(self.downloadSamplesLock);
+    SDWebImageDownloadSample *sample = [self.downloadSamples objectForKey:operation];
+    [self.downloadSamples removeObjectForKey:operation];
+    UNLOCK(self.downloadSamplesLock);
+    SDWebImageDownloaderConcurrencyController *concurrencyController = self.concurrencyController;
+    if (!sample || !concurrencyController) {
+        return;
+    }
+    NSTimeInterval duration = [NSProcessInfo processInfo].systemUptime - sample.startTime;
+    [concurrencyController addSampleWithTimeToFirstByte:sample.timeToFirstByte duration:duration receivedBytes:task.countOfBytesReceived error:error];
+    NSInteger limit = concurrencyController.currentLimit;
+    if (limit != self.maxConcurrentDownloads) {
+        self.maxConcurrentDownloads = limit;
+    }
 }
 
 #pragma mark Helper methods
 
 - (SDWebImageDownloaderOperation *)operationWithTask:(NSURLSessionTask *)task {
-    SDWebImageDownloaderOperation *returnOperation = nil;
+    NSNumber *taskIdentifier = @(task.taskIdentifier);
+    LOCK(self.taskOperationsLock);
+    SDWebImageDownloaderOperation *returnOperation = [self.taskOperations objectForKey:taskIdentifier];
+    UNLOCK(self.taskOperationsLock);
+    // Task identifiers are only unique in one session, check the task itself in case the session has been recreated
+    if (returnOperation && returnOperation.dataTask == task) {
+        return returnOperation;
+    }
+    
+    // Only the first delegate method of a task searches the queue, the following ones (such as each received data) are routed by the map
+    returnOperation = nil;
     for (SDWebImageDownloaderOperation *operation in self.downloadQueue.operations) {
-        if (operation.dataTask.taskIdentifier == task.taskIdentifier) {
+        if (operation.dataTask == task) {
             returnOperation = operation;
             break;
         }
     }
+    if (returnOperation) {
+        LOCK(self.taskOperationsLock);
+        [self.taskOperations setObject:returnOperation forKey:taskIdentifier];
+        UNLOCK(self.taskOperationsLock);
+    }
     return returnOperation;
 }
 
+- (void)removeOperationWithTask:(NSURLSessionTask *)task {
+    NSNumber *taskIdentifier = @(task.taskIdentifier);
+    LOCK(self.taskOperationsLock);
+    NSURLSessionTask *operationTask = [self.taskOperations objectForKey:taskIdentifier].dataTask;
+    // A cancelled operation has already released its task, and a restarted one has moved to a new task with another identifier. The same identifier is a task of a recreated session, whose entry is kept
+    if (!operationTask || operationTask == task || operationTask.taskIdentifier != task.taskIdentifier) {
+        [self.taskOperations removeObjectForKey:taskIdentifier];
+    }
+    UNLOCK(self.taskOperationsLock);
+}
+
 #pragma mark NSURLSessionDataDelegate
 
 - (void)URLSession:(NSURLSession *)session
@@ -336,8 +1084,15 @@
 didReceiveResponse:(NSURLResponse *)response
  completionHandler:(void (^)(NSURLSessionResponseDisposition disposition))completionHandler {
 
+    SDWebImageDownloaderProbe *probe = [self probeWithTask:dataTask];
+    if (probe) {
+        [self probe:probe didReceiveResponse:response completionHandler:completionHandler];
+        return;
+    }
+
     // Identify the operation that runs this task and pass it the delegate method
     SDWebImageDownloaderOperation *dataOperation = [self operationWithTask:dataTask];
+    [self recordResponseForOperation:dataOperation];
     if ([dataOperation respondsToSelector:@selector(URLSession:dataTask:didReceiveResponse:completionHandler:)]) {
         [dataOperation URLSession:session dataTask:dataTask didReceiveResponse:response completionHandler:completionHandler];
     } else {
@@ -345,10 +1100,17 @@ didReceiveResponse:(NSURLResponse *)response
             completionHandler(NSURLSessionResponseAllow);
         }
     }
+    [self didHandleResponseForOperation:dataOperation];
 }
 
 - (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask didReceiveData:(NSData *)data {
 
+    SDWebImageDownloaderProbe *probe = [self probeWithTask:dataTask];
+    if (probe) {
+        [self probe:probe didReceiveData:data];
+        return;
+    }
+
     // Identify the operation that runs this task and pass it the delegate method
     SDWebImageDownloaderOperation *dataOperation = [self operationWithTask:dataTask];
     if ([dataOperation respondsToSelector:@selector(URLSession:dataTask:didReceiveData:)]) {
@@ -361,6 +1123,14 @@ didReceiveResponse:(NSURLResponse *)response
  willCacheResponse:(NSCachedURLResponse *)proposedResponse
  completionHandler:(void (^)(NSCachedURLResponse *cachedResponse))completionHandler {
 
+    // The partial body of a probe is not worth caching
+    if ([self probeWithTask:dataTask]) {
+        if (completionHandler) {
+            completionHandler(nil);
+        }
+        return;
+    }
+
     // Identify the operation that runs this task and pass it the delegate method
     SDWebImageDownloaderOperation *dataOperation = [self operationWithTask:dataTask];
     if ([dataOperation respondsToSelector:@selector(URLSession:dataTask:willCacheResponse:completionHandler:)]) {
@@ -376,13 +1146,32 @@ didReceiveResponse:(NSURLResponse *)response
 
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error {
     
+    SDWebImageDownloaderProbe *probe = [self probeWithTask:task];
+    if (probe) {
+        [self removeProbeWithTask:task];
+        [self probe:probe didCompleteWithError:error];
+        return;
+    }
+
     // Identify the operation that runs this task and pass it the delegate method
     SDWebImageDownloaderOperation *dataOperation = [self operationWithTask:task];
+    // The task has finished, no more delegate methods for it
+    [self removeOperationWithTask:task];
+    [self recordCompletionForOperation:dataOperation task:task error:error];
     if ([dataOperation respondsToSelector:@selector(URLSession:task:didCompleteWithError:)]) {
         [dataOperation URLSession:session task:task didCompleteWithError:error];
     }
 }
 
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didFinishCollectingMetrics:(NSURLSessionTaskMetrics *)metrics API_AVAILABLE(macosx(10.12), ios(10.0), tvos(10.0), watchos(3.0)) {
+    
+    // Identify the operation that runs this task and pass it the delegate method
+    SDWebImageDownloaderOperation *dataOperation = [self operationWithTask:task];
+    if ([dataOperation respondsToSelector:@selector(URLSession:task:didFinishCollectingMetrics:)]) {
+        [dataOperation URLSession:session task:task didFinishCollectingMetrics:metrics];
+    }
+}
+
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task willPerformHTTPRedirection:(NSHTTPURLResponse *)response newRequest:(NSURLRequest *)request completionHandler:(void (^)(NSURLRequest * _Nullable))completionHandler {
     
     // Identify the operation that runs this task and pass it the delegate method
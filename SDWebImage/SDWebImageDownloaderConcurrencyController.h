@@ -0,0 +1,122 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+typedef NS_ENUM(NSInteger, SDWebImageDownloaderConcurrencyChangeReason) {
+    /**
+     * The limit has not changed yet, it is the initial limit.
+     */
+    SDWebImageDownloaderConcurrencyChangeReasonInitial = 0,
+    /**
+     * The downloads of the last window failed too often, the limit has been divided.
+     */
+    SDWebImageDownloaderConcurrencyChangeReasonErrorRate,
+    /**
+     * The time to first byte of the last window grew too much over the best one seen, the limit has been divided.
+     */
+    SDWebImageDownloaderConcurrencyChangeReasonLatency,
+    /**
+     * The throughput of the last window kept up, the limit has been increased by one.
+     */
+    SDWebImageDownloaderConcurrencyChangeReasonThroughput,
+    /**
+     * The bounds have been changed and the limit has been clamped to them.
+     */
+    SDWebImageDownloaderConcurrencyChangeReasonBounds
+};
+
+@class SDWebImageDownloaderConcurrencyController;
+
+@protocol SDWebImageDownloaderConcurrencyControllerDelegate <NSObject>
+
+/**
+ * Called when the controller changes its limit. This is called on the queue the sample has been added on.
+ *
+ * @param controller The concurrency controller
+ * @param limit      The new limit
+ * @param reason     The reason for the change
+ */
+- (void)concurrencyController:(nonnull SDWebImageDownloaderConcurrencyController *)controller didChangeLimit:(NSUInteger)limit reason:(SDWebImageDownloaderConcurrencyChangeReason)reason;
+
+@end
+
+/**
+ * Adjusts the number of concurrent downloads from the observed network conditions, using additive increase and multiplicative decrease (AIMD).
+ * The samples are evaluated by windows: a window with too many errors or a time to first byte grown too much over the best one seen divides the limit, a window whose throughput kept up with the previous one increases it by one.
+ * Set it to `SDWebImageDownloader.concurrencyController` to have the downloader feed it and follow its limit.
+ */
+@interface SDWebImageDownloaderConcurrencyController : NSObject
+
+@property (weak, nonatomic, nullable) id<SDWebImageDownloaderConcurrencyControllerDelegate> delegate;
+
+/**
+ * The current limit, always within `minimumLimit` and `maximumLimit`.
+ */
+@property (assign, nonatomic, readonly) NSUInteger currentLimit;
+
+/**
+ * The reason of the last change of `currentLimit`.
+ */
+@property (assign, nonatomic, readonly) SDWebImageDownloaderConcurrencyChangeReason lastChangeReason;
+
+/**
+ * The lower bound of the limit. Defaults to 1.
+ */
+@property (assign, nonatomic) NSUInteger minimumLimit;
+
+/**
+ * The upper bound of the limit. Defaults to 16.
+ */
+@property (assign, nonatomic) NSUInteger maximumLimit;
+
+/**
+ * The number of samples evaluated together. Defaults to 4.
+ */
+@property (assign, nonatomic) NSUInteger sampleWindow;
+
+/**
+ * The ratio the limit is multiplied by when decreased. Defaults to 0.5.
+ */
+@property (assign, nonatomic) double decreaseRatio;
+
+/**
+ * The ratio of failed downloads in a window above which the limit is decreased. Defaults to 0.25.
+ */
+@property (assign, nonatomic) double errorRateThreshold;
+
+/**
+ * How many times the best time to first byte seen the average of a window may reach before the limit is decreased. Defaults to 2.
+ */
+@property (assign, nonatomic) double latencyTolerance;
+
+/**
+ * Initializes the controller with the initial limit, clamped to the default bounds.
+ */
+- (nonnull instancetype)initWithInitialLimit:(NSUInteger)initialLimit NS_DESIGNATED_INITIALIZER;
+
+/**
+ * Adds the sample of one finished download. This is thread-safe, and may be called directly to drive the controller without a network.
+ *
+ * @param timeToFirstByte The time from the download start to its response, or a negative value if there was no response
+ * @param duration        The time from the download start to its end
+ * @param receivedBytes   The number of bytes received
+ * @param error           The error the download failed with, if any. Cancellations are ignored
+ */
+- (void)addSampleWithTimeToFirstByte:(NSTimeInterval)timeToFirstByte
+                            duration:(NSTimeInterval)duration
+                       receivedBytes:(int64_t)receivedBytes
+                               error:(nullable NSError *)error;
+
+/**
+ * Resets the limit to `initialLimit` (clamped) and forgets the samples and the best time to first byte seen, for example when the network changes.
+ */
+- (void)resetWithInitialLimit:(NSUInteger)initialLimit;
+
+@end
@@ -0,0 +1,179 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageDownloaderConcurrencyController.h"
+
+#define LOCK(lock) dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
+#define UNLOCK(lock) dispatch_semaphore_signal(lock);
+
+static const NSUInteger kDefaultInitialLimit = 6;
+static const NSUInteger kDefaultMinimumLimit = 1;
+static const NSUInteger kDefaultMaximumLimit = 16;
+// A window whose throughput dropped below this ratio of the previous one holds the limit
+static const double kThroughputDropTolerance = 0.9;
+
+@interface SDWebImageDownloaderConcurrencyController ()
+
+@property (assign, nonatomic, readwrite) NSUInteger currentLimit;
+@property (assign, nonatomic, readwrite) SDWebImageDownloaderConcurrencyChangeReason lastChangeReason;
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t lock; // a lock to keep the access to the samples and the limit thread-safe
+
+// The current window
+@property (assign, nonatomic) NSUInteger windowSampleCount;
+@property (assign, nonatomic) NSUInteger windowErrorCount;
+@property (assign, nonatomic) NSUInteger windowResponseCount;
+@property (assign, nonatomic) NSTimeInterval windowTimeToFirstByte;
+@property (assign, nonatomic) NSTimeInterval windowDuration;
+@property (assign, nonatomic) int64_t windowReceivedBytes;
+
+// The best time to first byte seen, and the estimated throughput of the previous window, 0 if unknown
+@property (assign, nonatomic) NSTimeInterval minimumTimeToFirstByte;
+@property (assign, nonatomic) double previousThroughput;
+
+@end
+
+@implementation SDWebImageDownloaderConcurrencyController
+
+- (nonnull instancetype)init {
+    return [self initWithInitialLimit:kDefaultInitialLimit];
+}
+
+- (nonnull instancetype)initWithInitialLimit:(NSUInteger)initialLimit {
+    if ((self = [super init])) {
+        _lock = dispatch_semaphore_create(1);
+        _minimumLimit = kDefaultMinimumLimit;
+        _maximumLimit = kDefaultMaximumLimit;
+        _sampleWindow = 4;
+        _decreaseRatio = 0.5;
+        _errorRateThreshold = 0.25;
+        _latencyTolerance = 2;
+        _currentLimit = MIN(MAX(initialLimit, _minimumLimit), _maximumLimit);
+        _lastChangeReason = SDWebImageDownloaderConcurrencyChangeReasonInitial;
+    }
+    return self;
+}
+
+- (void)setMinimumLimit:(NSUInteger)minimumLimit {
+    LOCK(self.lock);
+    _minimumLimit = MAX(minimumLimit, 1);
+    _maximumLimit = MAX(_maximumLimit, _minimumLimit);
+    UNLOCK(self.lock);
+    [self clampLimit];
+}
+
+- (void)setMaximumLimit:(NSUInteger)maximumLimit {
+    LOCK(self.lock);
+    _maximumLimit = MAX(maximumLimit, 1);
+    _minimumLimit = MIN(_minimumLimit, _maximumLimit);
+    UNLOCK(self.lock);
+    [self clampLimit];
+}
+
+- (void)clampLimit {
+    LOCK(self.lock);
+    NSUInteger limit = MIN(MAX(_currentLimit, _minimumLimit), _maximumLimit);
+    BOOL changed = [self updateLimit:limit reason:SDWebImageDownloaderConcurrencyChangeReasonBounds];
+    UNLOCK(self.lock);
+    if (changed) {
+        [self.delegate concurrencyController:self didChangeLimit:limit reason:SDWebImageDownloaderConcurrencyChangeReasonBounds];
+    }
+}
+
+// Call with the lock held
+- (BOOL)updateLimit:(NSUInteger)limit reason:(SDWebImageDownloaderConcurrencyChangeReason)reason {
+    if (limit == _currentLimit) {
+        return NO;
+    }
+    _currentLimit = limit;
+    _lastChangeReason = reason;
+    return YES;
+}
+
+- (void)resetWithInitialLimit:(NSUInteger)initialLimit {
+    LOCK(self.lock);
+    [self resetWindow];
+    self.minimumTimeToFirstByte = 0;
+    self.previousThroughput = 0;
+    NSUInteger limit = MIN(MAX(initialLimit, _minimumLimit), _maximumLimit);
+    BOOL changed = [self updateLimit:limit reason:SDWebImageDownloaderConcurrencyChangeReasonInitial];
+    _lastChangeReason = SDWebImageDownloaderConcurrencyChangeReasonInitial;
+    UNLOCK(self.lock);
+    if (changed) {
+        [self.delegate concurrencyController:self didChangeLimit:limit reason:SDWebImageDownloaderConcurrencyChangeReasonInitial];
+    }
+}
+
+// Call with the lock held
+- (void)resetWindow {
+    self.windowSampleCount = 0;
+    self.windowErrorCount = 0;
+    self.windowResponseCount = 0;
+    self.windowTimeToFirstByte = 0;
+    self.windowDuration = 0;
+    self.windowReceivedBytes = 0;
+}
+
+- (void)addSampleWithTimeToFirstByte:(NSTimeInterval)timeToFirstByte
+                            duration:(NSTimeInterval)duration
+                       receivedBytes:(int64_t)receivedBytes
+                               error:(nullable NSError *)error {
+    if ([error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorCancelled) {
+        // A cancellation says nothing about the network
+        return;
+    }
+
+    LOCK(self.lock);
+    self.windowSampleCount++;
+    if (error) {
+        self.windowErrorCount++;
+    } else {
+        self.windowDuration += MAX(duration, 0);
+        self.windowReceivedBytes += MAX(receivedBytes, 0);
+    }
+    if (timeToFirstByte >= 0) {
+        self.windowResponseCount++;
+        self.windowTimeToFirstByte += timeToFirstByte;
+    }
+    if (self.windowSampleCount < MAX(self.sampleWindow, 1)) {
+        UNLOCK(self.lock);
+        return;
+    }
+
+    NSUInteger limit = _currentLimit;
+    SDWebImageDownloaderConcurrencyChangeReason reason = _lastChangeReason;
+    double errorRate = (double)self.windowErrorCount / self.windowSampleCount;
+    NSTimeInterval averageTimeToFirstByte = self.windowResponseCount > 0 ? self.windowTimeToFirstByte / self.windowResponseCount : 0;
+    // The throughput of one download times the number of concurrent downloads estimates the throughput of them all
+    double throughput = self.windowDuration > 0 ? self.windowReceivedBytes / self.windowDuration * limit : 0;
+
+    if (errorRate > self.errorRateThreshold) {
+        limit = (NSUInteger)(limit * self.decreaseRatio);
+        reason = SDWebImageDownloaderConcurrencyChangeReasonErrorRate;
+    } else if (self.minimumTimeToFirstByte > 0 && averageTimeToFirstByte > self.minimumTimeToFirstByte * self.latencyTolerance) {
+        limit = (NSUInteger)(limit * self.decreaseRatio);
+        reason = SDWebImageDownloaderConcurrencyChangeReasonLatency;
+    } else if (throughput > 0 && throughput >= self.previousThroughput * kThroughputDropTolerance) {
+        limit = limit + 1;
+        reason = SDWebImageDownloaderConcurrencyChangeReasonThroughput;
+    }
+    limit = MIN(MAX(limit, _minimumLimit), _maximumLimit);
+
+    if (averageTimeToFirstByte > 0 && (self.minimumTimeToFirstByte <= 0 || averageTimeToFirstByte < self.minimumTimeToFirstByte)) {
+        self.minimumTimeToFirstByte = averageTimeToFirstByte;
+    }
+    self.previousThroughput = throughput;
+    [self resetWindow];
+    BOOL changed = [self updateLimit:limit reason:reason];
+    UNLOCK(self.lock);
+
+    if (changed) {
+        [self.delegate concurrencyController:self didChangeLimit:limit reason:reason];
+    }
+}
+
+@end
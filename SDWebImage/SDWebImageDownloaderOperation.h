@@ -15,6 +15,60 @@ FOUNDATION_EXPORT NSString * _Nonnull const SDWebImageDownloadReceiveResponseNot
 FOUNDATION_EXPORT NSString * _Nonnull const SDWebImageDownloadStopNotification;
 FOUNDATION_EXPORT NSString * _Nonnull const SDWebImageDownloadFinishNotification;
 
+/**
+ * The timings of one download, from the creation of its operation to the delivery of its image.
+ * The dates are nil and the durations negative when the phase did not happen, for example the connection phases of a reused connection.
+ */
+@interface SDWebImageDownloaderMetrics : NSObject
+
+/**
+ * The URL of the download.
+ */
+@property (strong, nonatomic, readonly, nullable) NSURL *URL;
+
+/**
+ * The metrics collected by the URL session for the task, nil if the session collected none.
+ */
+@property (strong, nonatomic, readonly, nullable) NSURLSessionTaskMetrics *taskMetrics API_AVAILABLE(macosx(10.12), ios(10.0), tvos(10.0), watchos(3.0));
+
+@property (strong, nonatomic, readonly, nullable) NSDate *creationDate;
+@property (strong, nonatomic, readonly, nullable) NSDate *startDate;
+@property (strong, nonatomic, readonly, nullable) NSDate *responseDate;
+@property (strong, nonatomic, readonly, nullable) NSDate *loadingEndDate;
+@property (strong, nonatomic, readonly, nullable) NSDate *decodeStartDate;
+@property (strong, nonatomic, readonly, nullable) NSDate *decodeEndDate;
+@property (strong, nonatomic, readonly, nullable) NSDate *deliveryDate;
+
+/**
+ * The time waited for a download slot, from the creation of the operation to its start.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval queueDuration;
+/**
+ * The network phases of the last transaction, from the task metrics.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval domainLookupDuration;
+@property (assign, nonatomic, readonly) NSTimeInterval connectDuration;
+@property (assign, nonatomic, readonly) NSTimeInterval secureConnectionDuration;
+@property (assign, nonatomic, readonly) NSTimeInterval timeToFirstByte;
+@property (assign, nonatomic, readonly) NSTimeInterval transferDuration;
+/**
+ * The time spent decoding the final image, including the wait for the decode queue.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval decodeDuration;
+/**
+ * The time from the end of the decode to the completion blocks called on the main queue.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval deliveryDuration;
+/**
+ * The time from the creation of the operation to the delivery.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval totalDuration;
+
+@end
+
+typedef void(^SDWebImageDownloaderMetricsBlock)(SDWebImageDownloaderMetrics * _Nonnull metrics);
+typedef void(^SDWebImageDownloaderInFlightBytesBlock)(int64_t deltaBytes);
+
 
 
 /**
@@ -69,6 +123,61 @@ FOUNDATION_EXPORT NSString * _Nonnull const SDWebImageDownloadFinishNotification
  */
 @property (nonatomic, strong, nullable) NSURLCredential *credential;
 
+/**
+ * The minimum time interval between two progress notifications while receiving the data, in seconds. The notifications in between are dropped, except the one for the last chunk.
+ * Defaults to 0.05.
+ */
+@property (assign, nonatomic) NSTimeInterval minimumProgressInterval;
+
+/**
+ * The minimum time interval between two progressive decodes, in seconds.
+ * Defaults to 0.1.
+ */
+@property (assign, nonatomic) NSTimeInterval minimumProgressiveDecodeInterval;
+
+/**
+ * The minimum number of bytes received since the previous progressive decode to decode again.
+ * Progressive JPEG are also only decoded again after a new scan is complete, and PNG after a new image data chunk is complete.
+ * Defaults to 32 KB.
+ */
+@property (assign, nonatomic) NSUInteger minimumProgressiveDecodeBytes;
+
+/**
+ * The maximum total size of the partially received bodies kept on disk to resume the downloads cancelled or failed midway.
+ * A download is resumed with a `Range` request validated by `If-Range` when the server advertised byte ranges and an ETag or Last-Modified validator. The partial body is discarded if the server answers with the full body, which happens once the validator changed.
+ * Defaults to 20 MB. Set to 0 to never keep partial bodies.
+ */
+@property (assign, nonatomic) NSUInteger maxPartialDataCacheSize;
+
+/**
+ * The expected size from which the body is written to a file as it arrives instead of being kept in memory, and decoded from the file mapped in memory.
+ * The file is in `SDWebImageContextDownloadDirectory` from the context if any, otherwise in the temporary directory.
+ * Defaults to 8 MB. Set to 0 to always keep the body in memory.
+ */
+@property (assign, nonatomic) NSUInteger diskStreamingThreshold;
+
+/**
+ * The file the body is written to, see `diskStreamingThreshold`, or nil if the body is kept in memory.
+ * The file belongs to the operation. Once the download succeeded it is kept until the completion blocks have been called, which may link it to keep it, and then removed.
+ */
+@property (copy, atomic, readonly, nullable) NSString *downloadFilePath;
+
+/**
+ * The timings of the download, completed once the image or the error has been delivered.
+ */
+@property (strong, nonatomic, readonly, nonnull) SDWebImageDownloaderMetrics *metrics;
+
+/**
+ * A block called on the main queue with `metrics` once the image or the error has been delivered. Not called if the download is cancelled.
+ */
+@property (copy, nonatomic, nullable) SDWebImageDownloaderMetricsBlock metricsBlock;
+
+/**
+ * A block called with the change of the memory held by the operation: the body buffered in memory, counted at its expected size from the response on, until it has been decoded.
+ * The changes add up to 0 once the operation has been reset.
+ */
+@property (copy, nonatomic, nullable) SDWebImageDownloaderInFlightBytesBlock inFlightBytesBlock;
+
 /**
  * The options for the receiver.
  */
@@ -79,6 +188,16 @@ FOUNDATION_EXPORT NSString * _Nonnull const SDWebImageDownloadFinishNotification
  */
 @property (copy, nonatomic, nullable) SDWebImageContext *context;
 
+/**
+ * The pixel size of the image, read from the first bytes of the body when progressive download or `SDWebImageContextImagePixelBudget` needs it. Zero until known.
+ */
+@property (assign, nonatomic, readonly) CGSize imagePixelSize;
+
+/**
+ * The number of frames of the image declared by its header, or seen so far for GIF and animated WebP. Zero until known.
+ */
+@property (assign, nonatomic, readonly) NSUInteger imageFrameCount;
+
 /**
  * The expected size of data.
  */
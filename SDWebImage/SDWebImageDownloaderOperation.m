@@ -10,24 +10,277 @@
 #import "SDWebImageManager.h"
 #import "NSImage+Additions.h"
 #import "SDWebImageCodersManager.h"
+#import "SDWebImageCoderHelper.h"
+#import "SDWebImageTracer.h"
+#import "SDWebImageDataScanner.h"
+#import <CommonCrypto/CommonDigest.h>
+#import <sys/xattr.h>
+#import <sys/mman.h>
 
 NSString *const SDWebImageDownloadStartNotification = @"SDWebImageDownloadStartNotification";
 NSString *const SDWebImageDownloadReceiveResponseNotification = @"SDWebImageDownloadReceiveResponseNotification";
 NSString *const SDWebImageDownloadStopNotification = @"SDWebImageDownloadStopNotification";
 NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinishNotification";
 
-static NSString *const kProgressCallbackKey = @"progress";
-static NSString *const kCompletedCallbackKey = @"completed";
+#define LOCK(lock) dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
+#define UNLOCK(lock) dispatch_semaphore_signal(lock);
 
-typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
+// Wrap each byte range of the data into a dispatch data region without copying, the regions retain the data itself
+static dispatch_data_t SDDispatchDataWithData(NSData *data) {
+    __block dispatch_data_t dispatchData = dispatch_data_empty;
+    [data enumerateByteRangesUsingBlock:^(const void * _Nonnull bytes, NSRange byteRange, BOOL * _Nonnull stop) {
+        dispatch_data_t region = dispatch_data_create(bytes, byteRange.length, NULL, ^{
+            (void)data;
+        });
+        dispatchData = dispatch_data_create_concat(dispatchData, region);
+    }];
+    return dispatchData;
+}
+
+// Map the first bytes of a file, the mapping stays valid once the file is closed or removed
+static NSData * SDMappedDataWithFileDescriptor(int fileDescriptor, size_t length) {
+    if (fileDescriptor < 0 || length == 0) {
+        return nil;
+    }
+    void *bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    if (bytes == MAP_FAILED) {
+        return nil;
+    }
+    return [[NSData alloc] initWithBytesNoCopy:bytes length:length deallocator:^(void * _Nonnull bytes, NSUInteger length) {
+        munmap(bytes, length);
+    }];
+}
+
+static const char *kPartialDataValidatorAttributeName = "com.hackemist.SDWebImageDownloader.validator";
+// Smaller bodies are quicker to download again than to keep
+static const NSUInteger kMinimumPartialDataSize = 16 * 1024;
+
+/**
+ * The partially received bodies of the downloads cancelled or failed midway, in one file per URL with the validator of the response in an extended attribute.
+ * The least recently stored files are removed first when over the size limit.
+ */
+@interface SDWebImageDownloaderPartialDataStore : NSObject
+
++ (nonnull instancetype)sharedStore;
+
+- (nullable NSData *)dataForURL:(nonnull NSURL *)url validator:(NSString * _Nullable * _Nonnull)validator;
+- (void)storeData:(nonnull NSData *)data validator:(nonnull NSString *)validator forURL:(nonnull NSURL *)url maxSize:(NSUInteger)maxSize;
+- (void)removeDataForURL:(nonnull NSURL *)url;
+
+@end
+
+@implementation SDWebImageDownloaderPartialDataStore {
+    NSString *_directoryPath;
+    dispatch_queue_t _ioQueue;
+    NSFileManager *_fileManager;
+}
+
++ (nonnull instancetype)sharedStore {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        NSArray<NSString *> *paths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+        _directoryPath = [paths.firstObject stringByAppendingPathComponent:@"com.hackemist.SDWebImageDownloader.partial"];
+        _ioQueue = dispatch_queue_create("com.hackemist.SDWebImageDownloaderPartialDataStore", DISPATCH_QUEUE_SERIAL);
+        dispatch_sync(_ioQueue, ^{
+            self->_fileManager = [NSFileManager new];
+        });
+    }
+    return self;
+}
+
+- (nonnull NSString *)pathForURL:(nonnull NSURL *)url {
+    const char *str = url.absoluteString.UTF8String ?: "";
+    unsigned char r[CC_MD5_DIGEST_LENGTH];
+    CC_MD5(str, (CC_LONG)strlen(str), r);
+    NSString *filename = [NSString stringWithFormat:@"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+                          r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9], r[10], r[11], r[12], r[13], r[14], r[15]];
+    return [_directoryPath stringByAppendingPathComponent:filename];
+}
+
+- (nullable NSData *)dataForURL:(nonnull NSURL *)url validator:(NSString * _Nullable * _Nonnull)validator {
+    __block NSData *data = nil;
+    __block NSString *storedValidator = nil;
+    dispatch_sync(_ioQueue, ^{
+        NSString *path = [self pathForURL:url];
+        ssize_t length = getxattr(path.fileSystemRepresentation, kPartialDataValidatorAttributeName, NULL, 0, 0, 0);
+        if (length <= 0) {
+            return;
+        }
+        NSMutableData *validatorData = [NSMutableData dataWithLength:length];
+        if (getxattr(path.fileSystemRepresentation, kPartialDataValidatorAttributeName, validatorData.mutableBytes, length, 0, 0) != length) {
+            return;
+        }
+        storedValidator = [[NSString alloc] initWithData:validatorData encoding:NSUTF8StringEncoding];
+        data = storedValidator ? [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:nil] : nil;
+    });
+    *validator = data ? storedValidator : nil;
+    return data;
+}
+
+- (void)storeData:(nonnull NSData *)data validator:(nonnull NSString *)validator forURL:(nonnull NSURL *)url maxSize:(NSUInteger)maxSize {
+    if (data.length > maxSize) {
+        return;
+    }
+    dispatch_async(_ioQueue, ^{
+        [self->_fileManager createDirectoryAtPath:self->_directoryPath withIntermediateDirectories:YES attributes:nil error:nil];
+        NSString *path = [self pathForURL:url];
+        NSData *validatorData = [validator dataUsingEncoding:NSUTF8StringEncoding];
+        if (![data writeToFile:path atomically:YES] || setxattr(path.fileSystemRepresentation, kPartialDataValidatorAttributeName, validatorData.bytes, validatorData.length, 0, 0) != 0) {
+            [self->_fileManager removeItemAtPath:path error:nil];
+            return;
+        }
+        [self trimToSize:maxSize];
+    });
+}
+
+- (void)removeDataForURL:(nonnull NSURL *)url {
+    dispatch_async(_ioQueue, ^{
+        [self->_fileManager removeItemAtPath:[self pathForURL:url] error:nil];
+    });
+}
+
+// Call on the io queue
+- (void)trimToSize:(NSUInteger)maxSize {
+    NSURL *directoryURL = [NSURL fileURLWithPath:_directoryPath isDirectory:YES];
+    NSArray<NSString *> *resourceKeys = @[NSURLContentModificationDateKey, NSURLTotalFileAllocatedSizeKey];
+    NSArray<NSURL *> *fileURLs = [_fileManager contentsOfDirectoryAtURL:directoryURL includingPropertiesForKeys:resourceKeys options:NSDirectoryEnumerationSkipsHiddenFiles error:nil];
+    NSMutableDictionary<NSURL *, NSDictionary<NSString *, id> *> *files = [NSMutableDictionary dictionary];
+    NSUInteger totalSize = 0;
+    for (NSURL *fileURL in fileURLs) {
+        NSDictionary<NSString *, id> *resourceValues = [fileURL resourceValuesForKeys:resourceKeys error:nil];
+        totalSize += [resourceValues[NSURLTotalFileAllocatedSizeKey] unsignedIntegerValue];
+        files[fileURL] = resourceValues;
+    }
+    if (totalSize <= maxSize) {
+        return;
+    }
+    NSArray<NSURL *> *sortedFileURLs = [files keysSortedByValueWithOptions:NSSortConcurrent usingComparator:^NSComparisonResult(id obj1, id obj2) {
+        return [obj1[NSURLContentModificationDateKey] compare:obj2[NSURLContentModificationDateKey]];
+    }];
+    for (NSURL *fileURL in sortedFileURLs) {
+        if (totalSize <= maxSize) {
+            break;
+        }
+        if ([_fileManager removeItemAtURL:fileURL error:nil]) {
+            totalSize -= [files[fileURL][NSURLTotalFileAllocatedSizeKey] unsignedIntegerValue];
+        }
+    }
+}
+
+@end
+
+// The duration between two dates, negative if either is unknown
+static inline NSTimeInterval SDTimeIntervalBetweenDates(NSDate *startDate, NSDate *endDate) {
+    if (!startDate || !endDate) {
+        return -1;
+    }
+    return [endDate timeIntervalSinceDate:startDate];
+}
+
+@interface SDWebImageDownloaderMetrics ()
+
+@property (strong, nonatomic, readwrite, nullable) NSURL *URL;
+@property (strong, nonatomic, readwrite, nullable) NSURLSessionTaskMetrics *taskMetrics API_AVAILABLE(macosx(10.12), ios(10.0), tvos(10.0), watchos(3.0));
+@property (strong, nonatomic, readwrite, nullable) NSDate *creationDate;
+@property (strong, nonatomic, readwrite, nullable) NSDate *startDate;
+@property (strong, nonatomic, readwrite, nullable) NSDate *responseDate;
+@property (strong, nonatomic, readwrite, nullable) NSDate *loadingEndDate;
+@property (strong, nonatomic, readwrite, nullable) NSDate *decodeStartDate;
+@property (strong, nonatomic, readwrite, nullable) NSDate *decodeEndDate;
+@property (strong, nonatomic, readwrite, nullable) NSDate *deliveryDate;
+@property (assign, nonatomic, readwrite) NSTimeInterval domainLookupDuration;
+@property (assign, nonatomic, readwrite) NSTimeInterval connectDuration;
+@property (assign, nonatomic, readwrite) NSTimeInterval secureConnectionDuration;
+@property (assign, nonatomic, readwrite) NSTimeInterval timeToFirstByte;
+@property (assign, nonatomic, readwrite) NSTimeInterval transferDuration;
+
+@end
+
+@implementation SDWebImageDownloaderMetrics
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _creationDate = [NSDate date];
+        _domainLookupDuration = -1;
+        _connectDuration = -1;
+        _secureConnectionDuration = -1;
+        _timeToFirstByte = -1;
+        _transferDuration = -1;
+    }
+    return self;
+}
+
+- (void)setTaskMetrics:(NSURLSessionTaskMetrics *)taskMetrics {
+    _taskMetrics = taskMetrics;
+    NSURLSessionTaskTransactionMetrics *transactionMetrics = taskMetrics.transactionMetrics.lastObject;
+    self.domainLookupDuration = SDTimeIntervalBetweenDates(transactionMetrics.domainLookupStartDate, transactionMetrics.domainLookupEndDate);
+    self.connectDuration = SDTimeIntervalBetweenDates(transactionMetrics.connectStartDate, transactionMetrics.connectEndDate);
+    self.secureConnectionDuration = SDTimeIntervalBetweenDates(transactionMetrics.secureConnectionStartDate, transactionMetrics.secureConnectionEndDate);
+    self.timeToFirstByte = SDTimeIntervalBetweenDates(transactionMetrics.requestStartDate, transactionMetrics.responseStartDate);
+    self.transferDuration = SDTimeIntervalBetweenDates(transactionMetrics.responseStartDate, transactionMetrics.responseEndDate);
+}
+
+- (NSTimeInterval)queueDuration {
+    return SDTimeIntervalBetweenDates(self.creationDate, self.startDate);
+}
+
+- (NSTimeInterval)decodeDuration {
+    return SDTimeIntervalBetweenDates(self.decodeStartDate, self.decodeEndDate);
+}
+
+- (NSTimeInterval)deliveryDuration {
+    return SDTimeIntervalBetweenDates(self.decodeEndDate ?: self.loadingEndDate, self.deliveryDate);
+}
+
+- (NSTimeInterval)totalDuration {
+    return SDTimeIntervalBetweenDates(self.creationDate, self.deliveryDate);
+}
+
+@end
+
+/**
+ * The handlers added by one `addHandlersForProgress:completed:` call, this is the token to cancel them.
+ */
+@interface SDWebImageDownloaderCallbacks : NSObject
+
+@property (copy, nonatomic, nullable, readonly) SDWebImageDownloaderProgressBlock progressBlock;
+@property (copy, nonatomic, nullable, readonly) SDWebImageDownloaderCompletedBlock completedBlock;
+
+@end
+
+@implementation SDWebImageDownloaderCallbacks
+
+- (nonnull instancetype)initWithProgressBlock:(nullable SDWebImageDownloaderProgressBlock)progressBlock completedBlock:(nullable SDWebImageDownloaderCompletedBlock)completedBlock {
+    if ((self = [super init])) {
+        _progressBlock = [progressBlock copy];
+        _completedBlock = [completedBlock copy];
+    }
+    return self;
+}
+
+@end
 
 @interface SDWebImageDownloaderOperation ()
 
-@property (strong, nonatomic, nonnull) NSMutableArray<SDCallbacksDictionary *> *callbackBlocks;
+// The handlers are never mutated in place: each change swaps immutable arrays, so the readers only hold the lock to read a pointer
+@property (strong, nonatomic, nonnull) NSArray<SDWebImageDownloaderCallbacks *> *callbacks;
+@property (strong, nonatomic, nonnull) NSArray<SDWebImageDownloaderProgressBlock> *progressBlocks;
+@property (strong, nonatomic, nonnull) NSArray<SDWebImageDownloaderCompletedBlock> *completedBlocks;
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t callbacksLock; // a lock to keep the access to the handlers thread-safe
+@property (assign, nonatomic) NSTimeInterval progressTime; // the system uptime of the latest progress notification. Only accessed on the delegate queue
+@property (assign, nonatomic) NSInteger progressSize; // the received size of the latest progress notification. Only accessed on the delegate queue
 
 @property (assign, nonatomic, getter = isExecuting) BOOL executing;
 @property (assign, nonatomic, getter = isFinished) BOOL finished;
-@property (strong, nonatomic, nullable) NSMutableData *imageData;
+@property (strong, nonatomic, nullable) dispatch_data_t imageData; // the received chunks, appended without copying
 @property (copy, nonatomic, nullable) NSData *cachedData;
 @property (assign, nonatomic, readwrite) NSInteger expectedSize;
 @property (strong, nonatomic, nullable, readwrite) NSURLResponse *response;
@@ -40,13 +293,28 @@ typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
 
 @property (strong, nonatomic, readwrite, nullable) NSURLSessionTask *dataTask;
 
-@property (strong, nonatomic, nullable) dispatch_queue_t barrierQueue;
-
 #if SD_UIKIT
 @property (assign, nonatomic) UIBackgroundTaskIdentifier backgroundTaskId;
 #endif
 
 @property (strong, nonatomic, nullable) id<SDWebImageProgressiveCoder> progressiveCoder;
+@property (strong, nonatomic, nullable) NSOperation *progressiveDecodeOperation; // the latest progressive decode, only one is in flight at a time
+@property (strong, nonatomic, nullable) SDWebImageDataScanner *dataScanner;
+@property (assign, nonatomic) NSUInteger progressiveDecodeSize; // the data size of the latest progressive decode
+@property (assign, nonatomic) NSUInteger progressiveDecodeBoundaryCount; // the boundary count of the latest progressive decode
+@property (assign, nonatomic) NSTimeInterval progressiveDecodeTime; // the system uptime of the latest progressive decode
+@property (assign, atomic) BOOL receivedAllData; // once set, the pending progressive decodes are stale
+@property (strong, nonatomic, nullable) UIImage *pendingProgressiveImage; // the latest progressive image not delivered on the main queue yet
+@property (strong, nonatomic, nullable) NSData *resumeData; // the partial body the request asks the rest of, until the response
+@property (strong, nonatomic, readwrite, nonnull) SDWebImageDownloaderMetrics *metrics;
+// The file the body is streamed to, if any. Only accessed on the delegate queue, the path is read by the completion blocks too
+@property (assign, nonatomic) int downloadFileDescriptor;
+@property (copy, atomic, readwrite, nullable) NSString *downloadFilePath;
+@property (assign, nonatomic) size_t downloadFileSize;
+@property (assign, nonatomic) BOOL shouldKeepDownloadFile; // set once the download into the file succeeded, the file is kept until the completion blocks have been called
+@property (assign, nonatomic) int64_t inFlightBytes; // the bytes reported to `inFlightBytesBlock`. Only accessed on the delegate queue
+@property (strong, nonatomic, nullable) NSError *pixelBudgetError; // set when the download is aborted for exceeding the pixel budget
+@property (assign, nonatomic) CGSize pixelBudgetFittingSize; // the size to decode the image downsampled at to fit the pixel budget, zero if it fits
 
 @end
 
@@ -55,6 +323,18 @@ typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
 @synthesize executing = _executing;
 @synthesize finished = _finished;
 
++ (nonnull NSOperationQueue *)decodeQueue {
+    static NSOperationQueue *decodeQueue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        // Shared by all the downloads, so that decoding never blocks the session delegate queue and is bounded by the number of cores
+        decodeQueue = [NSOperationQueue new];
+        decodeQueue.name = @"com.hackemist.SDWebImageDownloaderOperationDecodeQueue";
+        decodeQueue.maxConcurrentOperationCount = MAX([NSProcessInfo processInfo].activeProcessorCount, 1);
+    });
+    return decodeQueue;
+}
+
 - (nonnull instancetype)init {
     return [self initWithRequest:nil inSession:nil options:0];
 }
@@ -66,45 +346,79 @@ typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
         _request = [request copy];
         _shouldDecompressImages = YES;
         _options = options;
-        _callbackBlocks = [NSMutableArray new];
+        _callbacks = @[];
+        _progressBlocks = @[];
+        _completedBlocks = @[];
+        _callbacksLock = dispatch_semaphore_create(1);
         _executing = NO;
         _finished = NO;
         _expectedSize = 0;
+        _minimumProgressInterval = 0.05;
+        _minimumProgressiveDecodeInterval = 0.1;
+        _minimumProgressiveDecodeBytes = 32 * 1024;
+        _maxPartialDataCacheSize = 20 * 1024 * 1024;
+        _diskStreamingThreshold = 8 * 1024 * 1024;
+        _downloadFileDescriptor = -1;
+        _metrics = [SDWebImageDownloaderMetrics new];
+        _metrics.URL = request.URL;
         _unownedSession = session;
-        _barrierQueue = dispatch_queue_create("com.hackemist.SDWebImageDownloaderOperationBarrierQueue", DISPATCH_QUEUE_CONCURRENT);
     }
     return self;
 }
 
+- (void)dealloc {
+    // The reset on the delegate queue may not have run
+    if (_inFlightBytes != 0 && _inFlightBytesBlock) {
+        _inFlightBytesBlock(-_inFlightBytes);
+    }
+}
+
 - (nullable id)addHandlersForProgress:(nullable SDWebImageDownloaderProgressBlock)progressBlock
                             completed:(nullable SDWebImageDownloaderCompletedBlock)completedBlock {
-    SDCallbacksDictionary *callbacks = [NSMutableDictionary new];
-    if (progressBlock) callbacks[kProgressCallbackKey] = [progressBlock copy];
-    if (completedBlock) callbacks[kCompletedCallbackKey] = [completedBlock copy];
-    dispatch_barrier_async(self.barrierQueue, ^{
-        [self.callbackBlocks addObject:callbacks];
-    });
+    SDWebImageDownloaderCallbacks *callbacks = [[SDWebImageDownloaderCallbacks alloc] initWithProgressBlock:progressBlock completedBlock:completedBlock];
+    LOCK(self.callbacksLock);
+    [self setCallbacksLocked:[self.callbacks arrayByAddingObject:callbacks]];
+    UNLOCK(self.callbacksLock);
     return callbacks;
 }
 
-- (nullable NSArray<id> *)callbacksForKey:(NSString *)key {
-    __block NSMutableArray<id> *callbacks = nil;
-    dispatch_sync(self.barrierQueue, ^{
-        // We need to remove [NSNull null] because there might not always be a progress block for each callback
-        callbacks = [[self.callbackBlocks valueForKey:key] mutableCopy];
-        [callbacks removeObjectIdenticalTo:[NSNull null]];
-    });
-    return [callbacks copy];    // strip mutability here
+// Call with the callbacks lock held
+- (void)setCallbacksLocked:(nonnull NSArray<SDWebImageDownloaderCallbacks *> *)callbacks {
+    NSMutableArray<SDWebImageDownloaderProgressBlock> *progressBlocks = [NSMutableArray arrayWithCapacity:callbacks.count];
+    NSMutableArray<SDWebImageDownloaderCompletedBlock> *completedBlocks = [NSMutableArray arrayWithCapacity:callbacks.count];
+    for (SDWebImageDownloaderCallbacks *entry in callbacks) {
+        if (entry.progressBlock) [progressBlocks addObject:entry.progressBlock];
+        if (entry.completedBlock) [completedBlocks addObject:entry.completedBlock];
+    }
+    self.callbacks = callbacks;
+    self.progressBlocks = [progressBlocks copy];
+    self.completedBlocks = [completedBlocks copy];
+}
+
+- (nonnull NSArray<SDWebImageDownloaderProgressBlock> *)progressBlocksSnapshot {
+    LOCK(self.callbacksLock);
+    NSArray<SDWebImageDownloaderProgressBlock> *progressBlocks = self.progressBlocks;
+    UNLOCK(self.callbacksLock);
+    return progressBlocks;
+}
+
+- (nonnull NSArray<SDWebImageDownloaderCompletedBlock> *)completedBlocksSnapshot {
+    LOCK(self.callbacksLock);
+    NSArray<SDWebImageDownloaderCompletedBlock> *completedBlocks = self.completedBlocks;
+    UNLOCK(self.callbacksLock);
+    return completedBlocks;
 }
 
 - (BOOL)cancel:(nullable id)token {
-    __block BOOL shouldCancel = NO;
-    dispatch_barrier_sync(self.barrierQueue, ^{
-        [self.callbackBlocks removeObjectIdenticalTo:token];
-        if (self.callbackBlocks.count == 0) {
-            shouldCancel = YES;
-        }
-    });
+    LOCK(self.callbacksLock);
+    NSUInteger index = [self.callbacks indexOfObjectIdenticalTo:token];
+    if (index != NSNotFound) {
+        NSMutableArray<SDWebImageDownloaderCallbacks *> *callbacks = [self.callbacks mutableCopy];
+        [callbacks removeObjectAtIndex:index];
+        [self setCallbacksLocked:[callbacks copy]];
+    }
+    BOOL shouldCancel = self.callbacks.count == 0;
+    UNLOCK(self.callbacksLock);
     if (shouldCancel) {
         [self cancel];
     }
@@ -112,6 +426,8 @@ typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
 }
 
 - (void)start {
+    NSNumber *traceIdentifier = SDTraceIdentifierFromContext(self.context);
+    SD_TRACE_END(@"download queue wait", traceIdentifier);
     @synchronized (self) {
         if (self.isCancelled) {
             self.finished = YES;
@@ -169,14 +485,30 @@ typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
             }
         }
         
-        self.dataTask = [session dataTaskWithRequest:self.request];
+        NSURLRequest *request = self.request;
+        if (self.maxPartialDataCacheSize > 0 && request.URL && ![request valueForHTTPHeaderField:@"Range"]) {
+            NSString *validator = nil;
+            NSData *resumeData = [[SDWebImageDownloaderPartialDataStore sharedStore] dataForURL:request.URL validator:&validator];
+            if (resumeData.length > 0) {
+                // Ask the rest of the body, the server sends it all instead if the validator does not match anymore
+                NSMutableURLRequest *mutableRequest = [request mutableCopy];
+                [mutableRequest setValue:[NSString stringWithFormat:@"bytes=%lu-", (unsigned long)resumeData.length] forHTTPHeaderField:@"Range"];
+                [mutableRequest setValue:validator forHTTPHeaderField:@"If-Range"];
+                request = [mutableRequest copy];
+                self.resumeData = resumeData;
+            }
+        }
+        
+        self.dataTask = [session dataTaskWithRequest:request];
+        self.metrics.startDate = [NSDate date];
         self.executing = YES;
     }
     
     [self.dataTask resume];
 
     if (self.dataTask) {
-        for (SDWebImageDownloaderProgressBlock progressBlock in [self callbacksForKey:kProgressCallbackKey]) {
+        SD_TRACE_BEGIN(@"network", traceIdentifier);
+        for (SDWebImageDownloaderProgressBlock progressBlock in [self progressBlocksSnapshot]) {
             progressBlock(0, NSURLResponseUnknownLength, self.request.URL);
         }
         __weak typeof(self) weakSelf = self;
@@ -233,10 +565,9 @@ typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
 }
 
 - (void)reset {
-    __weak typeof(self) weakSelf = self;
-    dispatch_barrier_async(self.barrierQueue, ^{
-        [weakSelf.callbackBlocks removeAllObjects];
-    });
+    LOCK(self.callbacksLock);
+    [self setCallbacksLocked:@[]];
+    UNLOCK(self.callbacksLock);
     self.dataTask = nil;
     
     NSOperationQueue *delegateQueue;
@@ -247,8 +578,14 @@ typedef NSMutableDictionary<NSString *, id> SDCallbacksDictionary;
     }
     if (delegateQueue) {
         NSAssert(delegateQueue.maxConcurrentOperationCount == 1, @"NSURLSession delegate queue should be a serial queue");
+        // Keep the operation until its file is closed, the completion blocks may still link it
         [delegateQueue addOperationWithBlock:^{
-            weakSelf.imageData = nil;
+            if (self.isCancelled && !self.receivedAllData) {
+                [self storePartialData];
+            }
+            [self closeDownloadFile];
+            self.imageData = nil;
+            [self reportInFlightBytes:0];
         }];
     }
     
@@ -283,12 +620,46 @@ didReceiveResponse:(NSURLResponse *)response
     NSURLSessionResponseDisposition disposition = NSURLSessionResponseAllow;
     NSInteger expected = (NSInteger)response.expectedContentLength;
     expected = expected > 0 ? expected : 0;
+    
+    NSData *resumeData = self.resumeData;
+    if (resumeData) {
+        self.resumeData = nil;
+        // The stored body is used once, whatever the response
+        [[SDWebImageDownloaderPartialDataStore sharedStore] removeDataForURL:self.request.URL];
+        BOOL isPartialResponse = [response isKindOfClass:[NSHTTPURLResponse class]] && ((NSHTTPURLResponse *)response).statusCode == 206;
+        if (isPartialResponse && [self rangeStartOfResponse:(NSHTTPURLResponse *)response] != resumeData.length) {
+            // Another range than the one asked, it can not be joined to the stored body which is gone now: ask the full body again
+            [self restartDataTaskInSession:session];
+            if (completionHandler) {
+                completionHandler(NSURLSessionResponseCancel);
+            }
+            return;
+        } else if (isPartialResponse) {
+            // The rest of the body follows the stored one, otherwise the full body comes as usual
+            self.imageData = SDDispatchDataWithData(resumeData);
+            if (expected > 0) {
+                expected += resumeData.length;
+            }
+            if (((self.options & SDWebImageDownloaderProgressiveDownload) && expected > 0) || [self pixelBudget] > 0) {
+                self.dataScanner = [SDWebImageDataScanner new];
+                [self.dataScanner scanData:resumeData];
+            }
+        }
+    }
     self.expectedSize = expected;
     self.response = response;
+    self.metrics.responseDate = [NSDate date];
+    SD_TRACE_MARK(@"response", SDTraceIdentifierFromContext(self.context), @{@"expectedSize" : @(expected)});
+    if (disposition == NSURLSessionResponseAllow && self.diskStreamingThreshold > 0 && expected >= (NSInteger)self.diskStreamingThreshold) {
+        [self openDownloadFile];
+    }
+    if (disposition == NSURLSessionResponseAllow) {
+        [self reportInFlightBytes:[self inMemorySize]];
+    }
     
     //'304 Not Modified' is an exceptional one. It should be treated as cancelled.
     if (![response respondsToSelector:@selector(statusCode)] || (((NSHTTPURLResponse *)response).statusCode < 400 && ((NSHTTPURLResponse *)response).statusCode != 304)) {
-        for (SDWebImageDownloaderProgressBlock progressBlock in [self callbacksForKey:kProgressCallbackKey]) {
+        for (SDWebImageDownloaderProgressBlock progressBlock in [self progressBlocksSnapshot]) {
             progressBlock(0, expected, self.request.URL);
         }
     } else {
@@ -307,45 +678,57 @@ didReceiveResponse:(NSURLResponse *)response
 }
 
 - (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask didReceiveData:(NSData *)data {
-    if (!self.imageData) {
-        self.imageData = [[NSMutableData alloc] initWithCapacity:self.expectedSize];
+    if (self.pixelBudgetError) {
+        // Aborted already
+        return;
+    }
+    if (self.downloadFileDescriptor >= 0) {
+        if (![self writeDataToDownloadFile:data]) {
+            // The body can not be completed, fail the download
+            [dataTask cancel];
+            return;
+        }
+    } else {
+        if (!self.imageData) {
+            self.imageData = dispatch_data_empty;
+        }
+        self.imageData = dispatch_data_create_concat(self.imageData, SDDispatchDataWithData(data));
+        [self reportInFlightBytes:[self inMemorySize]];
     }
-    [self.imageData appendData:data];
 
-    if ((self.options & SDWebImageDownloaderProgressiveDownload) && self.expectedSize > 0) {
+    unsigned long long pixelBudget = [self pixelBudget];
+    if (((self.options & SDWebImageDownloaderProgressiveDownload) && self.expectedSize > 0) || pixelBudget > 0) {
+        if (!self.dataScanner) {
+            self.dataScanner = [SDWebImageDataScanner new];
+        }
+        [self.dataScanner scanData:data];
+    }
+    if (pixelBudget > 0 && ![self checkPixelBudget:pixelBudget]) {
+        // Do not download the rest of an image which would not be decoded
+        [dataTask cancel];
+        return;
+    }
+    
+    // The full size image is not decoded progressively when it exceeds the pixel budget
+    if ((self.options & SDWebImageDownloaderProgressiveDownload) && self.expectedSize > 0 && CGSizeEqualToSize(self.pixelBudgetFittingSize, CGSizeZero) && [self shouldProgressivelyDecode]) {
         // Get the image data
-        NSData *imageData = [self.imageData copy];
+        NSData *imageData = [self contiguousImageData];
         // Get the total bytes downloaded
         const NSInteger totalSize = imageData.length;
         // Get the finish status
         BOOL finished = (totalSize >= self.expectedSize);
         
-        if (!self.progressiveCoder) {
-            // We need to create a new instance for progressive decoding to avoid conflicts
-            for (id<SDWebImageCoder>coder in [SDWebImageCodersManager sharedInstance].coders) {
-                if ([coder conformsToProtocol:@protocol(SDWebImageProgressiveCoder)] &&
-                    [((id<SDWebImageProgressiveCoder>)coder) canIncrementallyDecodeFromData:imageData]) {
-                    self.progressiveCoder = [[[coder class] alloc] init];
-                    break;
-                }
-            }
-        }
-        
-        UIImage *image = [self.progressiveCoder incrementallyDecodedImageWithData:imageData finished:finished];
-        if (image) {
-            NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:self.request.URL];
-            image = [self scaledImageForKey:key image:image];
-            if (self.shouldDecompressImages) {
-                image = [[SDWebImageCodersManager sharedInstance] decompressedImageWithImage:image data:&data options:@{SDWebImageCoderScaleDownLargeImagesKey: @(NO)}];
-            }
-            
-            [self callCompletionBlocksWithImage:image imageData:nil error:nil finished:NO];
-        }
+        self.progressiveDecodeSize = totalSize;
+        self.progressiveDecodeBoundaryCount = self.dataScanner.boundaryCount;
+        self.progressiveDecodeTime = [NSProcessInfo processInfo].systemUptime;
+        NSOperation *decodeOperation = [NSBlockOperation blockOperationWithBlock:^{
+            [self progressivelyDecodeImageData:imageData finished:finished];
+        }];
+        self.progressiveDecodeOperation = decodeOperation;
+        [self addDecodeOperation:decodeOperation];
     }
 
-    for (SDWebImageDownloaderProgressBlock progressBlock in [self callbacksForKey:kProgressCallbackKey]) {
-        progressBlock(self.imageData.length, self.expectedSize, self.request.URL);
-    }
+    [self notifyProgressIfNeeded];
 }
 
 - (void)URLSession:(NSURLSession *)session
@@ -366,7 +749,37 @@ didReceiveResponse:(NSURLResponse *)response
 
 #pragma mark NSURLSessionTaskDelegate
 
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didFinishCollectingMetrics:(NSURLSessionTaskMetrics *)metrics API_AVAILABLE(macosx(10.12), ios(10.0), tvos(10.0), watchos(3.0)) {
+    self.metrics.taskMetrics = metrics;
+    NSNumber *traceIdentifier = SDTraceIdentifierFromContext(self.context);
+    if (!traceIdentifier) {
+        return;
+    }
+    // The sub-phases of "network", one set per transaction (such as each redirection)
+    for (NSURLSessionTaskTransactionMetrics *transactionMetrics in metrics.transactionMetrics) {
+        SD_TRACE_PHASE(@"dns lookup", transactionMetrics.domainLookupStartDate, transactionMetrics.domainLookupEndDate, traceIdentifier);
+        SD_TRACE_PHASE(@"connect", transactionMetrics.connectStartDate, transactionMetrics.connectEndDate, traceIdentifier);
+        SD_TRACE_PHASE(@"tls handshake", transactionMetrics.secureConnectionStartDate, transactionMetrics.secureConnectionEndDate, traceIdentifier);
+        SD_TRACE_PHASE(@"request", transactionMetrics.requestStartDate, transactionMetrics.requestEndDate, traceIdentifier);
+        SD_TRACE_PHASE(@"response", transactionMetrics.responseStartDate, transactionMetrics.responseEndDate, traceIdentifier);
+    }
+}
+
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error {
+    @synchronized(self) {
+        if (self.dataTask && task != self.dataTask) {
+            // A task replaced by `restartDataTaskInSession:`, the operation goes on with the new one
+            return;
+        }
+    }
+    if (self.pixelBudgetError) {
+        // Report why the task has been cancelled
+        error = self.pixelBudgetError;
+    }
+    self.receivedAllData = YES;
+    self.metrics.loadingEndDate = [NSDate date];
+    NSNumber *traceIdentifier = SDTraceIdentifierFromContext(self.context);
+    SD_TRACE_END(@"network", traceIdentifier);
     @synchronized(self) {
         self.dataTask = nil;
         __weak typeof(self) weakSelf = self;
@@ -379,13 +792,21 @@ didReceiveResponse:(NSURLResponse *)response
     }
     
     if (error) {
+        if (!self.pixelBudgetError) {
+            [self storePartialData];
+        }
         [self callCompletionBlocksWithError:error];
     } else {
-        if ([self callbacksForKey:kCompletedCallbackKey].count > 0) {
+        [self notifyFinalProgressIfNeeded];
+        if (self.downloadFileDescriptor >= 0) {
+            // The file is complete, the completion blocks may link it
+            self.shouldKeepDownloadFile = YES;
+        }
+        if ([self completedBlocksSnapshot].count > 0) {
             /**
              *  If you specified to use `NSURLCache`, then the response you get here is what you need.
              */
-            NSData *imageData = [self.imageData copy];
+            NSData *imageData = [self contiguousImageData];
             if (imageData) {
                 /**  if you specified to only use cached data via `SDWebImageDownloaderIgnoreCachedResponse`,
                  *  then we should check if the cached data is equal to image data
@@ -394,35 +815,21 @@ didReceiveResponse:(NSURLResponse *)response
                     // call completion block with nil
                     [self callCompletionBlocksWithImage:nil imageData:nil error:nil finished:YES];
                 } else {
-                    UIImage *image = [[SDWebImageCodersManager sharedInstance] decodedImageWithData:imageData];
-                    NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:self.request.URL];
-                    image = [self scaledImageForKey:key image:image];
-                    
-                    BOOL shouldDecode = YES;
-                    // Do not force decoding animated GIFs and WebPs
-                    if (image.images) {
-                        shouldDecode = NO;
-                    } else {
-#ifdef SD_WEBP
-                        SDImageFormat imageFormat = [NSData sd_imageFormatForImageData:imageData];
-                        if (imageFormat == SDImageFormatWebP) {
-                            shouldDecode = NO;
-                        }
-#endif
-                    }
-                    
-                    if (shouldDecode) {
-                        if (self.shouldDecompressImages) {
-                            BOOL shouldScaleDown = self.options & SDWebImageDownloaderScaleDownLargeImages;
-                            image = [[SDWebImageCodersManager sharedInstance] decompressedImageWithImage:image data:&imageData options:@{SDWebImageCoderScaleDownLargeImagesKey: @(shouldScaleDown)}];
+                    // Decode in the decode queue and keep the operation executing until then, the delegate queue only hands the data off
+                    SD_TRACE_BEGIN(@"decode queue wait", traceIdentifier);
+                    NSOperation *decodeOperation = [NSBlockOperation blockOperationWithBlock:^{
+                        SD_TRACE_END(@"decode queue wait", traceIdentifier);
+                        if (!self.isCancelled) {
+                            [self decodeImageData:imageData];
                         }
+                        [self done];
+                    }];
+                    // The last progressive image must be delivered before the final one
+                    if (self.progressiveDecodeOperation) {
+                        [decodeOperation addDependency:self.progressiveDecodeOperation];
                     }
-                    CGSize imageSize = image.size;
-                    if (imageSize.width == 0 || imageSize.height == 0) {
-                        [self callCompletionBlocksWithError:[NSError errorWithDomain:SDWebImageErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Downloaded image has 0 pixels"}]];
-                    } else {
-                        [self callCompletionBlocksWithImage:image imageData:imageData error:nil finished:YES];
-                    }
+                    [self addDecodeOperation:decodeOperation];
+                    return;
                 }
             } else {
                 [self callCompletionBlocksWithError:[NSError errorWithDomain:SDWebImageErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Image data is nil"}]];
@@ -462,7 +869,411 @@ didReceiveResponse:(NSURLResponse *)response
     }
 }
 
+#pragma mark Progress
+
+// Coalesce the per chunk notifications, the last one is always delivered
+- (void)notifyProgressIfNeeded {
+    NSArray<SDWebImageDownloaderProgressBlock> *progressBlocks = [self progressBlocksSnapshot];
+    if (progressBlocks.count == 0) {
+        return;
+    }
+    NSInteger receivedSize = (NSInteger)[self receivedSize];
+    NSTimeInterval now = [NSProcessInfo processInfo].systemUptime;
+    BOOL finished = self.expectedSize > 0 && receivedSize >= self.expectedSize;
+    if (!finished && now - self.progressTime < self.minimumProgressInterval) {
+        return;
+    }
+    self.progressTime = now;
+    self.progressSize = receivedSize;
+    for (SDWebImageDownloaderProgressBlock progressBlock in progressBlocks) {
+        progressBlock(receivedSize, self.expectedSize, self.request.URL);
+    }
+}
+
+// Without an expected size, the last chunk is only known once the task completes
+- (void)notifyFinalProgressIfNeeded {
+    NSInteger receivedSize = (NSInteger)[self receivedSize];
+    if (receivedSize == self.progressSize) {
+        return;
+    }
+    self.progressSize = receivedSize;
+    for (SDWebImageDownloaderProgressBlock progressBlock in [self progressBlocksSnapshot]) {
+        progressBlock(receivedSize, self.expectedSize, self.request.URL);
+    }
+}
+
+#pragma mark Decoding
+
+- (void)addDecodeOperation:(nonnull NSOperation *)decodeOperation {
+    // Match the priority of the download
+    if (self.options & SDWebImageDownloaderHighPriority) {
+        decodeOperation.qualityOfService = NSQualityOfServiceUserInteractive;
+        decodeOperation.queuePriority = NSOperationQueuePriorityHigh;
+    } else if (self.options & SDWebImageDownloaderLowPriority) {
+        decodeOperation.qualityOfService = NSQualityOfServiceUtility;
+        decodeOperation.queuePriority = NSOperationQueuePriorityLow;
+    } else {
+        decodeOperation.qualityOfService = NSQualityOfServiceUserInitiated;
+    }
+    [[[self class] decodeQueue] addOperation:decodeOperation];
+}
+
+- (BOOL)shouldProgressivelyDecode {
+    // Skip when the previous progressive decode is still running, the next one decodes the data received meanwhile
+    if (self.progressiveDecodeOperation && !self.progressiveDecodeOperation.isFinished) {
+        return NO;
+    }
+    NSUInteger receivedSize = [self receivedSize];
+    if (receivedSize >= (NSUInteger)self.expectedSize) {
+        return YES;
+    }
+    if (receivedSize - self.progressiveDecodeSize < self.minimumProgressiveDecodeBytes) {
+        return NO;
+    }
+    if ([NSProcessInfo processInfo].systemUptime - self.progressiveDecodeTime < self.minimumProgressiveDecodeInterval) {
+        return NO;
+    }
+    // Decoding again in the middle of a progressive scan or a row would redraw nearly the same image
+    if (self.dataScanner.hasBoundaries && self.dataScanner.boundaryCount == self.progressiveDecodeBoundaryCount) {
+        return NO;
+    }
+    return YES;
+}
+
+- (void)progressivelyDecodeImageData:(NSData *)imageData finished:(BOOL)finished {
+    // The final decode is coming, this partial image is stale
+    if (self.isCancelled || self.receivedAllData) {
+        return;
+    }
+    if (!self.progressiveCoder) {
+        // We need to create a new instance for progressive decoding to avoid conflicts
+        for (id<SDWebImageCoder>coder in [SDWebImageCodersManager sharedInstance].coders) {
+            if ([coder conformsToProtocol:@protocol(SDWebImageProgressiveCoder)] &&
+                [((id<SDWebImageProgressiveCoder>)coder) canIncrementallyDecodeFromData:imageData]) {
+                self.progressiveCoder = [[[coder class] alloc] init];
+                break;
+            }
+        }
+    }
+    
+    UIImage *image = [self.progressiveCoder incrementallyDecodedImageWithData:imageData finished:finished];
+    if (image) {
+        NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:self.request.URL];
+        image = [self scaledImageForKey:key image:image];
+        if (self.shouldDecompressImages) {
+            image = [[SDWebImageCodersManager sharedInstance] decompressedImageWithImage:image data:&imageData options:@{SDWebImageCoderScaleDownLargeImagesKey: @(NO)}];
+        }
+        
+        [self callProgressiveCompletionBlocksWithImage:image];
+    }
+}
+
+- (void)callProgressiveCompletionBlocksWithImage:(nonnull UIImage *)image {
+    // If the main queue has not delivered the previous partial image yet, replace it with this newer one
+    BOOL isScheduled;
+    @synchronized (self) {
+        isScheduled = self.pendingProgressiveImage != nil;
+        self.pendingProgressiveImage = image;
+    }
+    if (isScheduled) {
+        return;
+    }
+    NSArray<SDWebImageDownloaderCompletedBlock> *completionBlocks = [self completedBlocksSnapshot];
+    dispatch_main_async_safe(^{
+        UIImage *pendingImage;
+        @synchronized (self) {
+            pendingImage = self.pendingProgressiveImage;
+            self.pendingProgressiveImage = nil;
+        }
+        if (!pendingImage || self.receivedAllData) {
+            return;
+        }
+        for (SDWebImageDownloaderCompletedBlock completedBlock in completionBlocks) {
+            completedBlock(pendingImage, nil, nil, NO);
+        }
+    });
+}
+
+- (void)decodeImageData:(NSData *)imageData {
+    self.metrics.decodeStartDate = [NSDate date];
+    NSNumber *traceIdentifier = SDTraceIdentifierFromContext(self.context);
+    SD_TRACE_BEGIN(@"decode", traceIdentifier);
+    UIImage *image = nil;
+    if (!CGSizeEqualToSize(self.pixelBudgetFittingSize, CGSizeZero)) {
+        // Never decode the full size bitmap of an image over the pixel budget
+        image = [SDWebImageCoderHelper thumbnailImageWithData:imageData pixelSize:self.pixelBudgetFittingSize];
+    }
+    if (!image) {
+        image = [[SDWebImageCodersManager sharedInstance] decodedImageWithData:imageData];
+    }
+    NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:self.request.URL];
+    image = [self scaledImageForKey:key image:image];
+    SD_TRACE_END(@"decode", traceIdentifier);
+    
+    BOOL shouldDecode = YES;
+    // Do not force decoding animated GIFs and WebPs
+    if (image.images) {
+        shouldDecode = NO;
+    } else {
+#ifdef SD_WEBP
+        SDImageFormat imageFormat = [NSData sd_imageFormatForImageData:imageData];
+        if (imageFormat == SDImageFormatWebP) {
+            shouldDecode = NO;
+        }
+#endif
+    }
+    
+    if (shouldDecode) {
+        if (self.shouldDecompressImages) {
+            BOOL shouldScaleDown = self.options & SDWebImageDownloaderScaleDownLargeImages;
+            SD_TRACE_BEGIN(@"force decompress", traceIdentifier);
+            image = [[SDWebImageCodersManager sharedInstance] decompressedImageWithImage:image data:&imageData options:@{SDWebImageCoderScaleDownLargeImagesKey: @(shouldScaleDown)}];
+            SD_TRACE_END(@"force decompress", traceIdentifier);
+        }
+    }
+    self.metrics.decodeEndDate = [NSDate date];
+    CGSize imageSize = image.size;
+    if (imageSize.width == 0 || imageSize.height == 0) {
+        [self callCompletionBlocksWithError:[NSError errorWithDomain:SDWebImageErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Downloaded image has 0 pixels"}]];
+    } else {
+        [self callCompletionBlocksWithImage:image imageData:imageData error:nil finished:YES];
+    }
+}
+
+#pragma mark Pixel budget
+
+- (unsigned long long)pixelBudget {
+    NSNumber *pixelBudget = self.context[SDWebImageContextImagePixelBudget];
+    return [pixelBudget isKindOfClass:[NSNumber class]] ? pixelBudget.unsignedLongLongValue : 0;
+}
+
+- (CGSize)imagePixelSize {
+    SDWebImageDataScanner *dataScanner = self.dataScanner;
+    return CGSizeMake(dataScanner.pixelWidth, dataScanner.pixelHeight);
+}
+
+- (NSUInteger)imageFrameCount {
+    return self.dataScanner.frameCount;
+}
+
+// Return NO, with `pixelBudgetError` set, if the image is known to exceed the budget and can not be downsampled to fit it. Call on the delegate queue
+- (BOOL)checkPixelBudget:(unsigned long long)pixelBudget {
+    SDWebImageDataScanner *dataScanner = self.dataScanner;
+    NSUInteger width = dataScanner.pixelWidth;
+    NSUInteger height = dataScanner.pixelHeight;
+    if (width == 0 || height == 0) {
+        // Not known yet
+        return YES;
+    }
+    NSUInteger frameCount = MAX(dataScanner.frameCount, 1);
+    unsigned long long pixelCount = (unsigned long long)width * height * frameCount;
+    if (pixelCount <= pixelBudget) {
+        return YES;
+    }
+    // Image/IO can downsample a still image while decoding it, but not the frames of an animated image nor WebP
+    if ((self.options & SDWebImageDownloaderScaleDownLargeImages) && frameCount == 1 && dataScanner.format != SDImageFormatWebP) {
+        double scale = sqrt((double)pixelBudget / pixelCount);
+        self.pixelBudgetFittingSize = CGSizeMake(MAX(floor(width * scale), 1), MAX(floor(height * scale), 1));
+        return YES;
+    }
+    NSString *description = [NSString stringWithFormat:@"Image of %lux%lu pixels and %lu frames exceeds the pixel budget of %llu", (unsigned long)width, (unsigned long)height, (unsigned long)frameCount, pixelBudget];
+    self.pixelBudgetError = [NSError errorWithDomain:SDWebImageErrorDomain code:SDWebImageErrorPixelBudgetExceeded userInfo:@{NSLocalizedDescriptionKey : description}];
+    return NO;
+}
+
+#pragma mark Partial data
+
+// The start offset of the `Content-Range` of a partial response, or NSNotFound
+- (NSUInteger)rangeStartOfResponse:(nonnull NSHTTPURLResponse *)response {
+    NSString *contentRange = response.allHeaderFields[@"Content-Range"];
+    NSScanner *scanner = contentRange ? [NSScanner scannerWithString:contentRange] : nil;
+    long long start = 0;
+    if (![scanner scanString:@"bytes" intoString:NULL] || ![scanner scanLongLong:&start] || start < 0) {
+        return NSNotFound;
+    }
+    return (NSUInteger)start;
+}
+
+// Replaces the task with one for the request as given, without the `Range` and `If-Range` of the resume
+- (void)restartDataTaskInSession:(nonnull NSURLSession *)session {
+    @synchronized (self) {
+        if (self.isCancelled || !self.dataTask) {
+            return;
+        }
+        self.dataTask = [session dataTaskWithRequest:self.request];
+        [self.dataTask resume];
+    }
+    SD_TRACE_MARK(@"restart", SDTraceIdentifierFromContext(self.context), nil);
+}
+
+// The validator the rest of the body of the response can be asked with, nil if it can not be resumed
+- (nullable NSString *)resumeValidatorOfResponse:(nullable NSURLResponse *)response {
+    if (![response isKindOfClass:[NSHTTPURLResponse class]]) {
+        return nil;
+    }
+    NSHTTPURLResponse *HTTPResponse = (NSHTTPURLResponse *)response;
+    NSDictionary *headers = HTTPResponse.allHeaderFields;
+    if (HTTPResponse.statusCode != 200 && HTTPResponse.statusCode != 206) {
+        return nil;
+    }
+    if (HTTPResponse.statusCode == 200 && ![[headers[@"Accept-Ranges"] lowercaseString] isEqualToString:@"bytes"]) {
+        return nil;
+    }
+    // The ranges would apply to the encoded body, not to the decoded one received
+    NSString *contentEncoding = [headers[@"Content-Encoding"] lowercaseString];
+    if (contentEncoding.length > 0 && ![contentEncoding isEqualToString:@"identity"]) {
+        return nil;
+    }
+    // `If-Range` only accepts a strong ETag
+    NSString *ETag = headers[@"ETag"];
+    if (ETag.length > 0 && ![ETag hasPrefix:@"W/"]) {
+        return ETag;
+    }
+    NSString *lastModified = headers[@"Last-Modified"];
+    return lastModified.length > 0 ? lastModified : nil;
+}
+
+// Keep the body received so far to resume the download later. Call on the delegate queue
+- (void)storePartialData {
+    NSUInteger maxSize = self.maxPartialDataCacheSize;
+    if (maxSize == 0 || !self.request.URL) {
+        return;
+    }
+    size_t size = [self receivedSize];
+    if (size < kMinimumPartialDataSize || (self.expectedSize > 0 && size >= (size_t)self.expectedSize)) {
+        return;
+    }
+    NSString *validator = [self resumeValidatorOfResponse:self.response];
+    if (!validator) {
+        return;
+    }
+    NSData *data = [self contiguousImageData];
+    [[SDWebImageDownloaderPartialDataStore sharedStore] storeData:data validator:validator forURL:self.request.URL maxSize:maxSize];
+}
+
+#pragma mark Disk streaming
+
+// Call on the delegate queue
+- (void)openDownloadFile {
+    // The operation names its own file, the context only tells where, so that it does not depend on the request the shared operation has been created for
+    NSString *directory = self.context[SDWebImageContextDownloadDirectory];
+    if (![directory isKindOfClass:[NSString class]]) {
+        directory = [NSTemporaryDirectory() stringByAppendingPathComponent:@"com.hackemist.SDWebImageDownloader.downloads"];
+    }
+    NSString *path = [directory stringByAppendingPathComponent:[NSUUID UUID].UUIDString];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil];
+    int fileDescriptor = open(path.fileSystemRepresentation, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fileDescriptor < 0) {
+        // Keep the body in memory
+        return;
+    }
+    // A resumed body already received its first part in memory
+    NSData *receivedData = [self contiguousImageData];
+    self.imageData = nil;
+    self.downloadFileDescriptor = fileDescriptor;
+    self.downloadFilePath = path;
+    self.downloadFileSize = 0;
+    if (receivedData && ![self writeDataToDownloadFile:receivedData]) {
+        [self.dataTask cancel];
+    }
+}
+
+// Call on the delegate queue
+- (BOOL)writeDataToDownloadFile:(nonnull NSData *)data {
+    __block BOOL success = YES;
+    [data enumerateByteRangesUsingBlock:^(const void * _Nonnull bytes, NSRange byteRange, BOOL * _Nonnull stop) {
+        size_t offset = 0;
+        while (offset < byteRange.length) {
+            ssize_t written = write(self.downloadFileDescriptor, (const uint8_t *)bytes + offset, byteRange.length - offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                success = NO;
+                *stop = YES;
+                return;
+            }
+            offset += written;
+        }
+    }];
+    if (success) {
+        self.downloadFileSize += data.length;
+    }
+    return success;
+}
+
+// Close and remove the file. A complete file is removed after the completion blocks, which have been dispatched to the main queue before. Call on the delegate queue
+- (void)closeDownloadFile {
+    if (self.downloadFileDescriptor < 0) {
+        return;
+    }
+    close(self.downloadFileDescriptor);
+    self.downloadFileDescriptor = -1;
+    self.downloadFileSize = 0;
+    NSString *path = self.downloadFilePath;
+    if (!self.shouldKeepDownloadFile) {
+        unlink(path.fileSystemRepresentation);
+        self.downloadFilePath = nil;
+        return;
+    }
+    dispatch_async(dispatch_get_main_queue(), ^{
+        unlink(path.fileSystemRepresentation);
+        if ([self.downloadFilePath isEqualToString:path]) {
+            self.downloadFilePath = nil;
+        }
+    });
+}
+
+- (size_t)receivedSize {
+    if (self.downloadFileDescriptor >= 0) {
+        return self.downloadFileSize;
+    }
+    return self.imageData ? dispatch_data_get_size(self.imageData) : 0;
+}
+
+#pragma mark In-flight bytes
+
+// The memory the body takes until it is decoded, reserved at the expected size. Call on the delegate queue
+- (int64_t)inMemorySize {
+    if (self.downloadFileDescriptor >= 0) {
+        return 0;
+    }
+    int64_t receivedSize = self.imageData ? dispatch_data_get_size(self.imageData) : 0;
+    return MAX(receivedSize, (int64_t)MAX(self.expectedSize, 0));
+}
+
+// Call on the delegate queue
+- (void)reportInFlightBytes:(int64_t)bytes {
+    int64_t deltaBytes = bytes - self.inFlightBytes;
+    if (deltaBytes == 0) {
+        return;
+    }
+    self.inFlightBytes = bytes;
+    SDWebImageDownloaderInFlightBytesBlock inFlightBytesBlock = self.inFlightBytesBlock;
+    if (inFlightBytesBlock) {
+        inFlightBytesBlock(deltaBytes);
+    }
+}
+
 #pragma mark Helper methods
+// Consolidate the received chunks only when a decoder needs the bytes. The consolidated buffer replaces the chunks, so it is not copied again if no more data is received
+- (nullable NSData *)contiguousImageData {
+    if (self.downloadFileDescriptor >= 0) {
+        return SDMappedDataWithFileDescriptor(self.downloadFileDescriptor, self.downloadFileSize);
+    }
+    if (!self.imageData) {
+        return nil;
+    }
+    const void *bytes = NULL;
+    size_t length = 0;
+    dispatch_data_t mappedData = dispatch_data_create_map(self.imageData, &bytes, &length);
+    self.imageData = mappedData;
+    return [[NSData alloc] initWithBytesNoCopy:(void *)bytes length:length deallocator:^(void * _Nonnull bytes, NSUInteger length) {
+        // keep the mapped buffer alive as long as the data
+        (void)mappedData;
+    }];
+}
+
 - (nullable UIImage *)scaledImageForKey:(nullable NSString *)key image:(nullable UIImage *)image {
     return SDScaledImageForKey(key, image);
 }
@@ -479,11 +1290,16 @@ didReceiveResponse:(NSURLResponse *)response
                             imageData:(nullable NSData *)imageData
                                 error:(nullable NSError *)error
                              finished:(BOOL)finished {
-    NSArray<id> *completionBlocks = [self callbacksForKey:kCompletedCallbackKey];
+    NSArray<SDWebImageDownloaderCompletedBlock> *completionBlocks = [self completedBlocksSnapshot];
+    SDWebImageDownloaderMetricsBlock metricsBlock = finished ? self.metricsBlock : nil;
     dispatch_main_async_safe(^{
         for (SDWebImageDownloaderCompletedBlock completedBlock in completionBlocks) {
             completedBlock(image, imageData, error, finished);
         }
+        if (metricsBlock) {
+            self.metrics.deliveryDate = [NSDate date];
+            metricsBlock(self.metrics);
+        }
     });
 }
 
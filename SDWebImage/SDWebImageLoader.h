@@ -0,0 +1,78 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+#import "SDWebImageOperation.h"
+#import "SDWebImageDownloader.h"
+
+/**
+ * A loader gives the image and its data for the URLs it can load. `SDWebImageManager` dispatches to a loader by the URL scheme, see `-[SDWebImageManager setImageLoader:forURLScheme:]`, and to its `imageDownloader` for the other schemes.
+ */
+@protocol SDWebImageLoader <NSObject>
+
+/**
+ * Whether the loader can load the URL.
+ */
+- (BOOL)canLoadWithURL:(nullable NSURL *)url;
+
+/**
+ * Loads and decodes the image at the URL.
+ *
+ * @param url            The URL of the image
+ * @param options        The options to be used for this load, the ones which do not apply to the loader are ignored
+ * @param context        A context contains different options to perform specify changes or processes, see `SDWebImageContextOption`
+ * @param progressBlock  A block called repeatedly while the image is loading, on a background queue
+ * @param completedBlock A block called once the load is completed, on the main queue. Not called once the returned operation has been cancelled
+ *
+ * @return An operation to cancel the load, or nil if there is nothing to cancel
+ */
+- (nullable id<SDWebImageOperation>)loadImageWithURL:(nullable NSURL *)url
+                                             options:(SDWebImageDownloaderOptions)options
+                                             context:(nullable SDWebImageContext *)context
+                                            progress:(nullable SDWebImageDownloaderProgressBlock)progressBlock
+                                           completed:(nullable SDWebImageDownloaderCompletedBlock)completedBlock;
+
+@end
+
+/**
+ * The downloader loads any URL through `NSURLSession`.
+ */
+@interface SDWebImageDownloader (SDWebImageLoader) <SDWebImageLoader>
+
+@end
+
+/**
+ * Loads the `file://` URLs, mapping the file in memory instead of reading it, without any `NSURLSession` task.
+ */
+@interface SDWebImageFileLoader : NSObject <SDWebImageLoader>
+
+/**
+ * Decompressing images that are loaded can improve performance but can consume lot of memory.
+ * Defaults to YES. Set this to NO if you are experiencing a crash due to excessive memory consumption.
+ */
+@property (assign, nonatomic) BOOL shouldDecompressImages;
+
++ (nonnull instancetype)sharedLoader;
+
+@end
+
+/**
+ * Loads the `data:` URIs, decoding the base64 or percent encoded data straight from the URL, without any `NSURLSession` task.
+ */
+@interface SDWebImageDataURILoader : NSObject <SDWebImageLoader>
+
+/**
+ * Decompressing images that are loaded can improve performance but can consume lot of memory.
+ * Defaults to YES. Set this to NO if you are experiencing a crash due to excessive memory consumption.
+ */
+@property (assign, nonatomic) BOOL shouldDecompressImages;
+
++ (nonnull instancetype)sharedLoader;
+
+@end
@@ -0,0 +1,219 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageLoader.h"
+#import "SDWebImageManager.h"
+#import "SDWebImageCodersManager.h"
+#import "NSData+ImageContentType.h"
+
+/**
+ * The operation of a local load, which only needs to drop the completion once cancelled.
+ */
+@interface SDWebImageLocalLoadOperation : NSObject <SDWebImageOperation>
+
+@property (assign, atomic, getter = isCancelled) BOOL cancelled;
+
+@end
+
+@implementation SDWebImageLocalLoadOperation
+
+- (void)cancel {
+    self.cancelled = YES;
+}
+
+@end
+
+// Decode the image as `SDWebImageDownloaderOperation` does
+static UIImage * SDDecodedImageWithData(NSData *data, NSURL *url, SDWebImageDownloaderOptions options, BOOL shouldDecompressImages) {
+    UIImage *image = [[SDWebImageCodersManager sharedInstance] decodedImageWithData:data];
+    NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:url];
+    image = SDScaledImageForKey(key, image);
+
+    BOOL shouldDecode = YES;
+    // Do not force decoding animated GIFs and WebPs
+    if (image.images) {
+        shouldDecode = NO;
+    } else {
+#ifdef SD_WEBP
+        SDImageFormat imageFormat = [NSData sd_imageFormatForImageData:data];
+        if (imageFormat == SDImageFormatWebP) {
+            shouldDecode = NO;
+        }
+#endif
+    }
+
+    if (shouldDecode && shouldDecompressImages) {
+        BOOL shouldScaleDown = options & SDWebImageDownloaderScaleDownLargeImages;
+        image = [[SDWebImageCodersManager sharedInstance] decompressedImageWithImage:image data:&data options:@{SDWebImageCoderScaleDownLargeImagesKey: @(shouldScaleDown)}];
+    }
+    return image;
+}
+
+// Read the data on a background queue, then decode it and deliver the image on the main queue unless cancelled
+static id<SDWebImageOperation> SDLoadImageWithDataBlock(NSURL *url,
+                                                       SDWebImageDownloaderOptions options,
+                                                       BOOL shouldDecompressImages,
+                                                       SDWebImageDownloaderProgressBlock progressBlock,
+                                                       SDWebImageDownloaderCompletedBlock completedBlock,
+                                                       NSData * (^dataBlock)(NSError **error)) {
+    SDWebImageLocalLoadOperation *operation = [SDWebImageLocalLoadOperation new];
+    long priority = (options & SDWebImageDownloaderHighPriority) ? DISPATCH_QUEUE_PRIORITY_HIGH : ((options & SDWebImageDownloaderLowPriority) ? DISPATCH_QUEUE_PRIORITY_LOW : DISPATCH_QUEUE_PRIORITY_DEFAULT);
+    dispatch_async(dispatch_get_global_queue(priority, 0), ^{
+        if (operation.isCancelled) {
+            return;
+        }
+        NSError *error = nil;
+        UIImage *image = nil;
+        NSData *data = dataBlock(&error);
+        if (data) {
+            if (progressBlock) {
+                progressBlock(data.length, data.length, url);
+            }
+            image = SDDecodedImageWithData(data, url, options, shouldDecompressImages);
+            if (!image || image.size.width == 0 || image.size.height == 0) {
+                error = [NSError errorWithDomain:SDWebImageErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Loaded image has 0 pixels"}];
+                image = nil;
+            }
+        } else if (!error) {
+            error = [NSError errorWithDomain:SDWebImageErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Image data is nil"}];
+        }
+        dispatch_main_async_safe(^{
+            if (!operation.isCancelled && completedBlock) {
+                completedBlock(image, image ? data : nil, error, YES);
+            }
+        });
+    });
+    return operation;
+}
+
+@implementation SDWebImageDownloader (SDWebImageLoader)
+
+- (BOOL)canLoadWithURL:(nullable NSURL *)url {
+    return url != nil;
+}
+
+- (nullable id<SDWebImageOperation>)loadImageWithURL:(nullable NSURL *)url
+                                             options:(SDWebImageDownloaderOptions)options
+                                             context:(nullable SDWebImageContext *)context
+                                            progress:(nullable SDWebImageDownloaderProgressBlock)progressBlock
+                                           completed:(nullable SDWebImageDownloaderCompletedBlock)completedBlock {
+    return [self downloadImageWithURL:url options:options progress:progressBlock completed:completedBlock context:context];
+}
+
+@end
+
+@implementation SDWebImageFileLoader
+
++ (nonnull instancetype)sharedLoader {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _shouldDecompressImages = YES;
+    }
+    return self;
+}
+
+- (BOOL)canLoadWithURL:(nullable NSURL *)url {
+    return url.isFileURL;
+}
+
+- (nullable id<SDWebImageOperation>)loadImageWithURL:(nullable NSURL *)url
+                                             options:(SDWebImageDownloaderOptions)options
+                                             context:(nullable SDWebImageContext *)context
+                                            progress:(nullable SDWebImageDownloaderProgressBlock)progressBlock
+                                           completed:(nullable SDWebImageDownloaderCompletedBlock)completedBlock {
+    return SDLoadImageWithDataBlock(url, options, self.shouldDecompressImages, progressBlock, completedBlock, ^NSData *(NSError **error) {
+        // The pages are only read as the decoder touches them
+        return [NSData dataWithContentsOfURL:url options:NSDataReadingMappedIfSafe error:error];
+    });
+}
+
+@end
+
+// Percent decode the bytes, returns nil for an invalid escape
+static NSData * SDPercentDecodedData(const char *bytes, size_t length) {
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    uint8_t *decodedBytes = data.mutableBytes;
+    size_t decodedLength = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (bytes[i] != '%') {
+            decodedBytes[decodedLength++] = bytes[i];
+            continue;
+        }
+        if (i + 2 >= length || !isxdigit(bytes[i + 1]) || !isxdigit(bytes[i + 2])) {
+            return nil;
+        }
+        char hex[3] = {bytes[i + 1], bytes[i + 2], 0};
+        decodedBytes[decodedLength++] = (uint8_t)strtol(hex, NULL, 16);
+        i += 2;
+    }
+    data.length = decodedLength;
+    return data;
+}
+
+@implementation SDWebImageDataURILoader
+
++ (nonnull instancetype)sharedLoader {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _shouldDecompressImages = YES;
+    }
+    return self;
+}
+
+- (BOOL)canLoadWithURL:(nullable NSURL *)url {
+    return url.scheme && [url.scheme caseInsensitiveCompare:@"data"] == NSOrderedSame;
+}
+
+- (nullable id<SDWebImageOperation>)loadImageWithURL:(nullable NSURL *)url
+                                             options:(SDWebImageDownloaderOptions)options
+                                             context:(nullable SDWebImageContext *)context
+                                            progress:(nullable SDWebImageDownloaderProgressBlock)progressBlock
+                                           completed:(nullable SDWebImageDownloaderCompletedBlock)completedBlock {
+    return SDLoadImageWithDataBlock(url, options, self.shouldDecompressImages, progressBlock, completedBlock, ^NSData *(NSError **error) {
+        return [self dataWithURL:url error:error];
+    });
+}
+
+// data:[<media type>][;base64],<data>
+- (nullable NSData *)dataWithURL:(nonnull NSURL *)url error:(NSError **)error {
+    const char *string = url.absoluteString.UTF8String;
+    const char *separator = string ? strchr(string, ',') : NULL;
+    if (!separator) {
+        *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadURL userInfo:@{NSURLErrorFailingURLErrorKey : url}];
+        return nil;
+    }
+    size_t headerLength = separator - string;
+    const char *payload = separator + 1;
+    NSData *data = SDPercentDecodedData(payload, strlen(payload));
+    BOOL isBase64 = headerLength >= 7 && strncasecmp(separator - 7, ";base64", 7) == 0;
+    if (data && isBase64) {
+        data = [[NSData alloc] initWithBase64EncodedData:data options:NSDataBase64DecodingIgnoreUnknownCharacters];
+    }
+    if (!data) {
+        *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotDecodeContentData userInfo:@{NSURLErrorFailingURLErrorKey : url}];
+    }
+    return data;
+}
+
+@end
@@ -9,12 +9,17 @@
 #import "SDWebImageCompat.h"
 #import "SDWebImageOperation.h"
 #import "SDWebImageDownloader.h"
+#import "SDWebImageLoader.h"
 #import "SDImageCache.h"
+#import "SDWebImagePipelineStage.h"
+#import "SDWebImageTransformer.h"
+#import "SDWebImageTracer.h"
 
 typedef NS_OPTIONS(NSUInteger, SDWebImageOptions) {
     /**
-     * By default, when a URL fail to be downloaded, the URL is blacklisted so the library won't keep trying.
+     * By default, when a URL fail to be downloaded, the URL is blacklisted so the library won't keep trying until its retry interval has elapsed.
      * This flag disable this blacklisting.
+     * @see failedURLRetryInterval
      */
     SDWebImageRetryFailed = 1 << 0,
 
@@ -144,6 +149,7 @@ typedef NSString * _Nullable (^SDWebImageCacheKeyFilterBlock)(NSURL * _Nullable
 /**
  * Allows to transform the image immediately after it has been downloaded and just before to cache it on disk and memory.
  * NOTE: This method is called from a global queue in order to not to block the main thread.
+ * NOTE: A transformer set with `SDWebImageContextImageTransformer` takes precedence over this method, and its images are cached under a key of their own.
  *
  * @param imageManager The current `SDWebImageManager`
  * @param image        The image to transform
@@ -184,6 +190,39 @@ SDWebImageManager *manager = [SDWebImageManager sharedManager];
 @property (strong, nonatomic, readonly, nullable) SDImageCache *imageCache;
 @property (strong, nonatomic, readonly, nullable) SDWebImageDownloader *imageDownloader;
 
+// The stages of a load, in order. Each stage has its own concurrency limit and queue depth metrics, so that the stages of different loads overlap and a bottleneck can be found and tuned alone.
+// The decode runs in the loaders, the downloads share a decode queue limited to the number of active processors.
+
+/**
+ * Runs the query of the memory and disk caches, from its start until the cache calls back. A memory hit is delivered in the same call while a slot is free.
+ * No limit by default.
+ */
+@property (strong, nonatomic, readonly, nonnull) SDWebImagePipelineStage *cacheQueryStage;
+
+/**
+ * Runs the image loaders, from the start of a load until it is finished. The downloader also has its own limits, see `-[SDWebImageDownloader maxConcurrentDownloads]`.
+ * No limit by default.
+ */
+@property (strong, nonatomic, readonly, nonnull) SDWebImagePipelineStage *fetchStage;
+
+/**
+ * Runs the thumbnail creation and `-[SDWebImageManagerDelegate imageManager:transformDownloadedImage:withURL:]` on a global queue.
+ * Limited to the number of active processors by default.
+ */
+@property (strong, nonatomic, readonly, nonnull) SDWebImagePipelineStage *transformStage;
+
+/**
+ * Runs the stores of the loaded images, until they are encoded and written to disk. The memory cache is updated when a store starts.
+ * No limit by default. With a limit, a loaded image may be delivered before it is in the memory cache.
+ */
+@property (strong, nonatomic, readonly, nonnull) SDWebImagePipelineStage *storeStage;
+
+/**
+ * Runs the completion blocks on the main queue.
+ * No limit by default.
+ */
+@property (strong, nonatomic, readonly, nonnull) SDWebImagePipelineStage *deliveryStage;
+
 /**
  * The cache filter is a block used each time SDWebImageManager need to convert an URL into a cache key. This can
  * be used to remove dynamic part of an image URL.
@@ -202,6 +241,40 @@ SDWebImageManager *manager = [SDWebImageManager sharedManager];
  */
 @property (nonatomic, copy, nullable) SDWebImageCacheKeyFilterBlock cacheKeyFilter;
 
+/**
+ * The maximum number of failed URLs remembered, the least recently used ones are forgotten first.
+ * Defaults to 1000. Set to 0 to never blacklist URLs.
+ */
+@property (assign, nonatomic) NSUInteger failedURLsCountLimit;
+
+/**
+ * The time a URL failed once is blacklisted, in seconds. Each further failure doubles it, and a random jitter takes off up to half of it.
+ * Failures which do not go away by themselves, such as an unsupported URL or undecodable image data, wait 16 times longer.
+ * Network conditions such as a lost connection or a time out never blacklist a URL.
+ * Defaults to 60.
+ */
+@property (assign, nonatomic) NSTimeInterval failedURLRetryInterval;
+
+/**
+ * The maximum time a failed URL is blacklisted, in seconds.
+ * Defaults to 1 day.
+ */
+@property (assign, nonatomic) NSTimeInterval maxFailedURLRetryInterval;
+
+/**
+ * Sets the loader of the URLs with the scheme, instead of `imageDownloader`.
+ * By default, `file` URLs are loaded by `SDWebImageFileLoader` and `data` URIs by `SDWebImageDataURILoader`, without any `NSURLSession` task.
+ *
+ * @param loader The loader, or nil to load the URLs with the scheme with `imageDownloader`
+ * @param scheme The URL scheme, case insensitive
+ */
+- (void)setImageLoader:(nullable id<SDWebImageLoader>)loader forURLScheme:(nonnull NSString *)scheme;
+
+/**
+ * Returns the loader of the URLs with the scheme, or nil if they are loaded with `imageDownloader`.
+ */
+- (nullable id<SDWebImageLoader>)imageLoaderForURLScheme:(nonnull NSString *)scheme;
+
 /**
  * Returns global SDWebImageManager instance.
  *
@@ -263,6 +336,18 @@ SDWebImageManager *manager = [SDWebImageManager sharedManager];
                                             completed:(nonnull SDInternalCompletionBlock)completedBlock
                                               context:(nullable SDWebImageContext *)context;
 
+/**
+ * Reads the metadata of the image at the URL, such as its pixel size for the layout, before loading it.
+ * The metadata comes from the image in the memory cache if any, else from a probe of the first bytes of the image, see `-[SDWebImageDownloader probeImageWithURL:completed:]`.
+ *
+ * @param url            The URL to the image
+ * @param completedBlock A block called on the main queue with the metadata or an error. Not called once the probe has been cancelled
+ *
+ * @return An operation to cancel the probe, or nil if the metadata was available at once
+ */
+- (nullable id <SDWebImageOperation>)probeImageWithURL:(nullable NSURL *)url
+                                             completed:(nullable SDWebImageMetadataCompletedBlock)completedBlock;
+
 /**
  * Saves image to cache for given URL
  *
@@ -273,11 +358,26 @@ SDWebImageManager *manager = [SDWebImageManager sharedManager];
 
 - (void)saveImageToCache:(nullable UIImage *)image forURL:(nullable NSURL *)url;
 
+/**
+ * Removes the URL from the failed URLs so that it is loaded again at once
+ */
+- (void)removeFailedURL:(nonnull NSURL *)url;
+
+/**
+ * Removes all the failed URLs
+ */
+- (void)removeAllFailedURLs;
+
 /**
  * Cancel all current operations
  */
 - (void)cancelAll;
 
+/**
+ * Cancel the current operations of a group, see `SDWebImageContextOperationGroup`
+ */
+- (void)cancelOperationsInGroup:(nonnull NSString *)group;
+
 /**
  * Check one or more operations running
  */
@@ -306,6 +406,21 @@ SDWebImageManager *manager = [SDWebImageManager sharedManager];
                    completion:(nullable SDWebImageCheckCacheCompletionBlock)completionBlock;
 
 
+/**
+ * Returns the image a load with the same arguments would be answered with from the memory cache, without loading it.
+ * It runs synchronously on the calling thread, without an operation, a lock of the manager or a dispatch, for the views to set a memory hit in the same run loop turn.
+ * Returns nil if the image is not in the memory cache, or if the load would do more than return it, such as with `SDWebImageRefreshCached` or `SDWebImageQueryDataWhenInMemory`.
+ *
+ * @param url     The URL of the image
+ * @param options The options of the load
+ * @param context The context of the load, for the thumbnail size and the transformer
+ *
+ * @return The image in the memory cache, or nil
+ */
+- (nullable UIImage *)imageFromMemoryCacheForURL:(nullable NSURL *)url
+                                         options:(SDWebImageOptions)options
+                                         context:(nullable SDWebImageContext *)context;
+
 /**
  *Return the cache key for a given URL
  */
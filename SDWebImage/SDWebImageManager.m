@@ -13,18 +13,114 @@
 @interface SDWebImageCombinedOperation : NSObject <SDWebImageOperation>
 
 @property (assign, nonatomic, getter = isCancelled) BOOL cancelled;
-@property (strong, nonatomic, nullable) SDWebImageDownloadToken *downloadToken;
+@property (strong, nonatomic, nullable) id<SDWebImageOperation> loaderOperation;
 @property (strong, nonatomic, nullable) NSOperation *cacheOperation;
 @property (weak, nonatomic, nullable) SDWebImageManager *manager;
+@property (copy, nonatomic, nullable) NSString *group;
+@property (strong, nonatomic, nullable) NSNumber *traceIdentifier; // nil unless the tracing is enabled
+// The slots of the stages which are not called back once cancelled, freed by `cancel`
+@property (strong, nonatomic, nullable) NSMutableArray<SDWebImagePipelineStageDoneBlock> *stageDoneBlocks;
+
+// Returns NO if the operation has been cancelled already
+- (BOOL)addStageDoneBlock:(nonnull SDWebImagePipelineStageDoneBlock)doneBlock;
 
 @end
 
+#define LOCK(lock) dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
+#define UNLOCK(lock) dispatch_semaphore_signal(lock);
+
+static inline id<SDWebImageTransformer> _Nullable SDTransformerFromContext(SDWebImageContext * _Nullable context) {
+    id transformer = context[SDWebImageContextImageTransformer];
+    return [transformer conformsToProtocol:@protocol(SDWebImageTransformer)] ? transformer : nil;
+}
+
+// The number of independently locked shards of the failed URL table
+static const NSUInteger kFailedURLTableShardCount = 16;
+// A permanent failure waits this many times longer than a transient one before a retry
+static const NSUInteger kPermanentFailureIntervalFactor = 16;
+
+typedef NS_ENUM(NSInteger, SDWebImageFailureClass) {
+    SDWebImageFailureClassTransient,
+    SDWebImageFailureClassPermanent
+};
+
+@interface SDWebImageFailedURLEntry : NSObject
+
+@property (assign, nonatomic) SDWebImageFailureClass failureClass;
+@property (assign, nonatomic) NSUInteger failureCount;
+@property (assign, nonatomic) NSTimeInterval failureTime; // the system uptime of the latest failure
+@property (assign, nonatomic) NSTimeInterval retryTime; // the system uptime from which the URL is loaded again
+
+@end
+
+@implementation SDWebImageFailedURLEntry
+@end
+
+// One shard of the failed URL table, the least recently used URLs are evicted first
+@interface SDWebImageFailedURLShard : NSObject {
+    @public
+    dispatch_semaphore_t _lock;
+    NSMutableDictionary<NSURL *, SDWebImageFailedURLEntry *> *_entries;
+    NSMutableOrderedSet<NSURL *> *_recentURLs; // from the least to the most recently used
+}
+@end
+
+@implementation SDWebImageFailedURLShard
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _lock = dispatch_semaphore_create(1);
+        _entries = [NSMutableDictionary new];
+        _recentURLs = [NSMutableOrderedSet new];
+    }
+    return self;
+}
+
+@end
+
+@class SDWebImageCacheQuery;
+
+// The handle of one requester of a shared cache query, cancelling it only detaches the requester
+@interface SDWebImageCacheQueryToken : NSOperation
+
+@property (copy, nonatomic, nullable) SDCacheQueryCompletedBlock doneBlock;
+@property (strong, nonatomic, nullable) SDWebImageCacheQuery *query;
+@property (weak, nonatomic, nullable) SDWebImageManager *manager;
+
+@end
+
+// One query of the cache shared by the requests of the same key at the same time, so that they read and decode the file once
+@interface SDWebImageCacheQuery : NSObject
+
+@property (copy, nonatomic, nonnull) NSString *queryKey;
+@property (strong, nonatomic, nullable) NSOperation *cacheOperation;
+@property (strong, nonatomic, nonnull) NSMutableArray<SDWebImageCacheQueryToken *> *tokens; // the requesters not cancelled yet
+@property (assign, nonatomic, getter = isCancelled) BOOL cancelled; // all the requesters cancelled before the cache operation was set
+
+@end
+
+@implementation SDWebImageCacheQuery
+@end
+
 @interface SDWebImageManager ()
 
 @property (strong, nonatomic, readwrite, nonnull) SDImageCache *imageCache;
 @property (strong, nonatomic, readwrite, nonnull) SDWebImageDownloader *imageDownloader;
-@property (strong, nonatomic, nonnull) NSMutableSet<NSURL *> *failedURLs;
-@property (strong, nonatomic, nonnull) NSMutableArray<SDWebImageCombinedOperation *> *runningOperations;
+@property (strong, nonatomic, nonnull) NSArray<SDWebImageFailedURLShard *> *failedURLShards; // the URLs are spread over shards so that lookups do not contend on one lock
+@property (strong, nonatomic, nonnull) NSMutableSet<SDWebImageCombinedOperation *> *runningOperations;
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSString *, NSMutableSet<SDWebImageCombinedOperation *> *> *groupedOperations; // the running operations which have a group, by group
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSString *, SDWebImageCacheQuery *> *cacheQueries; // the cache queries in flight, by key, options and thumbnail size
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t cacheQueriesLock; // a lock to keep the access to `cacheQueries` and to their tokens thread-safe
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t runningOperationsLock; // a lock to keep the access to `runningOperations` and `groupedOperations` thread-safe
+@property (strong, nonatomic, nonnull) NSMutableDictionary<NSString *, id<SDWebImageLoader>> *imageLoaders; // by lowercase URL scheme
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t imageLoadersLock; // a lock to keep the access to `imageLoaders` thread-safe
+@property (strong, nonatomic, readwrite, nonnull) SDWebImagePipelineStage *cacheQueryStage;
+@property (strong, nonatomic, readwrite, nonnull) SDWebImagePipelineStage *fetchStage;
+@property (strong, nonatomic, readwrite, nonnull) SDWebImagePipelineStage *transformStage;
+@property (strong, nonatomic, readwrite, nonnull) SDWebImagePipelineStage *storeStage;
+@property (strong, nonatomic, readwrite, nonnull) SDWebImagePipelineStage *deliveryStage;
+
+- (void)cancelCacheQueryToken:(nonnull SDWebImageCacheQueryToken *)token;
 
 @end
 
@@ -49,8 +145,27 @@
     if ((self = [super init])) {
         _imageCache = cache;
         _imageDownloader = downloader;
-        _failedURLs = [NSMutableSet new];
-        _runningOperations = [NSMutableArray new];
+        NSMutableArray<SDWebImageFailedURLShard *> *failedURLShards = [NSMutableArray arrayWithCapacity:kFailedURLTableShardCount];
+        for (NSUInteger i = 0; i < kFailedURLTableShardCount; i++) {
+            [failedURLShards addObject:[SDWebImageFailedURLShard new]];
+        }
+        _failedURLShards = [failedURLShards copy];
+        _failedURLsCountLimit = 1000;
+        _failedURLRetryInterval = 60;
+        _maxFailedURLRetryInterval = 60 * 60 * 24;
+        _runningOperations = [NSMutableSet new];
+        _groupedOperations = [NSMutableDictionary new];
+        _runningOperationsLock = dispatch_semaphore_create(1);
+        _cacheQueries = [NSMutableDictionary new];
+        _cacheQueriesLock = dispatch_semaphore_create(1);
+        _imageLoaders = [@{@"file" : [SDWebImageFileLoader sharedLoader],
+                           @"data" : [SDWebImageDataURILoader sharedLoader]} mutableCopy];
+        _imageLoadersLock = dispatch_semaphore_create(1);
+        _cacheQueryStage = [[SDWebImagePipelineStage alloc] initWithName:@"cache query" queue:nil maxConcurrentTaskCount:0];
+        _fetchStage = [[SDWebImagePipelineStage alloc] initWithName:@"fetch" queue:nil maxConcurrentTaskCount:0];
+        _transformStage = [[SDWebImagePipelineStage alloc] initWithName:@"transform" queue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0) maxConcurrentTaskCount:MAX([NSProcessInfo processInfo].activeProcessorCount, 1)];
+        _storeStage = [[SDWebImagePipelineStage alloc] initWithName:@"store" queue:nil maxConcurrentTaskCount:0];
+        _deliveryStage = [[SDWebImagePipelineStage alloc] initWithName:@"delivery" queue:dispatch_get_main_queue() maxConcurrentTaskCount:0];
     }
     return self;
 }
@@ -107,6 +222,33 @@
     }];
 }
 
+- (nullable UIImage *)imageFromMemoryCacheForURL:(nullable NSURL *)url
+                                         options:(SDWebImageOptions)options
+                                         context:(nullable SDWebImageContext *)context {
+    if ([url isKindOfClass:NSString.class]) {
+        url = [NSURL URLWithString:(NSString *)url];
+    }
+    if (![url isKindOfClass:NSURL.class] || (options & (SDWebImageRefreshCached | SDWebImageQueryDataWhenInMemory))) {
+        return nil;
+    }
+    NSString *key = SDTransformedKeyForKey([self cacheKeyForURL:url], SDTransformerFromContext(context).transformerKey);
+    return [self.imageCache imageFromMemoryCacheForKey:key thumbnailPixelSize:SDThumbnailPixelSizeFromContext(context)];
+}
+
+- (nullable id<SDWebImageOperation>)probeImageWithURL:(nullable NSURL *)url
+                                            completed:(nullable SDWebImageMetadataCompletedBlock)completedBlock {
+    SDWebImageMetadata *metadata = url ? [SDWebImageMetadata metadataWithImage:[self.imageCache imageFromMemoryCacheForKey:[self cacheKeyForURL:url]]] : nil;
+    if (metadata) {
+        if (completedBlock) {
+            dispatch_main_async_safe(^{
+                completedBlock(metadata, nil);
+            });
+        }
+        return nil;
+    }
+    return [self.imageDownloader probeImageWithURL:url completed:completedBlock];
+}
+
 - (id<SDWebImageOperation>)loadImageWithURL:(NSURL *)url options:(SDWebImageOptions)options progress:(SDWebImageDownloaderProgressBlock)progressBlock completed:(SDInternalCompletionBlock)completedBlock {
     return [self loadImageWithURL:url options:options progress:progressBlock completed:completedBlock context:nil];
 }
@@ -132,12 +274,22 @@
 
     SDWebImageCombinedOperation *operation = [SDWebImageCombinedOperation new];
     operation.manager = self;
+    if (SDWebImageTracingEnabled) {
+        // Each load gets its own timeline unless the caller gave one
+        NSNumber *traceIdentifier = context[SDWebImageContextTraceIdentifier];
+        if (!traceIdentifier) {
+            traceIdentifier = [[SDWebImageTracer sharedTracer] nextTraceIdentifier];
+            NSMutableDictionary *mutableContext = context ? [context mutableCopy] : [NSMutableDictionary dictionary];
+            mutableContext[SDWebImageContextTraceIdentifier] = traceIdentifier;
+            context = [mutableContext copy];
+        }
+        operation.traceIdentifier = traceIdentifier;
+        SD_TRACE_MARK(@"enqueue", traceIdentifier, @{@"url" : url.absoluteString ?: @""});
+    }
 
     BOOL isFailedUrl = NO;
-    if (url) {
-        @synchronized (self.failedURLs) {
-            isFailedUrl = [self.failedURLs containsObject:url];
-        }
+    if (url && !(options & SDWebImageRetryFailed)) {
+        isFailedUrl = [self isFailedURL:url];
     }
 
     if (url.absoluteString.length == 0 || (!(options & SDWebImageRetryFailed) && isFailedUrl)) {
@@ -145,9 +297,8 @@
         return operation;
     }
 
-    @synchronized (self.runningOperations) {
-        [self.runningOperations addObject:operation];
-    }
+    operation.group = context[SDWebImageContextOperationGroup];
+    [self addOperationToRunning:operation];
     NSString *key = [self cacheKeyForURL:url];
     
     SDImageCacheOptions cacheOptions = 0;
@@ -155,117 +306,555 @@
     if (options & SDWebImageQueryDiskSync) cacheOptions |= SDImageCacheQueryDiskSync;
     
     __weak SDWebImageCombinedOperation *weakOperation = operation;
-    operation.cacheOperation = [self.imageCache queryCacheOperationForKey:key options:cacheOptions done:^(UIImage *cachedImage, NSData *cachedData, SDImageCacheType cacheType) {
+    [self.cacheQueryStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull cacheQueryDone) {
         __strong __typeof(weakOperation) strongOperation = weakOperation;
-        if (!strongOperation || strongOperation.isCancelled) {
+        // The cache does not call back once its operation has been cancelled, the combined operation frees the slot then
+        if (![strongOperation addStageDoneBlock:cacheQueryDone]) {
+            cacheQueryDone();
             [self safelyRemoveOperationFromRunning:strongOperation];
             return;
         }
+        // A transformed image is cached under its own key
+        NSString *transformedKey = SDTransformedKeyForKey(key, SDTransformerFromContext(context).transformerKey);
+        strongOperation.cacheOperation = [self queryCacheForKey:transformedKey options:cacheOptions context:context done:^(UIImage *cachedImage, NSData *cachedData, SDImageCacheType cacheType) {
+            if (!cachedImage && ![transformedKey isEqualToString:key] && !(options & SDWebImageRefreshCached)) {
+                // The original image in the cache is transformed without network
+                weakOperation.cacheOperation = [self queryCacheForKey:key options:cacheOptions context:context done:^(UIImage *originalImage, NSData *originalData, SDImageCacheType originalCacheType) {
+                    cacheQueryDone();
+                    if (originalImage) {
+                        [self transformCachedImage:originalImage forOperation:weakOperation url:url key:key options:options context:context cacheType:originalCacheType completed:completedBlock];
+                    } else {
+                        [self didQueryCacheForOperation:weakOperation url:url key:key options:options context:context cachedImage:nil cachedData:nil cacheType:SDImageCacheTypeNone progress:progressBlock completed:completedBlock];
+                    }
+                }];
+                return;
+            }
+            cacheQueryDone();
+            [self didQueryCacheForOperation:weakOperation url:url key:key options:options context:context cachedImage:cachedImage cachedData:cachedData cacheType:cacheType progress:progressBlock completed:completedBlock];
+        }];
+    } traceIdentifier:operation.traceIdentifier];
+
+    return operation;
+}
+
+- (void)didQueryCacheForOperation:(nullable SDWebImageCombinedOperation *)operation
+                              url:(nonnull NSURL *)url
+                              key:(nullable NSString *)key
+                          options:(SDWebImageOptions)options
+                          context:(nullable SDWebImageContext *)context
+                      cachedImage:(nullable UIImage *)cachedImage
+                       cachedData:(nullable NSData *)cachedData
+                        cacheType:(SDImageCacheType)cacheType
+                         progress:(nullable SDWebImageDownloaderProgressBlock)progressBlock
+                        completed:(nonnull SDInternalCompletionBlock)completedBlock {
+    if (!operation || operation.isCancelled) {
+        [self safelyRemoveOperationFromRunning:operation];
+        return;
+    }
+    
+    // Check whether we should download image from network
+    BOOL shouldDownload = (!(options & SDWebImageFromCacheOnly))
+        && (!cachedImage || options & SDWebImageRefreshCached)
+        && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url]);
+    if (shouldDownload) {
+        if (cachedImage && options & SDWebImageRefreshCached) {
+            // If image was found in the cache but SDWebImageRefreshCached is provided, notify about the cached image
+            // AND try to re-download it in order to let a chance to NSURLCache to refresh it from server.
+            [self callCompletionBlockForOperation:operation completion:completedBlock image:cachedImage data:cachedData error:nil cacheType:cacheType finished:YES url:url];
+        }
         
-        // Check whether we should download image from network
-        BOOL shouldDownload = (!(options & SDWebImageFromCacheOnly))
-            && (!cachedImage || options & SDWebImageRefreshCached)
-            && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url]);
-        if (shouldDownload) {
-            if (cachedImage && options & SDWebImageRefreshCached) {
-                // If image was found in the cache but SDWebImageRefreshCached is provided, notify about the cached image
-                // AND try to re-download it in order to let a chance to NSURLCache to refresh it from server.
-                [self callCompletionBlockForOperation:strongOperation completion:completedBlock image:cachedImage data:cachedData error:nil cacheType:cacheType finished:YES url:url];
+        __weak SDWebImageCombinedOperation *weakOperation = operation;
+        [self.fetchStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull fetchDone) {
+            __strong __typeof(weakOperation) strongOperation = weakOperation;
+            // The loaders do not call back once cancelled, the combined operation frees the slot then
+            if (![strongOperation addStageDoneBlock:fetchDone]) {
+                fetchDone();
+                [self safelyRemoveOperationFromRunning:strongOperation];
+                return;
             }
+            [self fetchImageForOperation:strongOperation url:url key:key options:options context:context cachedImage:cachedImage progress:progressBlock completed:completedBlock done:fetchDone];
+        } traceIdentifier:operation.traceIdentifier];
+    } else if (cachedImage) {
+        [self callCompletionBlockForOperation:operation completion:completedBlock image:cachedImage data:cachedData error:nil cacheType:cacheType finished:YES url:url];
+        [self safelyRemoveOperationFromRunning:operation];
+    } else {
+        // Image not in cache and download disallowed by delegate
+        [self callCompletionBlockForOperation:operation completion:completedBlock image:nil data:nil error:nil cacheType:SDImageCacheTypeNone finished:YES url:url];
+        [self safelyRemoveOperationFromRunning:operation];
+    }
+}
 
-            // download if no image or requested to refresh anyway, and download allowed by delegate
-            SDWebImageDownloaderOptions downloaderOptions = 0;
-            if (options & SDWebImageLowPriority) downloaderOptions |= SDWebImageDownloaderLowPriority;
-            if (options & SDWebImageProgressiveDownload) downloaderOptions |= SDWebImageDownloaderProgressiveDownload;
-            if (options & SDWebImageRefreshCached) downloaderOptions |= SDWebImageDownloaderUseNSURLCache;
-            if (options & SDWebImageContinueInBackground) downloaderOptions |= SDWebImageDownloaderContinueInBackground;
-            if (options & SDWebImageHandleCookies) downloaderOptions |= SDWebImageDownloaderHandleCookies;
-            if (options & SDWebImageAllowInvalidSSLCertificates) downloaderOptions |= SDWebImageDownloaderAllowInvalidSSLCertificates;
-            if (options & SDWebImageHighPriority) downloaderOptions |= SDWebImageDownloaderHighPriority;
-            if (options & SDWebImageScaleDownLargeImages) downloaderOptions |= SDWebImageDownloaderScaleDownLargeImages;
-            
-            if (cachedImage && options & SDWebImageRefreshCached) {
-                // force progressive off if image already cached but forced refreshing
-                downloaderOptions &= ~SDWebImageDownloaderProgressiveDownload;
-                // ignore image read from NSURLCache if image if cached but force refreshing
-                downloaderOptions |= SDWebImageDownloaderIgnoreCachedResponse;
+- (void)transformCachedImage:(nonnull UIImage *)originalImage
+                forOperation:(nullable SDWebImageCombinedOperation *)operation
+                         url:(nonnull NSURL *)url
+                         key:(nullable NSString *)key
+                     options:(SDWebImageOptions)options
+                     context:(nullable SDWebImageContext *)context
+                   cacheType:(SDImageCacheType)cacheType
+                   completed:(nonnull SDInternalCompletionBlock)completedBlock {
+    if (!operation || operation.isCancelled) {
+        [self safelyRemoveOperationFromRunning:operation];
+        return;
+    }
+    id<SDWebImageTransformer> transformer = SDTransformerFromContext(context);
+    BOOL cacheOnDisk = !(options & SDWebImageCacheMemoryOnly);
+    [self.transformStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull transformDone) {
+        UIImage *transformedImage = [transformer transformedImageWithImage:originalImage forKey:key];
+        transformDone();
+        if (transformedImage) {
+            [self storeTransformedImage:transformedImage forKey:key transformer:transformer context:context toDisk:cacheOnDisk traceIdentifier:operation.traceIdentifier];
+        }
+        [self callCompletionBlockForOperation:operation completion:completedBlock image:transformedImage data:nil error:nil cacheType:cacheType finished:YES url:url];
+        [self safelyRemoveOperationFromRunning:operation];
+    } traceIdentifier:operation.traceIdentifier];
+}
+
+- (void)fetchImageForOperation:(nonnull SDWebImageCombinedOperation *)operation
+                           url:(nonnull NSURL *)url
+                           key:(nullable NSString *)key
+                       options:(SDWebImageOptions)options
+                       context:(nullable SDWebImageContext *)context
+                   cachedImage:(nullable UIImage *)cachedImage
+                      progress:(nullable SDWebImageDownloaderProgressBlock)progressBlock
+                     completed:(nonnull SDInternalCompletionBlock)completedBlock
+                          done:(nonnull SDWebImagePipelineStageDoneBlock)fetchDone {
+    // download if no image or requested to refresh anyway, and download allowed by delegate
+    SDWebImageDownloaderOptions downloaderOptions = 0;
+    if (options & SDWebImageLowPriority) downloaderOptions |= SDWebImageDownloaderLowPriority;
+    if (options & SDWebImageProgressiveDownload) downloaderOptions |= SDWebImageDownloaderProgressiveDownload;
+    if (options & SDWebImageRefreshCached) downloaderOptions |= SDWebImageDownloaderUseNSURLCache;
+    if (options & SDWebImageContinueInBackground) downloaderOptions |= SDWebImageDownloaderContinueInBackground;
+    if (options & SDWebImageHandleCookies) downloaderOptions |= SDWebImageDownloaderHandleCookies;
+    if (options & SDWebImageAllowInvalidSSLCertificates) downloaderOptions |= SDWebImageDownloaderAllowInvalidSSLCertificates;
+    if (options & SDWebImageHighPriority) downloaderOptions |= SDWebImageDownloaderHighPriority;
+    if (options & SDWebImageScaleDownLargeImages) downloaderOptions |= SDWebImageDownloaderScaleDownLargeImages;
+    
+    if (cachedImage && options & SDWebImageRefreshCached) {
+        // force progressive off if image already cached but forced refreshing
+        downloaderOptions &= ~SDWebImageDownloaderProgressiveDownload;
+        // ignore image read from NSURLCache if image if cached but force refreshing
+        downloaderOptions |= SDWebImageDownloaderIgnoreCachedResponse;
+    }
+    
+    id<SDWebImageLoader> imageLoader = [self imageLoaderForURL:url];
+    // Have a large body written in the disk cache's directory, so that it can be moved into the cache rather than written again
+    SDWebImageContext *downloadContext = context;
+    BOOL shouldLinkDownloadFile = NO;
+    if (imageLoader == self.imageDownloader && !(options & SDWebImageCacheMemoryOnly)) {
+        shouldLinkDownloadFile = YES;
+        if (!context[SDWebImageContextDownloadDirectory]) {
+            NSMutableDictionary<SDWebImageContextOption, id> *mutableContext = context ? [context mutableCopy] : [NSMutableDictionary dictionary];
+            mutableContext[SDWebImageContextDownloadDirectory] = [self.imageCache downloadDirectoryPath];
+            downloadContext = [mutableContext copy];
+        }
+    }
+    
+    // `SDWebImageCombinedOperation` -> `SDWebImageDownloadToken` -> `downloadOperationCancelToken`, which retains the completed block bellow, so we need weak-strong again to avoid retain cycle
+    __weak typeof(operation) weakSubOperation = operation;
+    operation.loaderOperation = [imageLoader loadImageWithURL:url options:downloaderOptions context:downloadContext progress:progressBlock completed:^(UIImage *downloadedImage, NSData *downloadedData, NSError *error, BOOL finished) {
+        if (finished) {
+            fetchDone();
+        }
+        __strong typeof(weakSubOperation) strongSubOperation = weakSubOperation;
+        // The link to the file of the download, moved into the cache or removed by the branch taken
+        NSString *downloadFilePath = nil;
+        BOOL downloadFileHandled = NO;
+        if (!strongSubOperation || strongSubOperation.isCancelled) {
+            // Do nothing if the operation was cancelled
+            // See #699 for more details
+            // if we would call the completedBlock, there could be a race condition between this block and another completedBlock for the same object, so if this one is called second, we will overwrite the new data
+        } else if (error) {
+            [self callCompletionBlockForOperation:strongSubOperation completion:completedBlock error:error url:url];
+
+            if (   error.code != NSURLErrorNotConnectedToInternet
+                && error.code != NSURLErrorCancelled
+                && error.code != NSURLErrorTimedOut
+                && error.code != NSURLErrorInternationalRoamingOff
+                && error.code != NSURLErrorDataNotAllowed
+                && error.code != NSURLErrorCannotFindHost
+                && error.code != NSURLErrorCannotConnectToHost
+                && error.code != NSURLErrorNetworkConnectionLost
+                && !([error.domain isEqualToString:SDWebImageErrorDomain] && error.code == SDWebImageErrorPixelBudgetExceeded)) {
+                [self recordFailedURL:url error:error];
+            }
+        }
+        else {
+            [self removeFailedURL:url];
+            if (finished && shouldLinkDownloadFile) {
+                downloadFilePath = [self linkDownloadFileForLoaderOperation:strongSubOperation.loaderOperation];
             }
             
-            // `SDWebImageCombinedOperation` -> `SDWebImageDownloadToken` -> `downloadOperationCancelToken`, which is a `SDCallbacksDictionary` and retain the completed block bellow, so we need weak-strong again to avoid retain cycle
-            __weak typeof(strongOperation) weakSubOperation = strongOperation;
-            strongOperation.downloadToken = [self.imageDownloader downloadImageWithURL:url options:downloaderOptions progress:progressBlock completed:^(UIImage *downloadedImage, NSData *downloadedData, NSError *error, BOOL finished) {
-                __strong typeof(weakSubOperation) strongSubOperation = weakSubOperation;
-                if (!strongSubOperation || strongSubOperation.isCancelled) {
-                    // Do nothing if the operation was cancelled
-                    // See #699 for more details
-                    // if we would call the completedBlock, there could be a race condition between this block and another completedBlock for the same object, so if this one is called second, we will overwrite the new data
-                } else if (error) {
-                    [self callCompletionBlockForOperation:strongSubOperation completion:completedBlock error:error url:url];
-
-                    if (   error.code != NSURLErrorNotConnectedToInternet
-                        && error.code != NSURLErrorCancelled
-                        && error.code != NSURLErrorTimedOut
-                        && error.code != NSURLErrorInternationalRoamingOff
-                        && error.code != NSURLErrorDataNotAllowed
-                        && error.code != NSURLErrorCannotFindHost
-                        && error.code != NSURLErrorCannotConnectToHost
-                        && error.code != NSURLErrorNetworkConnectionLost) {
-                        @synchronized (self.failedURLs) {
-                            [self.failedURLs addObject:url];
-                        }
+            BOOL cacheOnDisk = !(options & SDWebImageCacheMemoryOnly);
+            
+            // We've done the scale process in SDWebImageDownloader with the shared manager, this is used for custom manager and avoid extra scale.
+            if (self != [SDWebImageManager sharedManager] && self.cacheKeyFilter && downloadedImage) {
+                downloadedImage = [self scaledImageForKey:key image:downloadedImage];
+            }
+
+            CGSize thumbnailPixelSize = SDThumbnailPixelSizeFromContext(context);
+            BOOL isThumbnail = thumbnailPixelSize.width >= 1 && thumbnailPixelSize.height >= 1;
+
+            id<SDWebImageTransformer> transformer = SDTransformerFromContext(context);
+            if (options & SDWebImageRefreshCached && cachedImage && !downloadedImage) {
+                // Image refresh hit the NSURLCache cache, do not call the completion block
+            } else if (downloadedImage && transformer && (!downloadedImage.images || (options & SDWebImageTransformAnimatedImage))) {
+                downloadFileHandled = YES;
+                NSNumber *storeOriginalImage = context[SDWebImageContextStoreOriginalImage];
+                BOOL shouldStoreOriginalImage = storeOriginalImage ? storeOriginalImage.boolValue : YES;
+                [self.transformStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull transformDone) {
+                    UIImage *sourceImage = downloadedImage;
+                    if (isThumbnail) {
+                        // transform the thumbnail rather than the full size image, the progressive partial images too
+                        sourceImage = [self.imageCache thumbnailImageForKey:key image:downloadedImage thumbnailPixelSize:thumbnailPixelSize];
                     }
-                }
-                else {
-                    if ((options & SDWebImageRetryFailed)) {
-                        @synchronized (self.failedURLs) {
-                            [self.failedURLs removeObject:url];
+                    UIImage *transformedImage = [transformer transformedImageWithImage:sourceImage forKey:key];
+                    transformDone();
+                    
+                    if (finished) {
+                        if (shouldStoreOriginalImage && cacheOnDisk) {
+                            // The memory cache only holds the transformed image
+                            [self storeImage:downloadedImage imageData:downloadedData downloadFilePath:downloadFilePath forKey:key toMemory:NO toDisk:YES traceIdentifier:strongSubOperation.traceIdentifier];
+                        } else {
+                            [self removeDownloadFileAtPath:downloadFilePath];
+                        }
+                        if (transformedImage) {
+                            [self storeTransformedImage:transformedImage forKey:key transformer:transformer context:context toDisk:cacheOnDisk traceIdentifier:strongSubOperation.traceIdentifier];
                         }
                     }
                     
-                    BOOL cacheOnDisk = !(options & SDWebImageCacheMemoryOnly);
-                    
-                    // We've done the scale process in SDWebImageDownloader with the shared manager, this is used for custom manager and avoid extra scale.
-                    if (self != [SDWebImageManager sharedManager] && self.cacheKeyFilter && downloadedImage) {
-                        downloadedImage = [self scaledImageForKey:key image:downloadedImage];
+                    [self callCompletionBlockForOperation:strongSubOperation completion:completedBlock image:transformedImage data:downloadedData error:nil cacheType:SDImageCacheTypeNone finished:finished url:url];
+                } traceIdentifier:strongSubOperation.traceIdentifier];
+            } else if (downloadedImage && (!downloadedImage.images || (options & SDWebImageTransformAnimatedImage)) && [self.delegate respondsToSelector:@selector(imageManager:transformDownloadedImage:withURL:)]) {
+                downloadFileHandled = YES;
+                [self.transformStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull transformDone) {
+                    UIImage *sourceImage = downloadedImage;
+                    if (isThumbnail) {
+                        // transform the thumbnail rather than the full size image, the progressive partial images too
+                        sourceImage = [self.imageCache thumbnailImageForKey:key image:downloadedImage thumbnailPixelSize:thumbnailPixelSize];
                     }
-
-                    if (options & SDWebImageRefreshCached && cachedImage && !downloadedImage) {
-                        // Image refresh hit the NSURLCache cache, do not call the completion block
-                    } else if (downloadedImage && (!downloadedImage.images || (options & SDWebImageTransformAnimatedImage)) && [self.delegate respondsToSelector:@selector(imageManager:transformDownloadedImage:withURL:)]) {
-                        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-                            UIImage *transformedImage = [self.delegate imageManager:self transformDownloadedImage:downloadedImage withURL:url];
-
-                            if (transformedImage && finished) {
-                                BOOL imageWasTransformed = ![transformedImage isEqual:downloadedImage];
-                                // pass nil if the image was transformed, so we can recalculate the data from the image
-                                [self.imageCache storeImage:transformedImage imageData:(imageWasTransformed ? nil : downloadedData) forKey:key toDisk:cacheOnDisk completion:nil];
-                            }
-                            
-                            [self callCompletionBlockForOperation:strongSubOperation completion:completedBlock image:transformedImage data:downloadedData error:nil cacheType:SDImageCacheTypeNone finished:finished url:url];
-                        });
-                    } else {
-                        if (downloadedImage && finished) {
-                            [self.imageCache storeImage:downloadedImage imageData:downloadedData forKey:key toDisk:cacheOnDisk completion:nil];
+                    UIImage *transformedImage = [self.delegate imageManager:self transformDownloadedImage:sourceImage withURL:url];
+                    transformDone();
+
+                    if (transformedImage && finished) {
+                        if (isThumbnail) {
+                            [self removeDownloadFileAtPath:downloadFilePath];
+                            [self storeThumbnailImage:transformedImage forKey:key thumbnailPixelSize:thumbnailPixelSize toDisk:cacheOnDisk traceIdentifier:strongSubOperation.traceIdentifier];
+                        } else {
+                            BOOL imageWasTransformed = ![transformedImage isEqual:downloadedImage];
+                            // pass nil if the image was transformed, so we can recalculate the data from the image
+                            [self storeImage:transformedImage imageData:(imageWasTransformed ? nil : downloadedData) downloadFilePath:downloadFilePath forKey:key toMemory:YES toDisk:cacheOnDisk traceIdentifier:strongSubOperation.traceIdentifier];
                         }
-                        [self callCompletionBlockForOperation:strongSubOperation completion:completedBlock image:downloadedImage data:downloadedData error:nil cacheType:SDImageCacheTypeNone finished:finished url:url];
+                    } else if (finished) {
+                        [self removeDownloadFileAtPath:downloadFilePath];
+                    }
+                    
+                    [self callCompletionBlockForOperation:strongSubOperation completion:completedBlock image:transformedImage data:downloadedData error:nil cacheType:SDImageCacheTypeNone finished:finished url:url];
+                } traceIdentifier:strongSubOperation.traceIdentifier];
+            } else {
+                UIImage *image = downloadedImage;
+                if (image && finished) {
+                    downloadFileHandled = YES;
+                    if (isThumbnail) {
+                        // keep the original data on disk so other sizes can be derived later, and only the thumbnail in memory
+                        [self storeImage:downloadedImage imageData:downloadedData downloadFilePath:downloadFilePath forKey:key toMemory:NO toDisk:cacheOnDisk traceIdentifier:strongSubOperation.traceIdentifier];
+                        image = [self.imageCache thumbnailImageForKey:key image:downloadedImage thumbnailPixelSize:thumbnailPixelSize];
+                        [self storeThumbnailImage:image forKey:key thumbnailPixelSize:thumbnailPixelSize toDisk:NO traceIdentifier:strongSubOperation.traceIdentifier];
+                    } else {
+                        [self storeImage:downloadedImage imageData:downloadedData downloadFilePath:downloadFilePath forKey:key toMemory:YES toDisk:cacheOnDisk traceIdentifier:strongSubOperation.traceIdentifier];
                     }
+                } else if (image && isThumbnail) {
+                    // the progressive partial images are delivered at the thumbnail size too
+                    image = [self.imageCache thumbnailImageForKey:key image:downloadedImage thumbnailPixelSize:thumbnailPixelSize];
                 }
+                [self callCompletionBlockForOperation:strongSubOperation completion:completedBlock image:image data:downloadedData error:nil cacheType:SDImageCacheTypeNone finished:finished url:url];
+            }
+        }
 
-                if (finished) {
-                    [self safelyRemoveOperationFromRunning:strongSubOperation];
-                }
-            } context:context];
-        } else if (cachedImage) {
-            [self callCompletionBlockForOperation:strongOperation completion:completedBlock image:cachedImage data:cachedData error:nil cacheType:cacheType finished:YES url:url];
-            [self safelyRemoveOperationFromRunning:strongOperation];
-        } else {
-            // Image not in cache and download disallowed by delegate
-            [self callCompletionBlockForOperation:strongOperation completion:completedBlock image:nil data:nil error:nil cacheType:SDImageCacheTypeNone finished:YES url:url];
-            [self safelyRemoveOperationFromRunning:strongOperation];
+        if (finished) {
+            if (!downloadFileHandled) {
+                [self removeDownloadFileAtPath:downloadFilePath];
+            }
+            [self safelyRemoveOperationFromRunning:strongSubOperation];
+        }
+    }];
+}
+
+#pragma mark - Cache Query
+
+- (nullable NSOperation *)queryCacheForKey:(nullable NSString *)key
+                                   options:(SDImageCacheOptions)options
+                                   context:(nullable SDWebImageContext *)context
+                                      done:(nonnull SDCacheQueryCompletedBlock)doneBlock {
+    if (!key || (options & SDImageCacheQueryDiskSync)) {
+        // A synchronous query can not wait for a query of another thread
+        return [self.imageCache queryCacheOperationForKey:key options:options done:doneBlock context:context];
+    }
+    CGSize thumbnailPixelSize = SDThumbnailPixelSizeFromContext(context);
+    NSString *queryKey = [NSString stringWithFormat:@"%@|%lu|%.0fx%.0f", key, (unsigned long)options, thumbnailPixelSize.width, thumbnailPixelSize.height];
+    SDWebImageCacheQueryToken *token = [SDWebImageCacheQueryToken new];
+    token.doneBlock = doneBlock;
+    token.manager = self;
+    
+    LOCK(self.cacheQueriesLock);
+    SDWebImageCacheQuery *query = self.cacheQueries[queryKey];
+    if (query) {
+        token.query = query;
+        [query.tokens addObject:token];
+        UNLOCK(self.cacheQueriesLock);
+        return token;
+    }
+    query = [SDWebImageCacheQuery new];
+    query.queryKey = queryKey;
+    query.tokens = [NSMutableArray arrayWithObject:token];
+    token.query = query;
+    self.cacheQueries[queryKey] = query;
+    UNLOCK(self.cacheQueriesLock);
+    
+    // A memory hit calls back before the cache operation is returned
+    NSOperation *cacheOperation = [self.imageCache queryCacheOperationForKey:key options:options done:^(UIImage * _Nullable image, NSData * _Nullable data, SDImageCacheType cacheType) {
+        LOCK(self.cacheQueriesLock);
+        if (self.cacheQueries[queryKey] == query) {
+            [self.cacheQueries removeObjectForKey:queryKey];
+        }
+        NSArray<SDWebImageCacheQueryToken *> *tokens = [query.tokens copy];
+        [query.tokens removeAllObjects];
+        UNLOCK(self.cacheQueriesLock);
+        for (SDWebImageCacheQueryToken *queryToken in tokens) {
+            if (!queryToken.isCancelled) {
+                queryToken.doneBlock(image, data, cacheType);
+            }
         }
     } context:context];
+    
+    LOCK(self.cacheQueriesLock);
+    query.cacheOperation = cacheOperation;
+    BOOL cancelled = query.isCancelled;
+    UNLOCK(self.cacheQueriesLock);
+    if (cancelled) {
+        [cacheOperation cancel];
+    }
+    return token;
+}
 
-    return operation;
+- (void)cancelCacheQueryToken:(nonnull SDWebImageCacheQueryToken *)token {
+    SDWebImageCacheQuery *query = token.query;
+    if (!query) {
+        return;
+    }
+    NSOperation *cacheOperation = nil;
+    LOCK(self.cacheQueriesLock);
+    [query.tokens removeObjectIdenticalTo:token];
+    if (query.tokens.count == 0 && !query.isCancelled) {
+        // The last requester cancels the query itself, a later request of the key starts a new one
+        query.cancelled = YES;
+        cacheOperation = query.cacheOperation;
+        if (self.cacheQueries[query.queryKey] == query) {
+            [self.cacheQueries removeObjectForKey:query.queryKey];
+        }
+    }
+    UNLOCK(self.cacheQueriesLock);
+    [cacheOperation cancel];
+}
+
+#pragma mark - Failed URLs
+
+- (nonnull SDWebImageFailedURLShard *)failedURLShardForURL:(nonnull NSURL *)url {
+    return self.failedURLShards[url.hash % self.failedURLShards.count];
+}
+
+- (BOOL)isFailedURL:(nonnull NSURL *)url {
+    SDWebImageFailedURLShard *shard = [self failedURLShardForURL:url];
+    LOCK(shard->_lock);
+    SDWebImageFailedURLEntry *entry = shard->_entries[url];
+    BOOL isFailedURL = entry && [NSProcessInfo processInfo].systemUptime < entry.retryTime;
+    if (isFailedURL) {
+        [shard->_recentURLs removeObject:url];
+        [shard->_recentURLs addObject:url];
+    }
+    UNLOCK(shard->_lock);
+    return isFailedURL;
+}
+
+- (SDWebImageFailureClass)failureClassForError:(nonnull NSError *)error {
+    if ([error.domain isEqualToString:NSURLErrorDomain]) {
+        switch (error.code) {
+            case NSURLErrorBadURL:
+            case NSURLErrorUnsupportedURL:
+            case NSURLErrorFileDoesNotExist:
+            case NSURLErrorNoPermissionsToReadFile:
+            case NSURLErrorCannotDecodeContentData:
+                return SDWebImageFailureClassPermanent;
+            default:
+                // The downloaders may report the HTTP status code as the error code, client errors do not go away by themselves
+                return (error.code >= 400 && error.code < 500) ? SDWebImageFailureClassPermanent : SDWebImageFailureClassTransient;
+        }
+    }
+    // The image data could not be decoded
+    if ([error.domain isEqualToString:SDWebImageErrorDomain]) {
+        return SDWebImageFailureClassPermanent;
+    }
+    return SDWebImageFailureClassTransient;
+}
+
+- (void)recordFailedURL:(nonnull NSURL *)url error:(nonnull NSError *)error {
+    NSUInteger countLimit = self.failedURLsCountLimit;
+    if (countLimit == 0) {
+        return;
+    }
+    NSUInteger shardCountLimit = MAX((countLimit + self.failedURLShards.count - 1) / self.failedURLShards.count, 1);
+    SDWebImageFailureClass failureClass = [self failureClassForError:error];
+    NSTimeInterval now = [NSProcessInfo processInfo].systemUptime;
+    
+    SDWebImageFailedURLShard *shard = [self failedURLShardForURL:url];
+    LOCK(shard->_lock);
+    SDWebImageFailedURLEntry *entry = shard->_entries[url];
+    if (!entry) {
+        entry = [SDWebImageFailedURLEntry new];
+        shard->_entries[url] = entry;
+    }
+    entry.failureClass = failureClass;
+    entry.failureCount++;
+    entry.failureTime = now;
+    // Exponential backoff, each failure doubles the interval, with a random jitter so that the URLs failed together are not retried together
+    NSTimeInterval interval = self.failedURLRetryInterval * (failureClass == SDWebImageFailureClassPermanent ? kPermanentFailureIntervalFactor : 1);
+    interval = MIN(interval * pow(2, MIN(entry.failureCount - 1, 32)), self.maxFailedURLRetryInterval);
+    interval *= 0.5 + 0.5 * arc4random_uniform(1001) / 1000.0;
+    entry.retryTime = now + interval;
+    [shard->_recentURLs removeObject:url];
+    [shard->_recentURLs addObject:url];
+    while (shard->_recentURLs.count > shardCountLimit) {
+        NSURL *leastRecentURL = shard->_recentURLs.firstObject;
+        [shard->_recentURLs removeObjectAtIndex:0];
+        [shard->_entries removeObjectForKey:leastRecentURL];
+    }
+    UNLOCK(shard->_lock);
+}
+
+- (void)removeFailedURL:(nonnull NSURL *)url {
+    SDWebImageFailedURLShard *shard = [self failedURLShardForURL:url];
+    LOCK(shard->_lock);
+    if (shard->_entries[url]) {
+        [shard->_entries removeObjectForKey:url];
+        [shard->_recentURLs removeObject:url];
+    }
+    UNLOCK(shard->_lock);
+}
+
+- (void)removeAllFailedURLs {
+    for (SDWebImageFailedURLShard *shard in self.failedURLShards) {
+        LOCK(shard->_lock);
+        [shard->_entries removeAllObjects];
+        [shard->_recentURLs removeAllObjects];
+        UNLOCK(shard->_lock);
+    }
+}
+
+#pragma mark - Image loaders
+
+- (void)setImageLoader:(nullable id<SDWebImageLoader>)loader forURLScheme:(nonnull NSString *)scheme {
+    LOCK(self.imageLoadersLock);
+    self.imageLoaders[scheme.lowercaseString] = loader;
+    UNLOCK(self.imageLoadersLock);
+}
+
+- (nullable id<SDWebImageLoader>)imageLoaderForURLScheme:(nonnull NSString *)scheme {
+    LOCK(self.imageLoadersLock);
+    id<SDWebImageLoader> loader = self.imageLoaders[scheme.lowercaseString];
+    UNLOCK(self.imageLoadersLock);
+    return loader;
+}
+
+- (nonnull id<SDWebImageLoader>)imageLoaderForURL:(nonnull NSURL *)url {
+    id<SDWebImageLoader> loader = url.scheme ? [self imageLoaderForURLScheme:url.scheme] : nil;
+    if ([loader canLoadWithURL:url]) {
+        return loader;
+    }
+    return self.imageDownloader;
+}
+
+#pragma mark - Store
+
+// Move the file the body has been streamed to into the disk cache instead of writing the data again
+// The store stage runs until the image is encoded and written to disk
+- (void)storeImage:(nonnull UIImage *)image
+         imageData:(nullable NSData *)imageData
+  downloadFilePath:(nullable NSString *)downloadFilePath
+            forKey:(nullable NSString *)key
+          toMemory:(BOOL)toMemory
+            toDisk:(BOOL)toDisk
+   traceIdentifier:(nullable NSNumber *)traceIdentifier {
+    [self.storeStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull storeDone) {
+        if (downloadFilePath && imageData && toDisk && [[NSFileManager defaultManager] fileExistsAtPath:downloadFilePath]) {
+            [self.imageCache storeImage:image imageData:imageData forKey:key toMemory:toMemory toDisk:NO completion:nil];
+            [self.imageCache storeImageDataFileAtPath:downloadFilePath forKey:key completion:^(NSError * _Nullable error) {
+                storeDone();
+            }];
+            return;
+        }
+        [self removeDownloadFileAtPath:downloadFilePath];
+        [self.imageCache storeImage:image imageData:imageData forKey:key toMemory:toMemory toDisk:toDisk completion:^(NSError * _Nullable error) {
+            storeDone();
+        }];
+    } traceIdentifier:traceIdentifier];
+}
+
+// The transformed image is encoded again, the data of the original does not match it
+- (void)storeTransformedImage:(nonnull UIImage *)image
+                       forKey:(nullable NSString *)key
+                  transformer:(nonnull id<SDWebImageTransformer>)transformer
+                      context:(nullable SDWebImageContext *)context
+                       toDisk:(BOOL)toDisk
+              traceIdentifier:(nullable NSNumber *)traceIdentifier {
+    NSString *transformedKey = SDTransformedKeyForKey(key, transformer.transformerKey);
+    if (key && transformedKey) {
+        // Removing the original image removes the transformed images too
+        [self.imageCache addDerivedKey:transformedKey forKey:key toDisk:toDisk];
+    }
+    CGSize thumbnailPixelSize = SDThumbnailPixelSizeFromContext(context);
+    if (thumbnailPixelSize.width >= 1 && thumbnailPixelSize.height >= 1) {
+        [self storeThumbnailImage:image forKey:transformedKey thumbnailPixelSize:thumbnailPixelSize toDisk:toDisk traceIdentifier:traceIdentifier];
+    } else {
+        [self storeImage:image imageData:nil downloadFilePath:nil forKey:transformedKey toMemory:YES toDisk:toDisk traceIdentifier:traceIdentifier];
+    }
+}
+
+- (void)storeThumbnailImage:(nonnull UIImage *)image
+                     forKey:(nullable NSString *)key
+         thumbnailPixelSize:(CGSize)thumbnailPixelSize
+                     toDisk:(BOOL)toDisk
+            traceIdentifier:(nullable NSNumber *)traceIdentifier {
+    [self.storeStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull storeDone) {
+        [self.imageCache storeThumbnailImage:image forKey:key thumbnailPixelSize:thumbnailPixelSize toDisk:toDisk completion:^(NSError * _Nullable error) {
+            storeDone();
+        }];
+    } traceIdentifier:traceIdentifier];
+}
+
+// The file belongs to the download, which may be shared with other loads and removes it once their completion blocks have run. A hard link keeps it for this load, call from the completion block
+- (nullable NSString *)linkDownloadFileForLoaderOperation:(nullable id<SDWebImageOperation>)loaderOperation {
+    if (![loaderOperation isKindOfClass:[SDWebImageDownloadToken class]]) {
+        return nil;
+    }
+    NSString *operationFilePath = ((SDWebImageDownloadToken *)loaderOperation).downloadFilePath;
+    if (!operationFilePath) {
+        return nil;
+    }
+    NSString *downloadFilePath = [self.imageCache makeDownloadFilePath];
+    [[NSFileManager defaultManager] createDirectoryAtPath:downloadFilePath.stringByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+    // Such as a directory given in the context on another volume, the data is written to the cache instead
+    if (link(operationFilePath.fileSystemRepresentation, downloadFilePath.fileSystemRepresentation) != 0) {
+        return nil;
+    }
+    return downloadFilePath;
+}
+
+- (void)removeDownloadFileAtPath:(nullable NSString *)downloadFilePath {
+    if (!downloadFilePath) {
+        return;
+    }
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        [[NSFileManager defaultManager] removeItemAtPath:downloadFilePath error:nil];
+    });
 }
 
 - (void)saveImageToCache:(nullable UIImage *)image forURL:(nullable NSURL *)url {
@@ -276,27 +865,63 @@
 }
 
 - (void)cancelAll {
-    @synchronized (self.runningOperations) {
-        NSArray<SDWebImageCombinedOperation *> *copiedOperations = [self.runningOperations copy];
-        [copiedOperations makeObjectsPerformSelector:@selector(cancel)];
-        [self.runningOperations removeObjectsInArray:copiedOperations];
+    // The running operations are swapped out rather than copied, and cancelled out of the lock as their cancel removes them from running
+    LOCK(self.runningOperationsLock);
+    NSSet<SDWebImageCombinedOperation *> *operations = self.runningOperations;
+    self.runningOperations = [NSMutableSet new];
+    [self.groupedOperations removeAllObjects];
+    UNLOCK(self.runningOperationsLock);
+    [operations makeObjectsPerformSelector:@selector(cancel)];
+}
+
+- (void)cancelOperationsInGroup:(nonnull NSString *)group {
+    LOCK(self.runningOperationsLock);
+    NSSet<SDWebImageCombinedOperation *> *operations = self.groupedOperations[group];
+    if (operations) {
+        [self.groupedOperations removeObjectForKey:group];
+        [self.runningOperations minusSet:operations];
     }
+    UNLOCK(self.runningOperationsLock);
+    [operations makeObjectsPerformSelector:@selector(cancel)];
 }
 
 - (BOOL)isRunning {
-    BOOL isRunning = NO;
-    @synchronized (self.runningOperations) {
-        isRunning = (self.runningOperations.count > 0);
-    }
+    LOCK(self.runningOperationsLock);
+    BOOL isRunning = (self.runningOperations.count > 0);
+    UNLOCK(self.runningOperationsLock);
     return isRunning;
 }
 
+- (void)addOperationToRunning:(nonnull SDWebImageCombinedOperation *)operation {
+    LOCK(self.runningOperationsLock);
+    [self.runningOperations addObject:operation];
+    NSString *group = operation.group;
+    if (group) {
+        NSMutableSet<SDWebImageCombinedOperation *> *operations = self.groupedOperations[group];
+        if (!operations) {
+            operations = [NSMutableSet new];
+            self.groupedOperations[group] = operations;
+        }
+        [operations addObject:operation];
+    }
+    UNLOCK(self.runningOperationsLock);
+}
+
 - (void)safelyRemoveOperationFromRunning:(nullable SDWebImageCombinedOperation*)operation {
-    @synchronized (self.runningOperations) {
-        if (operation) {
-            [self.runningOperations removeObject:operation];
+    if (!operation) {
+        return;
+    }
+    LOCK(self.runningOperationsLock);
+    [self.runningOperations removeObject:operation];
+    NSString *group = operation.group;
+    if (group) {
+        NSMutableSet<SDWebImageCombinedOperation *> *operations = self.groupedOperations[group];
+        [operations removeObject:operation];
+        if (operations.count == 0) {
+            [self.groupedOperations removeObjectForKey:group];
         }
     }
+    UNLOCK(self.runningOperationsLock);
 }
 
 - (void)callCompletionBlockForOperation:(nullable SDWebImageCombinedOperation*)operation
@@ -314,30 +939,60 @@
                               cacheType:(SDImageCacheType)cacheType
                                finished:(BOOL)finished
                                     url:(nullable NSURL *)url {
-    dispatch_main_async_safe(^{
+    [self.deliveryStage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull deliveryDone) {
         if (operation && !operation.isCancelled && completionBlock) {
             completionBlock(image, data, error, cacheType, finished, url);
         }
-    });
+        deliveryDone();
+    } traceIdentifier:operation.traceIdentifier];
 }
 
 @end
 
 
+@implementation SDWebImageCacheQueryToken
+
+- (void)cancel {
+    [super cancel];
+    [self.manager cancelCacheQueryToken:self];
+}
+
+@end
+
 @implementation SDWebImageCombinedOperation
 
+- (BOOL)addStageDoneBlock:(nonnull SDWebImagePipelineStageDoneBlock)doneBlock {
+    @synchronized (self) {
+        if (self.isCancelled) {
+            return NO;
+        }
+        if (!self.stageDoneBlocks) {
+            self.stageDoneBlocks = [NSMutableArray array];
+        }
+        [self.stageDoneBlocks addObject:[doneBlock copy]];
+        return YES;
+    }
+}
+
 - (void)cancel {
+    NSArray<SDWebImagePipelineStageDoneBlock> *stageDoneBlocks;
     @synchronized(self) {
         self.cancelled = YES;
         if (self.cacheOperation) {
             [self.cacheOperation cancel];
             self.cacheOperation = nil;
         }
-        if (self.downloadToken) {
-            [self.manager.imageDownloader cancel:self.downloadToken];
+        if (self.loaderOperation) {
+            [self.loaderOperation cancel];
         }
+        stageDoneBlocks = [self.stageDoneBlocks copy];
+        self.stageDoneBlocks = nil;
         [self.manager safelyRemoveOperationFromRunning:self];
     }
+    // The done blocks start the next tasks of their stages, which must not run under this lock. A done block already called has no effect
+    for (SDWebImagePipelineStageDoneBlock doneBlock in stageDoneBlocks) {
+        doneBlock();
+    }
 }
 
 @end
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+#import "NSData+ImageContentType.h"
+
+/**
+ * What the header of an image tells before the image is loaded, see `-[SDWebImageDownloader probeImageWithURL:completed:]`.
+ */
+@interface SDWebImageMetadata : NSObject
+
+/**
+ * The image format, `SDImageFormatUndefined` if unknown.
+ */
+@property (assign, nonatomic, readonly) SDImageFormat format;
+
+/**
+ * The size of the stored pixels, before the orientation is applied.
+ */
+@property (assign, nonatomic, readonly) CGSize pixelSize;
+
+/**
+ * The EXIF orientation, from 1 to 8. Defaults to 1 (up) when the image does not specify it.
+ */
+@property (assign, nonatomic, readonly) NSInteger exifOrientation;
+
+#if SD_UIKIT || SD_WATCH
+/**
+ * The EXIF orientation as an iOS one.
+ */
+@property (assign, nonatomic, readonly) UIImageOrientation imageOrientation;
+#endif
+
+/**
+ * Whether the image declares more than one frame (GIF, APNG or animated WebP).
+ */
+@property (assign, nonatomic, readonly, getter = isAnimated) BOOL animated;
+
+/**
+ * Reads the metadata from the first bytes of an image, usually the first few KB are enough.
+ *
+ * @param data The image data, which may be truncated
+ *
+ * @return The metadata, or nil if the data does not contain the pixel size yet
+ */
++ (nullable instancetype)metadataWithData:(nullable NSData *)data;
+
+/**
+ * The metadata of an image already loaded. Its format is unknown once decoded.
+ */
++ (nullable instancetype)metadataWithImage:(nullable UIImage *)image;
+
+@end
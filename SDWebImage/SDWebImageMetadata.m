@@ -0,0 +1,106 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageMetadata.h"
+#import "SDWebImageCoderHelper.h"
+#import "SDWebImageDataScanner.h"
+#import "NSImage+Additions.h"
+#import <ImageIO/ImageIO.h>
+
+@interface SDWebImageMetadata ()
+
+@property (assign, nonatomic, readwrite) SDImageFormat format;
+@property (assign, nonatomic, readwrite) CGSize pixelSize;
+@property (assign, nonatomic, readwrite) NSInteger exifOrientation;
+@property (assign, nonatomic, readwrite, getter = isAnimated) BOOL animated;
+
+@end
+
+@implementation SDWebImageMetadata
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _format = SDImageFormatUndefined;
+        _exifOrientation = 1;
+    }
+    return self;
+}
+
+#if SD_UIKIT || SD_WATCH
+- (UIImageOrientation)imageOrientation {
+    return [SDWebImageCoderHelper imageOrientationFromEXIFOrientation:self.exifOrientation];
+}
+#endif
+
++ (nullable instancetype)metadataWithData:(nullable NSData *)data {
+    SDImageFormat format = [NSData sd_imageFormatForImageData:data];
+    if (format == SDImageFormatUndefined) {
+        return nil;
+    }
+    SDWebImageMetadata *metadata = [self new];
+    metadata.format = format;
+    // The same scanner as the downloads reads the headers of JPEG, PNG, GIF and WebP
+    SDWebImageDataScanner *dataScanner = [SDWebImageDataScanner new];
+    [dataScanner scanData:data];
+    if (dataScanner.pixelWidth > 0 && dataScanner.pixelHeight > 0) {
+        metadata.pixelSize = CGSizeMake(dataScanner.pixelWidth, dataScanner.pixelHeight);
+        metadata.animated = dataScanner.isAnimated;
+    }
+    if (format != SDImageFormatWebP) {
+        // Image/IO reads the orientation, and the pixel size of the other formats. It does not read WebP on all the supported systems
+        [metadata readImageIOPropertiesFromData:data];
+    }
+    if (metadata.pixelSize.width <= 0 || metadata.pixelSize.height <= 0) {
+        return nil;
+    }
+    return metadata;
+}
+
++ (nullable instancetype)metadataWithImage:(nullable UIImage *)image {
+    CGImageRef imageRef = image.CGImage;
+    if (!imageRef) {
+        return nil;
+    }
+    SDWebImageMetadata *metadata = [self new];
+    metadata.pixelSize = CGSizeMake(CGImageGetWidth(imageRef), CGImageGetHeight(imageRef));
+#if SD_UIKIT || SD_WATCH
+    metadata.exifOrientation = [SDWebImageCoderHelper exifOrientationFromImageOrientation:image.imageOrientation];
+#endif
+    metadata.animated = image.images.count > 1;
+    return metadata;
+}
+
+- (void)readImageIOPropertiesFromData:(nonnull NSData *)data {
+    // The incremental source reads the properties of the truncated data without waiting for the rest
+    CGImageSourceRef source = CGImageSourceCreateIncremental(NULL);
+    CGImageSourceUpdateData(source, (__bridge CFDataRef)data, false);
+    CFDictionaryRef properties = CGImageSourceCopyPropertiesAtIndex(source, 0, NULL);
+    CFRelease(source);
+    if (!properties) {
+        return;
+    }
+    NSInteger orientation = 0;
+    CFTypeRef val = CFDictionaryGetValue(properties, kCGImagePropertyOrientation);
+    if (val) CFNumberGetValue(val, kCFNumberNSIntegerType, &orientation);
+    if (orientation >= 1 && orientation <= 8) {
+        self.exifOrientation = orientation;
+    }
+    if (CGSizeEqualToSize(self.pixelSize, CGSizeZero)) {
+        NSInteger width = 0, height = 0;
+        val = CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
+        if (val) CFNumberGetValue(val, kCFNumberNSIntegerType, &width);
+        val = CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
+        if (val) CFNumberGetValue(val, kCFNumberNSIntegerType, &height);
+        if (width > 0 && height > 0) {
+            self.pixelSize = CGSizeMake(width, height);
+        }
+    }
+    CFRelease(properties);
+}
+
+@end
@@ -0,0 +1,93 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+typedef void(^SDWebImagePipelineStageDoneBlock)(void);
+
+/**
+ * The work of one request in a stage. It must call `done` once finished, possibly asynchronously, to free its slot. Calling `done` again has no effect.
+ */
+typedef void(^SDWebImagePipelineStageTask)(SDWebImagePipelineStageDoneBlock _Nonnull done);
+
+/**
+ * One stage of the `SDWebImageManager` pipeline, such as the cache query or the transform, with its own concurrency limit and queue depth metrics.
+ * A task waits in the stage while `maxConcurrentTaskCount` tasks are running, in first-in-first-out order, and runs from its start until it calls `done`.
+ * The metrics are thread-safe and meant to find which stage is the bottleneck.
+ */
+@interface SDWebImagePipelineStage : NSObject
+
+/**
+ * The name of the stage, for logs.
+ */
+@property (copy, nonatomic, readonly, nonnull) NSString *name;
+
+/**
+ * The queue the tasks run on. If nil, a task runs on the thread which added it, or on the thread which freed its slot if it had to wait.
+ * The tasks of a stage on the main queue added from the main thread run at once when a slot is free.
+ */
+@property (strong, nonatomic, readonly, nullable) dispatch_queue_t queue;
+
+/**
+ * The maximum number of tasks running at the same time. 0 means no limit.
+ */
+@property (assign, atomic) NSUInteger maxConcurrentTaskCount;
+
+/**
+ * The number of tasks waiting for a slot.
+ */
+@property (assign, atomic, readonly) NSUInteger pendingTaskCount;
+
+/**
+ * The number of tasks started and not done yet.
+ */
+@property (assign, atomic, readonly) NSUInteger runningTaskCount;
+
+/**
+ * The highest `pendingTaskCount` since the metrics were reset.
+ */
+@property (assign, atomic, readonly) NSUInteger peakPendingTaskCount;
+
+/**
+ * The number of tasks done since the metrics were reset.
+ */
+@property (assign, atomic, readonly) NSUInteger completedTaskCount;
+
+/**
+ * The average time the tasks done waited for a slot, in seconds.
+ */
+@property (assign, atomic, readonly) NSTimeInterval averageWaitTime;
+
+/**
+ * The average time from the start of the tasks done to their `done` call, in seconds.
+ */
+@property (assign, atomic, readonly) NSTimeInterval averageRunTime;
+
+- (nonnull instancetype)initWithName:(nonnull NSString *)name
+                               queue:(nullable dispatch_queue_t)queue
+              maxConcurrentTaskCount:(NSUInteger)maxConcurrentTaskCount NS_DESIGNATED_INITIALIZER;
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/**
+ * Adds a task, which starts at once if a slot is free.
+ */
+- (void)addTask:(nonnull SDWebImagePipelineStageTask)task;
+
+/**
+ * Adds a task of a traced load. Its wait for a slot and its run are recorded as the "<name> wait" and "<name>" phases of the load in `SDWebImageTracer`.
+ */
+- (void)addTask:(nonnull SDWebImagePipelineStageTask)task traceIdentifier:(nullable NSNumber *)traceIdentifier;
+
+/**
+ * Resets the peak, the count and the averages of the tasks done. The pending and running counts are kept.
+ */
+- (void)resetMetrics;
+
+@end
@@ -0,0 +1,178 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImagePipelineStage.h"
+#import "SDWebImageTracer.h"
+
+#define LOCK(lock) dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
+#define UNLOCK(lock) dispatch_semaphore_signal(lock);
+
+@interface SDWebImagePipelineStageEntry : NSObject
+
+@property (copy, nonatomic, nonnull) SDWebImagePipelineStageTask task;
+@property (strong, nonatomic, nullable) NSNumber *traceIdentifier;
+@property (assign, nonatomic) NSTimeInterval addTime; // the system uptime when added
+@property (assign, nonatomic) NSTimeInterval startTime;
+@property (assign, nonatomic, getter = isDone) BOOL done; // guarded by the lock of the stage
+@property (assign, nonatomic, getter = isRunningInline) BOOL runningInline; // guarded by the lock of the stage, the task is running on the thread which started it
+
+@end
+
+@implementation SDWebImagePipelineStageEntry
+@end
+
+@interface SDWebImagePipelineStage ()
+
+@property (strong, nonatomic, nonnull) NSMutableArray<SDWebImagePipelineStageEntry *> *pendingEntries;
+@property (copy, nonatomic, nonnull) NSString *waitPhase; // the name of the traced phase waiting for a slot
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t lock; // a lock to keep the access to the entries and the metrics thread-safe
+@property (assign, atomic, readwrite) NSUInteger runningTaskCount;
+@property (assign, atomic, readwrite) NSUInteger peakPendingTaskCount;
+@property (assign, atomic, readwrite) NSUInteger completedTaskCount;
+@property (assign, nonatomic) NSTimeInterval totalWaitTime;
+@property (assign, nonatomic) NSTimeInterval totalRunTime;
+
+@end
+
+@implementation SDWebImagePipelineStage
+
+- (nonnull instancetype)initWithName:(nonnull NSString *)name
+                               queue:(nullable dispatch_queue_t)queue
+              maxConcurrentTaskCount:(NSUInteger)maxConcurrentTaskCount {
+    if ((self = [super init])) {
+        _name = [name copy];
+        _waitPhase = [name stringByAppendingString:@" wait"];
+        _queue = queue;
+        _maxConcurrentTaskCount = maxConcurrentTaskCount;
+        _pendingEntries = [NSMutableArray new];
+        _lock = dispatch_semaphore_create(1);
+    }
+    return self;
+}
+
+- (void)setMaxConcurrentTaskCount:(NSUInteger)maxConcurrentTaskCount {
+    LOCK(self.lock);
+    _maxConcurrentTaskCount = maxConcurrentTaskCount;
+    UNLOCK(self.lock);
+    [self startPendingTasks];
+}
+
+- (NSUInteger)pendingTaskCount {
+    LOCK(self.lock);
+    NSUInteger pendingTaskCount = self.pendingEntries.count;
+    UNLOCK(self.lock);
+    return pendingTaskCount;
+}
+
+- (NSTimeInterval)averageWaitTime {
+    LOCK(self.lock);
+    NSTimeInterval averageWaitTime = self.completedTaskCount > 0 ? self.totalWaitTime / self.completedTaskCount : 0;
+    UNLOCK(self.lock);
+    return averageWaitTime;
+}
+
+- (NSTimeInterval)averageRunTime {
+    LOCK(self.lock);
+    NSTimeInterval averageRunTime = self.completedTaskCount > 0 ? self.totalRunTime / self.completedTaskCount : 0;
+    UNLOCK(self.lock);
+    return averageRunTime;
+}
+
+- (void)resetMetrics {
+    LOCK(self.lock);
+    self.peakPendingTaskCount = self.pendingEntries.count;
+    self.completedTaskCount = 0;
+    self.totalWaitTime = 0;
+    self.totalRunTime = 0;
+    UNLOCK(self.lock);
+}
+
+- (void)addTask:(nonnull SDWebImagePipelineStageTask)task {
+    [self addTask:task traceIdentifier:nil];
+}
+
+- (void)addTask:(nonnull SDWebImagePipelineStageTask)task traceIdentifier:(nullable NSNumber *)traceIdentifier {
+    SDWebImagePipelineStageEntry *entry = [SDWebImagePipelineStageEntry new];
+    entry.task = task;
+    entry.traceIdentifier = traceIdentifier;
+    SD_TRACE_BEGIN(self.waitPhase, traceIdentifier);
+    entry.addTime = [NSProcessInfo processInfo].systemUptime;
+    LOCK(self.lock);
+    [self.pendingEntries addObject:entry];
+    self.peakPendingTaskCount = MAX(self.peakPendingTaskCount, self.pendingEntries.count);
+    UNLOCK(self.lock);
+    [self startPendingTasks];
+}
+
+// The tasks finishing on the thread which started them do not start the next ones themselves, this loop does, so that a long run of synchronous tasks does not grow the stack
+- (void)startPendingTasks {
+    dispatch_queue_t queue = self.queue;
+    BOOL runsInline = !queue || (queue == dispatch_get_main_queue() && [NSThread isMainThread]);
+    while (YES) {
+        LOCK(self.lock);
+        if (self.pendingEntries.count == 0 || (_maxConcurrentTaskCount > 0 && self.runningTaskCount >= _maxConcurrentTaskCount)) {
+            UNLOCK(self.lock);
+            break;
+        }
+        SDWebImagePipelineStageEntry *entry = self.pendingEntries.firstObject;
+        [self.pendingEntries removeObjectAtIndex:0];
+        entry.startTime = [NSProcessInfo processInfo].systemUptime;
+        entry.runningInline = runsInline;
+        self.runningTaskCount++;
+        UNLOCK(self.lock);
+        [self runEntry:entry inline:runsInline];
+    }
+}
+
+- (void)runEntry:(nonnull SDWebImagePipelineStageEntry *)entry inline:(BOOL)runsInline {
+    SDWebImagePipelineStageDoneBlock done = ^{
+        [self finishEntry:entry];
+    };
+    SDWebImagePipelineStageTask task = entry.task;
+    NSNumber *traceIdentifier = entry.traceIdentifier;
+    NSString *waitPhase = self.waitPhase;
+    NSString *phase = self.name;
+    if (runsInline) {
+        SD_TRACE_END(waitPhase, traceIdentifier);
+        SD_TRACE_BEGIN(phase, traceIdentifier);
+        task(done);
+        LOCK(self.lock);
+        entry.runningInline = NO;
+        UNLOCK(self.lock);
+    } else {
+        dispatch_queue_t queue = self.queue;
+        dispatch_async(queue, ^{
+            SD_TRACE_END(waitPhase, traceIdentifier);
+            SD_TRACE_BEGIN(phase, traceIdentifier);
+            task(done);
+        });
+    }
+}
+
+- (void)finishEntry:(nonnull SDWebImagePipelineStageEntry *)entry {
+    LOCK(self.lock);
+    if (entry.isDone) {
+        UNLOCK(self.lock);
+        return;
+    }
+    entry.done = YES;
+    NSTimeInterval now = [NSProcessInfo processInfo].systemUptime;
+    self.runningTaskCount--;
+    self.completedTaskCount++;
+    self.totalWaitTime += entry.startTime - entry.addTime;
+    self.totalRunTime += now - entry.startTime;
+    // The loop which started the task goes on once it returns
+    BOOL shouldStartPendingTasks = !entry.isRunningInline;
+    UNLOCK(self.lock);
+    SD_TRACE_END(self.name, entry.traceIdentifier);
+    if (shouldStartPendingTasks) {
+        [self startPendingTasks];
+    }
+}
+
+@end
@@ -11,6 +11,7 @@
 @interface SDWebImagePrefetcher ()
 
 @property (strong, nonatomic, nonnull) SDWebImageManager *manager;
+@property (copy, nonatomic, nonnull) NSString *operationGroup; // the group of the loads of this prefetcher, so that cancelling them keeps the other loads of the manager
 @property (strong, atomic, nullable) NSArray<NSURL *> *prefetchURLs; // may be accessed from different queue
 @property (assign, nonatomic) NSUInteger requestedCount;
 @property (assign, nonatomic) NSUInteger skippedCount;
@@ -39,6 +40,7 @@
 - (nonnull instancetype)initWithImageManager:(SDWebImageManager *)manager {
     if ((self = [super init])) {
         _manager = manager;
+        _operationGroup = [NSString stringWithFormat:@"SDWebImagePrefetcher-%p", self];
         _options = SDWebImageLowPriority;
         _prefetcherQueue = dispatch_get_main_queue();
         self.maxConcurrentDownloads = 3;
@@ -92,7 +94,7 @@
             }
             self.progressBlock = nil;
         }
-    }];
+    } context:@{SDWebImageContextOperationGroup : self.operationGroup}];
 }
 
 - (void)reportStatus {
@@ -138,7 +140,7 @@
         self.requestedCount = 0;
         self.finishedCount = 0;
     }
-    [self.manager cancelAll];
+    [self.manager cancelOperationsInGroup:self.operationGroup];
 }
 
 @end
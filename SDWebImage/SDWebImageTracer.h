@@ -0,0 +1,96 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+#import "SDWebImageDefine.h"
+
+/**
+ * Whether the tracing is enabled, read by the trace macros before anything else. Set it with `-[SDWebImageTracer setEnabled:]`.
+ */
+FOUNDATION_EXPORT BOOL SDWebImageTracingEnabled;
+
+/**
+ * Records the timeline of each load, from its enqueue to the set of its image on the main thread, with the thread and the queue of each phase.
+ * The timelines are exported as Chrome Trace Event JSON, to open in chrome://tracing or https://ui.perfetto.dev, and tell whether a slow image waited on the IO queue of the cache, on the session delegate queue or on the main queue.
+ * The tracing is disabled by default, and the trace macros only read `SDWebImageTracingEnabled` then. Define `SD_TRACE_DISABLED` to 1 to compile them out.
+ */
+@interface SDWebImageTracer : NSObject
+
++ (nonnull instancetype)sharedTracer;
+
+/**
+ * Whether the phases are recorded. Defaults to NO.
+ */
+@property (assign, nonatomic, getter = isEnabled) BOOL enabled;
+
+/**
+ * The maximum number of events kept, the oldest are dropped first. Defaults to 100000.
+ */
+@property (assign, atomic) NSUInteger maxEventCount;
+
+/**
+ * Returns a new identifier for the timeline of a load, see `SDWebImageContextTraceIdentifier`.
+ */
+- (nonnull NSNumber *)nextTraceIdentifier;
+
+/**
+ * Records the start of a phase of a load. Does nothing if the identifier is nil.
+ */
+- (void)beginPhase:(nonnull NSString *)phase traceIdentifier:(nullable NSNumber *)traceIdentifier;
+
+/**
+ * Records the end of a phase of a load. Does nothing if the identifier is nil.
+ */
+- (void)endPhase:(nonnull NSString *)phase traceIdentifier:(nullable NSNumber *)traceIdentifier;
+
+/**
+ * Records a phase of a load timed by someone else, such as the DNS lookup in the metrics of a session task. Does nothing if the identifier or one of the dates is nil.
+ */
+- (void)addPhase:(nonnull NSString *)phase startDate:(nullable NSDate *)startDate endDate:(nullable NSDate *)endDate traceIdentifier:(nullable NSNumber *)traceIdentifier;
+
+/**
+ * Records an instant event of a load, such as its enqueue or the response of the server. Does nothing if the identifier is nil.
+ */
+- (void)markEvent:(nonnull NSString *)name traceIdentifier:(nullable NSNumber *)traceIdentifier args:(nullable NSDictionary<NSString *, id> *)args;
+
+/**
+ * Returns the events recorded as Chrome Trace Event JSON.
+ */
+- (nonnull NSData *)chromeTraceData;
+
+/**
+ * Writes the events recorded as Chrome Trace Event JSON to a file.
+ */
+- (BOOL)writeChromeTraceToFile:(nonnull NSString *)path error:(NSError * _Nullable * _Nullable)error;
+
+/**
+ * Removes the events recorded.
+ */
+- (void)removeAllEvents;
+
+@end
+
+/**
+ * Returns the trace identifier of the context, or nil if the tracing is disabled.
+ */
+static inline NSNumber * _Nullable SDTraceIdentifierFromContext(SDWebImageContext * _Nullable context) {
+    return SDWebImageTracingEnabled ? context[SDWebImageContextTraceIdentifier] : nil;
+}
+
+#if SD_TRACE_DISABLED
+#define SD_TRACE_BEGIN(phase, traceIdentifier) do {} while (0)
+#define SD_TRACE_END(phase, traceIdentifier) do {} while (0)
+#define SD_TRACE_MARK(name, traceIdentifier, args) do {} while (0)
+#define SD_TRACE_PHASE(phase, startDate, endDate, traceIdentifier) do {} while (0)
+#else
+#define SD_TRACE_BEGIN(phase, traceIdentifier) do { if (SDWebImageTracingEnabled) { [[SDWebImageTracer sharedTracer] beginPhase:(phase) traceIdentifier:(traceIdentifier)]; } } while (0)
+#define SD_TRACE_END(phase, traceIdentifier) do { if (SDWebImageTracingEnabled) { [[SDWebImageTracer sharedTracer] endPhase:(phase) traceIdentifier:(traceIdentifier)]; } } while (0)
+#define SD_TRACE_MARK(name, traceIdentifier, args) do { if (SDWebImageTracingEnabled) { [[SDWebImageTracer sharedTracer] markEvent:(name) traceIdentifier:(traceIdentifier) args:(args)]; } } while (0)
+#define SD_TRACE_PHASE(phase, startDate, endDate, traceIdentifier) do { if (SDWebImageTracingEnabled) { [[SDWebImageTracer sharedTracer] addPhase:(phase) startDate:(startDate) endDate:(endDate) traceIdentifier:(traceIdentifier)]; } } while (0)
+#endif
@@ -0,0 +1,165 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageTracer.h"
+#import <pthread.h>
+
+#define LOCK(lock) dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
+#define UNLOCK(lock) dispatch_semaphore_signal(lock);
+
+BOOL SDWebImageTracingEnabled = NO;
+
+@interface SDWebImageTraceEvent : NSObject
+
+@property (copy, nonatomic, nonnull) NSString *name;
+@property (copy, nonatomic, nonnull) NSString *eventPhase; // "b", "e" or "n", the nestable async events of the Chrome format
+@property (strong, nonatomic, nonnull) NSNumber *traceIdentifier;
+@property (assign, nonatomic) NSTimeInterval timestamp; // the system uptime
+@property (assign, nonatomic) uint64_t threadID;
+@property (copy, nonatomic, nullable) NSString *queueLabel;
+@property (copy, nonatomic, nullable) NSDictionary<NSString *, id> *args;
+
+@end
+
+@implementation SDWebImageTraceEvent
+@end
+
+@interface SDWebImageTracer ()
+
+@property (strong, nonatomic, nonnull) NSMutableArray<SDWebImageTraceEvent *> *events;
+@property (strong, nonatomic, nonnull) dispatch_semaphore_t lock; // a lock to keep the access to `events` thread-safe
+@property (assign, nonatomic) int64_t lastTraceIdentifier;
+
+@end
+
+@implementation SDWebImageTracer
+
++ (nonnull instancetype)sharedTracer {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        _events = [NSMutableArray new];
+        _lock = dispatch_semaphore_create(1);
+        _maxEventCount = 100000;
+    }
+    return self;
+}
+
+- (BOOL)isEnabled {
+    return SDWebImageTracingEnabled;
+}
+
+- (void)setEnabled:(BOOL)enabled {
+    SDWebImageTracingEnabled = enabled;
+}
+
+- (nonnull NSNumber *)nextTraceIdentifier {
+    LOCK(self.lock);
+    int64_t traceIdentifier = ++self.lastTraceIdentifier;
+    UNLOCK(self.lock);
+    return @(traceIdentifier);
+}
+
+- (void)beginPhase:(nonnull NSString *)phase traceIdentifier:(nullable NSNumber *)traceIdentifier {
+    [self addEventWithName:phase eventPhase:@"b" traceIdentifier:traceIdentifier timestamp:[NSProcessInfo processInfo].systemUptime args:nil];
+}
+
+- (void)endPhase:(nonnull NSString *)phase traceIdentifier:(nullable NSNumber *)traceIdentifier {
+    [self addEventWithName:phase eventPhase:@"e" traceIdentifier:traceIdentifier timestamp:[NSProcessInfo processInfo].systemUptime args:nil];
+}
+
+- (void)addPhase:(nonnull NSString *)phase startDate:(nullable NSDate *)startDate endDate:(nullable NSDate *)endDate traceIdentifier:(nullable NSNumber *)traceIdentifier {
+    if (!startDate || !endDate) {
+        // Such as the DNS lookup and the connection of a reused connection
+        return;
+    }
+    // The dates are wall clock time, the events system uptime
+    NSTimeInterval systemUptime = [NSProcessInfo processInfo].systemUptime;
+    [self addEventWithName:phase eventPhase:@"b" traceIdentifier:traceIdentifier timestamp:systemUptime + startDate.timeIntervalSinceNow args:nil];
+    [self addEventWithName:phase eventPhase:@"e" traceIdentifier:traceIdentifier timestamp:systemUptime + endDate.timeIntervalSinceNow args:nil];
+}
+
+- (void)markEvent:(nonnull NSString *)name traceIdentifier:(nullable NSNumber *)traceIdentifier args:(nullable NSDictionary<NSString *, id> *)args {
+    [self addEventWithName:name eventPhase:@"n" traceIdentifier:traceIdentifier timestamp:[NSProcessInfo processInfo].systemUptime args:args];
+}
+
+- (void)addEventWithName:(nonnull NSString *)name eventPhase:(nonnull NSString *)eventPhase traceIdentifier:(nullable NSNumber *)traceIdentifier timestamp:(NSTimeInterval)timestamp args:(nullable NSDictionary<NSString *, id> *)args {
+    if (!traceIdentifier || !self.isEnabled) {
+        return;
+    }
+    SDWebImageTraceEvent *event = [SDWebImageTraceEvent new];
+    event.name = name;
+    event.eventPhase = eventPhase;
+    event.traceIdentifier = traceIdentifier;
+    event.timestamp = timestamp;
+    uint64_t threadID = 0;
+    pthread_threadid_np(NULL, &threadID);
+    event.threadID = threadID;
+    const char *queueLabel = dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL);
+    if (queueLabel && queueLabel[0] != '\0') {
+        event.queueLabel = @(queueLabel);
+    }
+    event.args = args;
+
+    LOCK(self.lock);
+    [self.events addObject:event];
+    NSUInteger maxEventCount = self.maxEventCount;
+    if (maxEventCount > 0 && self.events.count > maxEventCount) {
+        [self.events removeObjectsInRange:NSMakeRange(0, self.events.count - maxEventCount)];
+    }
+    UNLOCK(self.lock);
+}
+
+- (void)removeAllEvents {
+    LOCK(self.lock);
+    [self.events removeAllObjects];
+    UNLOCK(self.lock);
+}
+
+#pragma mark - Chrome Trace
+
+// See https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+- (nonnull NSData *)chromeTraceData {
+    LOCK(self.lock);
+    NSArray<SDWebImageTraceEvent *> *events = [self.events copy];
+    UNLOCK(self.lock);
+
+    NSNumber *processID = @([NSProcessInfo processInfo].processIdentifier);
+    NSMutableArray<NSDictionary *> *traceEvents = [NSMutableArray arrayWithCapacity:events.count];
+    for (SDWebImageTraceEvent *event in events) {
+        NSMutableDictionary *args = [NSMutableDictionary dictionary];
+        if (event.queueLabel) {
+            args[@"queue"] = event.queueLabel;
+        }
+        [args addEntriesFromDictionary:event.args];
+        [traceEvents addObject:@{@"name" : event.name,
+                                 @"cat" : @"SDWebImage",
+                                 @"ph" : event.eventPhase,
+                                 @"id" : [NSString stringWithFormat:@"0x%llx", event.traceIdentifier.unsignedLongLongValue],
+                                 @"ts" : @((int64_t)(event.timestamp * USEC_PER_SEC)),
+                                 @"pid" : processID,
+                                 @"tid" : @(event.threadID),
+                                 @"args" : args}];
+    }
+    NSDictionary *trace = @{@"traceEvents" : traceEvents,
+                            @"displayTimeUnit" : @"ms"};
+    return [NSJSONSerialization dataWithJSONObject:trace options:0 error:nil] ?: [NSData data];
+}
+
+- (BOOL)writeChromeTraceToFile:(nonnull NSString *)path error:(NSError * _Nullable * _Nullable)error {
+    return [[self chromeTraceData] writeToFile:path options:NSDataWritingAtomic error:error];
+}
+
+@end
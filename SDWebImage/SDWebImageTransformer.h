@@ -0,0 +1,62 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ Return the cache key for an image transformed by a transformer. Each transformer of the same image is cached as a separate entry.
+
+ @param key The unique image cache key, usually it's image absolute URL
+ @param transformerKey The key of the transformer. If it's nil or empty, the key itself is returned
+ @return The cache key for the transformed image
+ */
+FOUNDATION_EXPORT NSString * _Nullable SDTransformedKeyForKey(NSString * _Nullable key, NSString * _Nullable transformerKey);
+
+/**
+ * Transforms the loaded images, such as resizing or rounding them, set with `SDWebImageContextImageTransformer`.
+ * The transforms run on the transform stage of the manager, see `-[SDWebImageManager transformStage]`.
+ */
+@protocol SDWebImageTransformer <NSObject>
+
+/**
+ * The key of the transform, used to derive the cache key of the transformed images. It must be stable across launches, and different for transformers giving different images, for example including their parameters.
+ */
+@property (copy, nonatomic, readonly, nonnull) NSString *transformerKey;
+
+/**
+ * Transforms the image. This is called on a background queue.
+ *
+ * @param image The image to transform
+ * @param key   The cache key of the original image
+ *
+ * @return The transformed image, or nil if it can not be transformed
+ */
+- (nullable UIImage *)transformedImageWithImage:(nonnull UIImage *)image forKey:(nonnull NSString *)key;
+
+@end
+
+/**
+ * A transformer running a block.
+ */
+@interface SDWebImageBlockTransformer : NSObject <SDWebImageTransformer>
+
++ (nonnull instancetype)transformerWithKey:(nonnull NSString *)transformerKey block:(nonnull UIImage * _Nullable (^)(UIImage * _Nonnull image, NSString * _Nonnull key))block;
+
+@end
+
+/**
+ * A transformer running other transformers in order. Its key joins their keys.
+ */
+@interface SDWebImagePipelineTransformer : NSObject <SDWebImageTransformer>
+
+@property (copy, nonatomic, readonly, nonnull) NSArray<id<SDWebImageTransformer>> *transformers;
+
++ (nonnull instancetype)transformerWithTransformers:(nonnull NSArray<id<SDWebImageTransformer>> *)transformers;
+
+@end
@@ -0,0 +1,67 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageTransformer.h"
+
+NSString * SDTransformedKeyForKey(NSString * _Nullable key, NSString * _Nullable transformerKey) {
+    if (!key || transformerKey.length == 0) {
+        return key;
+    }
+    return [key stringByAppendingFormat:@"#SDTransformed(%@)", transformerKey];
+}
+
+@interface SDWebImageBlockTransformer ()
+
+@property (copy, nonatomic, readwrite, nonnull) NSString *transformerKey;
+@property (copy, nonatomic, nonnull) UIImage * _Nullable (^block)(UIImage * _Nonnull image, NSString * _Nonnull key);
+
+@end
+
+@implementation SDWebImageBlockTransformer
+
++ (nonnull instancetype)transformerWithKey:(nonnull NSString *)transformerKey block:(nonnull UIImage * _Nullable (^)(UIImage * _Nonnull image, NSString * _Nonnull key))block {
+    SDWebImageBlockTransformer *transformer = [self new];
+    transformer.transformerKey = transformerKey;
+    transformer.block = block;
+    return transformer;
+}
+
+- (nullable UIImage *)transformedImageWithImage:(nonnull UIImage *)image forKey:(nonnull NSString *)key {
+    return self.block(image, key);
+}
+
+@end
+
+@interface SDWebImagePipelineTransformer ()
+
+@property (copy, nonatomic, readwrite, nonnull) NSString *transformerKey;
+@property (copy, nonatomic, readwrite, nonnull) NSArray<id<SDWebImageTransformer>> *transformers;
+
+@end
+
+@implementation SDWebImagePipelineTransformer
+
++ (nonnull instancetype)transformerWithTransformers:(nonnull NSArray<id<SDWebImageTransformer>> *)transformers {
+    SDWebImagePipelineTransformer *transformer = [self new];
+    transformer.transformers = transformers;
+    transformer.transformerKey = [[transformers valueForKey:NSStringFromSelector(@selector(transformerKey))] componentsJoinedByString:@"-"];
+    return transformer;
+}
+
+- (nullable UIImage *)transformedImageWithImage:(nonnull UIImage *)image forKey:(nonnull NSString *)key {
+    UIImage *transformedImage = image;
+    for (id<SDWebImageTransformer> transformer in self.transformers) {
+        transformedImage = [transformer transformedImageWithImage:transformedImage forKey:key];
+        if (!transformedImage) {
+            break;
+        }
+    }
+    return transformedImage;
+}
+
+@end
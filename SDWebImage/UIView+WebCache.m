@@ -62,6 +62,10 @@ static char imageURLKey;
     [self sd_cancelImageLoadOperationWithKey:validOperationKey];
     self.sd_imageURL = url;
     
+    if (url && [self sd_setImageFromMemoryCacheWithURL:url options:options setImageBlock:setImageBlock completed:completedBlock context:context]) {
+        return;
+    }
+    
     if (!(options & SDWebImageDelayPlaceholder)) {
         if ([context valueForKey:SDWebImageContextSetImageGroup]) {
             dispatch_group_t group = [context valueForKey:SDWebImageContextSetImageGroup];
@@ -185,6 +189,35 @@ static char imageURLKey;
     }
 }
 
+// A memory hit on the main thread is set at once, neither the placeholder nor the completion waits for a dispatch
+- (BOOL)sd_setImageFromMemoryCacheWithURL:(nonnull NSURL *)url
+                                  options:(SDWebImageOptions)options
+                            setImageBlock:(nullable SDSetImageBlock)setImageBlock
+                                completed:(nullable SDExternalCompletionBlock)completedBlock
+                                  context:(nullable SDWebImageContext *)context {
+    if (![NSThread isMainThread] || [context valueForKey:SDWebImageContextSetImageGroup]) {
+        return NO;
+    }
+    SDWebImageManager *manager = [context valueForKey:SDWebImageContextCustomManager] ?: [SDWebImageManager sharedManager];
+    UIImage *image = [manager imageFromMemoryCacheForURL:url options:options context:context];
+    if (!image) {
+        return NO;
+    }
+    self.sd_imageProgress.totalUnitCount = SDWebImageProgressUnitCountUnknown;
+    self.sd_imageProgress.completedUnitCount = SDWebImageProgressUnitCountUnknown;
+    // an indicator of the previous load may still run
+    [self sd_stopImageIndicator];
+    if (!(options & SDWebImageAvoidAutoSetImage)) {
+        SDWebImageTransition *transition = (options & SDWebImageForceTransition) ? self.sd_imageTransition : nil;
+        [self sd_setImage:image imageData:nil basedOnClassOrViaCustomSetImageBlock:setImageBlock transition:transition cacheType:SDImageCacheTypeMemory imageURL:url];
+        [self sd_setNeedsLayout];
+    }
+    if (completedBlock) {
+        completedBlock(image, nil, SDImageCacheTypeMemory, url);
+    }
+    return YES;
+}
+
 - (void)sd_cancelCurrentImageLoad {
     [self sd_cancelImageLoadOperationWithKey:NSStringFromClass([self class])];
 }
@@ -160,6 +160,27 @@ static void * SDCategoriesTestsContext = &SDCategoriesTestsContext;
     }];
 }
 
+- (void)testUIImageViewSetImageFromMemoryCacheSynchronously {
+    UIImageView *imageView = [[UIImageView alloc] init];
+    NSURL *imageURL = [NSURL URLWithString:@"http://via.placeholder.com/MemoryHit.png"];
+    NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:imageURL];
+    NSString *testImagePath = [[NSBundle bundleForClass:[self class]] pathForResource:@"TestImage" ofType:@"png"];
+    UIImage *cachedImage = [[UIImage alloc] initWithContentsOfFile:testImagePath];
+    [[SDImageCache sharedImageCache] storeImage:cachedImage forKey:key toDisk:NO completion:nil];
+    
+    __block BOOL completed = NO;
+    [imageView sd_setImageWithURL:imageURL
+                        completed:^(UIImage * _Nullable image, NSError * _Nullable error, SDImageCacheType cacheType, NSURL * _Nullable url) {
+                            expect(image).to.equal(cachedImage);
+                            expect(cacheType).to.equal(SDImageCacheTypeMemory);
+                            completed = YES;
+                        }];
+    // set in the same run loop turn
+    expect(completed).to.beTruthy();
+    expect(imageView.image).to.equal(cachedImage);
+    [[SDImageCache sharedImageCache] removeImageForKey:key fromDisk:NO withCompletion:nil];
+}
+
 - (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
 {
     if (context == SDCategoriesTestsContext) {
@@ -9,6 +9,8 @@
 #import "SDTestCase.h"
 #import <SDWebImage/SDImageCache.h>
 #import <SDWebImage/SDWebImageCodersManager.h>
+#import <SDWebImage/SDWebImageCoderHelper.h>
+#import <SDWebImage/SDWebImageTransformer.h>
 #import "SDWebImageTestDecoder.h"
 #import "SDMockFileManager.h"
 
@@ -338,6 +340,132 @@ NSString *kImageTestKey = @"TestImageKey.jpg";
     XCTAssertNil(error);
 }
 
+- (void)test43ThumbnailDerivedFromCachedImage {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Thumbnail is derived from the cached image"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TestThumbnail"];
+    NSString *key = @"TestThumbnailImageKey.jpg";
+    CGSize thumbnailPixelSize = CGSizeMake(50, 50);
+    SDWebImageContext *context = @{SDWebImageContextImageThumbnailPixelSize : [NSValue valueWithBytes:&thumbnailPixelSize objCType:@encode(CGSize)]};
+    
+    [cache storeImage:[self imageForTesting] imageData:nil forKey:key toMemory:NO toDisk:YES completion:^(NSError * _Nullable error) {
+        expect([cache imageFromMemoryCacheForKey:key]).to.beNil();
+        [cache queryCacheOperationForKey:key options:0 done:^(UIImage * _Nullable image, NSData * _Nullable data, SDImageCacheType cacheType) {
+            expect(image).toNot.beNil();
+            expect(image.size.width).to.beLessThanOrEqualTo(thumbnailPixelSize.width);
+            expect(image.size.height).to.beLessThanOrEqualTo(thumbnailPixelSize.height);
+            expect(cacheType).to.equal(SDImageCacheTypeDisk);
+            // The thumbnail is kept in memory under its own key, the full size image is not
+            expect([cache imageFromMemoryCacheForKey:key thumbnailPixelSize:thumbnailPixelSize]).to.equal(image);
+            expect([cache imageFromMemoryCacheForKey:SDThumbnailedKeyForKey(key, thumbnailPixelSize)]).to.equal(image);
+            expect([cache imageFromMemoryCacheForKey:key]).to.beNil();
+            
+            [cache removeImageForKey:key withCompletion:^{
+                expect([cache imageFromMemoryCacheForKey:SDThumbnailedKeyForKey(key, thumbnailPixelSize)]).to.beNil();
+                [expectation fulfill];
+            }];
+        } context:context];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test44SmallerThumbnailDerivedFromLargerThumbnailInMemory {
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TestThumbnail"];
+    NSString *key = @"TestLargerThumbnailImageKey.jpg";
+    CGSize largerPixelSize = CGSizeMake(100, 100);
+    CGSize smallerPixelSize = CGSizeMake(20, 20);
+    UIImage *largerImage = [SDWebImageCoderHelper thumbnailImageWithImage:[self imageForTesting] pixelSize:largerPixelSize];
+    [cache storeThumbnailImage:largerImage forKey:key thumbnailPixelSize:largerPixelSize toDisk:NO completion:nil];
+    
+    UIImage *smallerImage = [cache imageFromMemoryCacheForKey:key thumbnailPixelSize:smallerPixelSize];
+    expect(smallerImage).toNot.beNil();
+    expect(smallerImage.size.width).to.beLessThanOrEqualTo(smallerPixelSize.width);
+    expect(smallerImage.size.height).to.beLessThanOrEqualTo(smallerPixelSize.height);
+    expect([cache imageFromMemoryCacheForKey:key]).to.beNil();
+    [cache removeImageForKey:key fromDisk:NO withCompletion:nil];
+}
+
+- (void)test45TruncatedDiskCacheFileIsRemovedAsMiss {
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TestIntegrity"];
+    NSData *imageData = [NSData dataWithContentsOfFile:[self testImagePath]];
+    NSString *key = @"TestTruncatedImageKey.jpg";
+    NSError *error = nil;
+    expect([cache storeImageDataToDisk:imageData forKey:key error:&error]).to.beTruthy();
+    expect(error).to.beNil();
+    
+    // Truncate in place, like a write interrupted by a crash, the checksum attribute is kept
+    NSString *cachePath = [cache defaultCachePathForKey:key];
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:cachePath];
+    [fileHandle truncateFileAtOffset:imageData.length / 2];
+    [fileHandle closeFile];
+    
+    expect([cache imageFromDiskCacheForKey:key]).to.beNil();
+    expect([[NSFileManager defaultManager] fileExistsAtPath:cachePath]).to.beFalsy();
+}
+
+- (void)test46UndecodableIntactDiskCacheFileIsRemovedAsMiss {
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TestIntegrity"];
+    cache.config.diskCacheWritingOptions = NSDataWritingWithoutOverwriting;
+    NSData *data = [@"Not an image" dataUsingEncoding:NSUTF8StringEncoding];
+    NSString *key = @"TestUndecodableImageKey.jpg";
+    NSError *error = nil;
+    expect([cache storeImageDataToDisk:data forKey:key error:&error]).to.beTruthy();
+    expect(error).to.beNil();
+    
+    // The data matches its checksum but can not be decoded, a file kept in place could never be replaced
+    NSString *cachePath = [cache defaultCachePathForKey:key];
+    expect([cache imageFromDiskCacheForKey:key]).to.beNil();
+    expect([[NSFileManager defaultManager] fileExistsAtPath:cachePath]).to.beFalsy();
+    expect([cache storeImageDataToDisk:[NSData dataWithContentsOfFile:[self testImagePath]] forKey:key error:&error]).to.beTruthy();
+    expect([cache imageFromDiskCacheForKey:key]).toNot.beNil();
+    [cache removeImageForKey:key withCompletion:nil];
+}
+
+- (void)test47DiskThumbnailIsRemovedWithImageAfterRelaunch {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Thumbnail on disk is removed with the image"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TestThumbnail"];
+    NSString *key = @"TestRelaunchThumbnailImageKey.jpg";
+    CGSize thumbnailPixelSize = CGSizeMake(50, 50);
+    UIImage *thumbnailImage = [cache thumbnailImageForKey:key image:[self imageForTesting] thumbnailPixelSize:thumbnailPixelSize];
+    NSString *thumbnailPath = [cache defaultCachePathForKey:SDThumbnailedKeyForKey(key, thumbnailPixelSize)];
+    
+    [cache storeThumbnailImage:thumbnailImage forKey:key thumbnailPixelSize:thumbnailPixelSize toDisk:YES completion:^(NSError * _Nullable error) {
+        expect([[NSFileManager defaultManager] fileExistsAtPath:thumbnailPath]).to.beTruthy();
+        // A new cache on the same directory has no thumbnail in memory, like after a relaunch
+        SDImageCache *relaunchedCache = [[SDImageCache alloc] initWithNamespace:@"TestThumbnail"];
+        [relaunchedCache removeImageForKey:key withCompletion:^{
+            expect([[NSFileManager defaultManager] fileExistsAtPath:thumbnailPath]).to.beFalsy();
+            [expectation fulfill];
+        }];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test48DerivedImageIsRemovedWithImageAfterRelaunch {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Derived image is removed with the image"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TestDerived"];
+    NSString *key = @"TestDerivedImageKey.jpg";
+    NSString *derivedKey = SDTransformedKeyForKey(key, @"TestTransformer");
+    NSString *derivedPath = [cache defaultCachePathForKey:derivedKey];
+    
+    [cache addDerivedKey:derivedKey forKey:key toDisk:YES];
+    [cache storeImage:[self imageForTesting] forKey:derivedKey toDisk:YES completion:^(NSError * _Nullable error) {
+        expect([[NSFileManager defaultManager] fileExistsAtPath:derivedPath]).to.beTruthy();
+        // The derived image in memory goes with the image too
+        [cache removeImageForKey:key fromDisk:NO withCompletion:nil];
+        expect([cache imageFromMemoryCacheForKey:derivedKey]).to.beNil();
+        // A new cache on the same directory knows the derived keys from disk only, like after a relaunch
+        SDImageCache *relaunchedCache = [[SDImageCache alloc] initWithNamespace:@"TestDerived"];
+        [relaunchedCache removeImageForKey:key withCompletion:^{
+            expect([[NSFileManager defaultManager] fileExistsAtPath:derivedPath]).to.beFalsy();
+            [expectation fulfill];
+        }];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
 #pragma mark Helper methods
 
 - (UIImage *)imageForTesting{
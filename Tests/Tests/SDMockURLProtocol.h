@@ -0,0 +1,34 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+// A canned response of `SDMockURLProtocol`
+@interface SDMockURLResponse : NSObject
+
+@property (nonatomic, assign) NSInteger statusCode;
+@property (nonatomic, copy, nullable) NSDictionary<NSString *, NSString *> *headerFields;
+@property (nonatomic, copy, nullable) NSData *body;
+@property (nonatomic, assign) NSUInteger failAfterLength; // if not 0, the connection is lost after that many bytes of the body
+
++ (nonnull instancetype)responseWithStatusCode:(NSInteger)statusCode headerFields:(nullable NSDictionary<NSString *, NSString *> *)headerFields body:(nullable NSData *)body;
+
+@end
+
+typedef SDMockURLResponse * _Nullable (^SDMockURLResponseHandler)(NSURLRequest * _Nonnull request);
+
+// This is a mock class to answer the requests of a session configured with it without network. Add it to the `protocolClasses` of the session configuration
+@interface SDMockURLProtocol : NSURLProtocol
+
+@property (class, nonatomic, copy, nullable) SDMockURLResponseHandler responseHandler; // used to specify the response of each request. If it returns nil, the request fails
+@property (class, nonatomic, copy, readonly, nonnull) NSArray<NSURLRequest *> *receivedRequests; // the requests received since the last reset, in order
+
++ (nonnull NSURLSessionConfiguration *)sessionConfiguration;
++ (void)reset;
+
+@end
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDMockURLProtocol.h"
+
+// The body is sent in chunks of this size, so that the client sees several progress updates
+static const NSUInteger kMockChunkSize = 4 * 1024;
+
+static SDMockURLResponseHandler gResponseHandler;
+static NSMutableArray<NSURLRequest *> *gReceivedRequests;
+
+@implementation SDMockURLResponse
+
++ (nonnull instancetype)responseWithStatusCode:(NSInteger)statusCode headerFields:(nullable NSDictionary<NSString *, NSString *> *)headerFields body:(nullable NSData *)body {
+    SDMockURLResponse *response = [self new];
+    response.statusCode = statusCode;
+    response.headerFields = headerFields;
+    response.body = body;
+    return response;
+}
+
+@end
+
+@implementation SDMockURLProtocol
+
++ (SDMockURLResponseHandler)responseHandler {
+    @synchronized (self) {
+        return gResponseHandler;
+    }
+}
+
++ (void)setResponseHandler:(SDMockURLResponseHandler)responseHandler {
+    @synchronized (self) {
+        gResponseHandler = [responseHandler copy];
+    }
+}
+
++ (NSArray<NSURLRequest *> *)receivedRequests {
+    @synchronized (self) {
+        return [gReceivedRequests copy] ?: @[];
+    }
+}
+
++ (nonnull NSURLSessionConfiguration *)sessionConfiguration {
+    NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+    configuration.protocolClasses = @[self];
+    configuration.URLCache = nil;
+    return configuration;
+}
+
++ (void)reset {
+    @synchronized (self) {
+        gResponseHandler = nil;
+        gReceivedRequests = nil;
+    }
+}
+
++ (BOOL)canInitWithRequest:(NSURLRequest *)request {
+    return YES;
+}
+
++ (NSURLRequest *)canonicalRequestForRequest:(NSURLRequest *)request {
+    return request;
+}
+
+- (void)startLoading {
+    SDMockURLResponseHandler responseHandler;
+    @synchronized ([self class]) {
+        if (!gReceivedRequests) {
+            gReceivedRequests = [NSMutableArray array];
+        }
+        [gReceivedRequests addObject:self.request];
+        responseHandler = gResponseHandler;
+    }
+    SDMockURLResponse *mockResponse = responseHandler ? responseHandler(self.request) : nil;
+    if (!mockResponse) {
+        [self.client URLProtocol:self didFailWithError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotConnectToHost userInfo:nil]];
+        return;
+    }
+    NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:self.request.URL statusCode:mockResponse.statusCode HTTPVersion:@"HTTP/1.1" headerFields:mockResponse.headerFields];
+    [self.client URLProtocol:self didReceiveResponse:response cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+    
+    NSData *body = mockResponse.body;
+    NSUInteger length = mockResponse.failAfterLength > 0 ? MIN(mockResponse.failAfterLength, body.length) : body.length;
+    for (NSUInteger offset = 0; offset < length; offset += kMockChunkSize) {
+        [self.client URLProtocol:self didLoadData:[body subdataWithRange:NSMakeRange(offset, MIN(kMockChunkSize, length - offset))]];
+    }
+    if (mockResponse.failAfterLength > 0) {
+        [self.client URLProtocol:self didFailWithError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNetworkConnectionLost userInfo:nil]];
+    } else {
+        [self.client URLProtocolDidFinishLoading:self];
+    }
+}
+
+- (void)stopLoading {
+}
+
+@end
@@ -12,6 +12,7 @@
 #import <SDWebImage/SDWebImageDownloaderOperation.h>
 #import <SDWebImage/SDWebImageCodersManager.h>
 #import "SDWebImageTestDecoder.h"
+#import "SDMockURLProtocol.h"
 
 /**
  *  Category for SDWebImageDownloader so we can access the operationClass
@@ -57,6 +58,25 @@
 
 
 
+/**
+ *  A metrics delegate forwarding the metrics to a block
+ */
+@interface SDWebImageDownloaderMetricsRecorder : NSObject<SDWebImageDownloaderMetricsDelegate>
+
+@property (nonatomic, copy, nullable) void (^metricsBlock)(SDWebImageDownloaderMetrics * _Nonnull metrics);
+
+@end
+
+@implementation SDWebImageDownloaderMetricsRecorder
+
+- (void)imageDownloader:(SDWebImageDownloader *)downloader didCollectMetrics:(SDWebImageDownloaderMetrics *)metrics {
+    if (self.metricsBlock) {
+        self.metricsBlock(metrics);
+    }
+}
+
+@end
+
 @interface SDWebImageDownloaderTests : SDTestCase
 
 @end
@@ -386,4 +406,444 @@
     [downloader invalidateSessionAndCancel:YES];
 }
 
+- (void)test23ThatProgressiveDecodeIsThrottledByMinimumBytes {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Progressive decode throttled"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    // No partial image can be decoded before the whole data is received
+    downloader.minimumProgressiveDecodeBytes = NSUIntegerMax;
+    __block NSUInteger progressiveImageCount = 0;
+    NSURL *imageURL = [NSURL URLWithString:kTestJpegURL];
+    [downloader downloadImageWithURL:imageURL options:SDWebImageDownloaderProgressiveDownload progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        if (image && data && !error && finished) {
+            // Only the complete data may be decoded progressively, before the final decode
+            expect(progressiveImageCount).to.beLessThanOrEqualTo(1);
+            [expectation fulfill];
+        } else if (finished) {
+            XCTFail(@"Something went wrong");
+        } else {
+            progressiveImageCount++;
+        }
+    }];
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test24ThatHostPatternLimitsPreferExactThenLongestWildcard {
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    downloader.maxConcurrentDownloadsPerHost = 4;
+    [downloader setMaxConcurrentDownloads:2 forHostPattern:@"*.example.com"];
+    [downloader setMaxConcurrentDownloads:3 forHostPattern:@"*.img.example.com"];
+    [downloader setMaxConcurrentDownloads:1 forHostPattern:@"a.img.example.com"];
+    expect([downloader maxConcurrentDownloadsForHost:@"example.com"]).to.equal(2);
+    expect([downloader maxConcurrentDownloadsForHost:@"cdn.example.com"]).to.equal(2);
+    expect([downloader maxConcurrentDownloadsForHost:@"b.img.example.com"]).to.equal(3);
+    expect([downloader maxConcurrentDownloadsForHost:@"A.img.example.com"]).to.equal(1);
+    expect([downloader maxConcurrentDownloadsForHost:@"badexample.com"]).to.equal(4);
+    [downloader setMaxConcurrentDownloads:0 forHostPattern:@"a.img.example.com"];
+    expect([downloader maxConcurrentDownloadsForHost:@"a.img.example.com"]).to.equal(3);
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test25ThatConcurrencyControllerIncreasesAdditivelyAndDecreasesMultiplicatively {
+    SDWebImageDownloaderConcurrencyController *controller = [[SDWebImageDownloaderConcurrencyController alloc] initWithInitialLimit:4];
+    controller.sampleWindow = 2;
+    // Steady throughput and latency increase the limit by one per window
+    for (NSUInteger i = 0; i < 4; i++) {
+        [controller addSampleWithTimeToFirstByte:0.05 duration:0.2 receivedBytes:100000 error:nil];
+    }
+    expect(controller.currentLimit).to.equal(6);
+    expect(controller.lastChangeReason).to.equal(SDWebImageDownloaderConcurrencyChangeReasonThroughput);
+    // Injected latency halves it
+    [controller addSampleWithTimeToFirstByte:0.5 duration:0.7 receivedBytes:100000 error:nil];
+    [controller addSampleWithTimeToFirstByte:0.5 duration:0.7 receivedBytes:100000 error:nil];
+    expect(controller.currentLimit).to.equal(3);
+    expect(controller.lastChangeReason).to.equal(SDWebImageDownloaderConcurrencyChangeReasonLatency);
+    // So do errors, down to the minimum; cancellations are ignored
+    NSError *timeout = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil];
+    NSError *cancelled = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCancelled userInfo:nil];
+    for (NSUInteger i = 0; i < 6; i++) {
+        [controller addSampleWithTimeToFirstByte:-1 duration:1 receivedBytes:0 error:timeout];
+        [controller addSampleWithTimeToFirstByte:-1 duration:1 receivedBytes:0 error:cancelled];
+    }
+    expect(controller.currentLimit).to.equal(1);
+    expect(controller.lastChangeReason).to.equal(SDWebImageDownloaderConcurrencyChangeReasonErrorRate);
+    
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    downloader.concurrencyController = controller;
+    expect(downloader.maxConcurrentDownloads).to.equal(1);
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test26ThatRaisingThePriorityOfAPendingDownloadStartsItFirst {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Reprioritized download starts first"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    downloader.maxConcurrentDownloads = 1;
+    NSMutableArray<NSString *> *finishedSizes = [NSMutableArray array];
+    NSArray<NSString *> *sizes = @[@"60x60", @"70x70", @"80x80"];
+    NSMutableArray<SDWebImageDownloadToken *> *tokens = [NSMutableArray array];
+    for (NSString *size in sizes) {
+        NSURL *imageURL = [NSURL URLWithString:[NSString stringWithFormat:@"http://via.placeholder.com/%@.jpg", size]];
+        SDWebImageDownloadToken *token = [downloader downloadImageWithURL:imageURL options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+            @synchronized (finishedSizes) {
+                [finishedSizes addObject:size];
+                if (finishedSizes.count == sizes.count) {
+                    // The first one was admitted at once, the last one overtook the second one
+                    expect(finishedSizes).to.equal((@[@"60x60", @"80x80", @"70x70"]));
+                    [expectation fulfill];
+                }
+            }
+        }];
+        [tokens addObject:token];
+    }
+    [tokens.lastObject setPriority:NSOperationQueuePriorityHigh];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test27ThatDownloadFailedMidwayIsResumedWithARangeRequest {
+    NSData *body = [NSData dataWithContentsOfFile:[[NSBundle bundleForClass:[self class]] pathForResource:@"TestImageLarge" ofType:@"jpg"]];
+    // Large enough for the partial body to be kept
+    NSUInteger partialLength = body.length / 2;
+    NSArray<NSURLRequest *> *(^requestsOfURL)(NSURL *) = ^NSArray<NSURLRequest *> *(NSURL *url) {
+        return [SDMockURLProtocol.receivedRequests filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"URL == %@", url]];
+    };
+    SDMockURLProtocol.responseHandler = ^SDMockURLResponse *(NSURLRequest *request) {
+        NSMutableDictionary<NSString *, NSString *> *headerFields = [@{@"Content-Type" : @"image/jpeg", @"Accept-Ranges" : @"bytes", @"ETag" : @"\"v1\""} mutableCopy];
+        if ([request valueForHTTPHeaderField:@"Range"]) {
+            if ([request.URL.lastPathComponent isEqualToString:@"Changed.jpg"]) {
+                // The image has changed since, the server ignores the range and sends the whole new body
+                headerFields[@"ETag"] = @"\"v2\"";
+            } else {
+                // A server which does not honor the start of the range for WrongRange.jpg
+                NSUInteger rangeStart = [request.URL.lastPathComponent isEqualToString:@"WrongRange.jpg"] ? partialLength / 2 : partialLength;
+                headerFields[@"Content-Range"] = [NSString stringWithFormat:@"bytes %lu-%lu/%lu", (unsigned long)rangeStart, (unsigned long)body.length - 1, (unsigned long)body.length];
+                headerFields[@"Content-Length"] = @(body.length - rangeStart).stringValue;
+                return [SDMockURLResponse responseWithStatusCode:206 headerFields:headerFields body:[body subdataWithRange:NSMakeRange(rangeStart, body.length - rangeStart)]];
+            }
+        }
+        headerFields[@"Content-Length"] = @(body.length).stringValue;
+        SDMockURLResponse *response = [SDMockURLResponse responseWithStatusCode:200 headerFields:headerFields body:body];
+        if (requestsOfURL(request.URL).count == 1) {
+            // The connection of the first request is lost midway
+            response.failAfterLength = partialLength;
+        }
+        return response;
+    };
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] initWithSessionConfiguration:[SDMockURLProtocol sessionConfiguration]];
+    void (^download)(NSURL *, BOOL) = ^(NSURL *url, BOOL shouldSucceed) {
+        XCTestExpectation *expectation = [self expectationWithDescription:[NSString stringWithFormat:@"Download %@", url]];
+        [downloader downloadImageWithURL:url options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+            if (shouldSucceed) {
+                expect(error).to.beNil();
+                expect(image).toNot.beNil();
+                expect(data).to.equal(body);
+            } else {
+                expect(error).toNot.beNil();
+            }
+            [expectation fulfill];
+        }];
+        [self waitForExpectationsWithCommonTimeout];
+    };
+    
+    // The second request asks the rest of the body, which is joined to the stored one
+    NSURL *resumedURL = [NSURL URLWithString:@"http://sdwebimage.mock/Resumed.jpg"];
+    download(resumedURL, NO);
+    download(resumedURL, YES);
+    NSArray<NSURLRequest *> *requests = requestsOfURL(resumedURL);
+    expect(requests.count).to.equal(2);
+    expect([requests[0] valueForHTTPHeaderField:@"Range"]).to.beNil();
+    expect([requests[1] valueForHTTPHeaderField:@"Range"]).to.equal([NSString stringWithFormat:@"bytes=%lu-", (unsigned long)partialLength]);
+    expect([requests[1] valueForHTTPHeaderField:@"If-Range"]).to.equal(@"\"v1\"");
+    
+    // A changed validator gets the whole body, and the stored one is discarded
+    NSURL *changedURL = [NSURL URLWithString:@"http://sdwebimage.mock/Changed.jpg"];
+    download(changedURL, NO);
+    download(changedURL, YES);
+    download(changedURL, YES);
+    requests = requestsOfURL(changedURL);
+    expect(requests.count).to.equal(3);
+    expect([requests[1] valueForHTTPHeaderField:@"If-Range"]).to.equal(@"\"v1\"");
+    expect([requests[2] valueForHTTPHeaderField:@"Range"]).to.beNil();
+    
+    // Another range than the one asked restarts the request without range
+    NSURL *wrongRangeURL = [NSURL URLWithString:@"http://sdwebimage.mock/WrongRange.jpg"];
+    download(wrongRangeURL, NO);
+    download(wrongRangeURL, YES);
+    requests = requestsOfURL(wrongRangeURL);
+    expect(requests.count).to.equal(3);
+    expect([requests[1] valueForHTTPHeaderField:@"Range"]).toNot.beNil();
+    expect([requests[2] valueForHTTPHeaderField:@"Range"]).to.beNil();
+    expect([requests[2] valueForHTTPHeaderField:@"If-Range"]).to.beNil();
+    
+    [downloader invalidateSessionAndCancel:YES];
+    [SDMockURLProtocol reset];
+}
+
+- (void)test28ThatMetricsDelegateReceivesTheTimingsOfEachPhase {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Metrics are delivered after the image"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    SDWebImageDownloaderMetricsRecorder *recorder = [SDWebImageDownloaderMetricsRecorder new];
+    downloader.metricsDelegate = recorder;
+    NSURL *imageURL = [NSURL URLWithString:kTestJpegURL];
+    __block BOOL delivered = NO;
+    recorder.metricsBlock = ^(SDWebImageDownloaderMetrics * _Nonnull metrics) {
+        expect(delivered).to.beTruthy();
+        expect(metrics.URL).to.equal(imageURL);
+        expect(metrics.queueDuration).to.beGreaterThanOrEqualTo(0);
+        expect(metrics.decodeDuration).to.beGreaterThanOrEqualTo(0);
+        expect(metrics.deliveryDuration).to.beGreaterThanOrEqualTo(0);
+        expect(metrics.totalDuration).to.beGreaterThanOrEqualTo(metrics.queueDuration + metrics.decodeDuration);
+        [expectation fulfill];
+    };
+    [downloader downloadImageWithURL:imageURL options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        delivered = YES;
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test29ThatDownloadsWithTheSameCoalescingKeyShareOneOperation {
+    XCTestExpectation *expectation1 = [self expectationWithDescription:@"First waiter gets the image"];
+    XCTestExpectation *expectation2 = [self expectationWithDescription:@"Second waiter gets the image"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    downloader.coalescingKeyFilter = ^NSString * _Nullable(NSURL * _Nonnull url) {
+        NSURLComponents *components = [NSURLComponents componentsWithURL:url resolvingAgainstBaseURL:NO];
+        components.query = nil;
+        return components.URL.absoluteString;
+    };
+    NSURL *imageURL1 = [NSURL URLWithString:[kTestJpegURL stringByAppendingString:@"?tracking=1"]];
+    NSURL *imageURL2 = [NSURL URLWithString:[kTestJpegURL stringByAppendingString:@"?tracking=2"]];
+    
+    [downloader downloadImageWithURL:imageURL1 options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        [expectation1 fulfill];
+    }];
+    [downloader downloadImageWithURL:imageURL2 options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        [expectation2 fulfill];
+    }];
+    expect(downloader.currentDownloadCount).to.equal(1);
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test30ThatALargeBodyIsStreamedToAFileInTheGivenDirectory {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Streamed download completes"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    downloader.diskStreamingThreshold = 1;
+    NSString *downloadDirectory = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSUUID UUID].UUIDString];
+    __block SDWebImageDownloadToken *token;
+    token = [downloader downloadImageWithURL:[NSURL URLWithString:kTestJpegURL] options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        NSString *downloadFilePath = token.downloadFilePath;
+        expect(downloadFilePath.stringByDeletingLastPathComponent).to.equal(downloadDirectory);
+        expect([NSData dataWithContentsOfFile:downloadFilePath]).to.equal(data);
+        // The download removes its file once the completion blocks have been called
+        dispatch_async(dispatch_get_main_queue(), ^{
+            expect([[NSFileManager defaultManager] fileExistsAtPath:downloadFilePath]).to.beFalsy();
+            [[NSFileManager defaultManager] removeItemAtPath:downloadDirectory error:nil];
+            [expectation fulfill];
+        });
+    } context:@{SDWebImageContextDownloadDirectory : downloadDirectory}];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test31ThatDownloadsOverTheInFlightBytesBudgetAreAdmittedOneAtATime {
+    XCTestExpectation *expectation1 = [self expectationWithDescription:@"First download completes"];
+    XCTestExpectation *expectation2 = [self expectationWithDescription:@"Second download completes"];
+    NSData *body = [NSData dataWithContentsOfFile:[[NSBundle bundleForClass:[self class]] pathForResource:@"TestImageLarge" ofType:@"jpg"]];
+    SDMockURLProtocol.responseHandler = ^SDMockURLResponse *(NSURLRequest *request) {
+        return [SDMockURLResponse responseWithStatusCode:200 headerFields:@{@"Content-Type" : @"image/jpeg", @"Content-Length" : @(body.length).stringValue} body:body];
+    };
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] initWithSessionConfiguration:[SDMockURLProtocol sessionConfiguration]];
+    // Every body is over the budget, so the second download waits for the first one to finish
+    downloader.maxInFlightBytes = 1;
+    NSURL *imageURL1 = [NSURL URLWithString:@"http://sdwebimage.mock/Budget1.jpg"];
+    NSURL *imageURL2 = [NSURL URLWithString:@"http://sdwebimage.mock/Budget2.jpg"];
+    __block BOOL firstCompleted = NO;
+    // The admitted downloads do not start before the check below
+    [downloader setSuspended:YES];
+    
+    [downloader downloadImageWithURL:imageURL1 options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        firstCompleted = YES;
+        [expectation1 fulfill];
+    }];
+    [downloader downloadImageWithURL:imageURL2 options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        expect(firstCompleted).to.beTruthy();
+        [expectation2 fulfill];
+    }];
+    // Only the first download has been admitted, and it is counted at the estimate until its response
+    expect(downloader.currentInFlightBytes).to.equal(downloader.inFlightBytesEstimate);
+    [downloader setSuspended:NO];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    NSArray<NSURLRequest *> *requests = SDMockURLProtocol.receivedRequests;
+    expect(requests.count).to.equal(2);
+    expect(requests[0].URL).to.equal(imageURL1);
+    expect(requests[1].URL).to.equal(imageURL2);
+    [downloader invalidateSessionAndCancel:YES];
+    [SDMockURLProtocol reset];
+}
+
+- (void)test32ThatAnImageOverThePixelBudgetIsAborted {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Download is aborted"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    // The test image is 50x50
+    [downloader downloadImageWithURL:[NSURL URLWithString:kTestJpegURL] options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).to.beNil();
+        expect(error.domain).to.equal(SDWebImageErrorDomain);
+        expect(error.code).to.equal(SDWebImageErrorPixelBudgetExceeded);
+        [expectation fulfill];
+    } context:@{SDWebImageContextImagePixelBudget : @(1000)}];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test33ThatAnImageOverThePixelBudgetIsDownsampledWhenScalingDown {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Downsampled image"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    [downloader downloadImageWithURL:[NSURL URLWithString:kTestJpegURL] options:SDWebImageDownloaderScaleDownLargeImages progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(error).to.beNil();
+        expect(image).toNot.beNil();
+        CGImageRef imageRef = image.CGImage;
+        expect(CGImageGetWidth(imageRef) * CGImageGetHeight(imageRef)).to.beLessThanOrEqualTo(1000);
+        [expectation fulfill];
+    } context:@{SDWebImageContextImagePixelBudget : @(1000)}];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test34ThatTheLastProgressIsDeliveredWhenProgressIsCoalesced {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Last progress delivered"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    downloader.minimumProgressInterval = 1000;
+    __block NSInteger lastReceivedSize = 0;
+    __block NSInteger lastExpectedSize = -1;
+    [downloader downloadImageWithURL:[NSURL URLWithString:kTestJpegURL] options:0 progress:^(NSInteger receivedSize, NSInteger expectedSize, NSURL * _Nullable targetURL) {
+        lastReceivedSize = receivedSize;
+        lastExpectedSize = expectedSize;
+    } completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        expect(lastExpectedSize).to.beGreaterThan(0);
+        expect(lastReceivedSize).to.equal(lastExpectedSize);
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+    
+    // Without a Content-Length, the last chunk is only known when the task completes
+    XCTestExpectation *unknownLengthExpectation = [self expectationWithDescription:@"Last progress delivered without an expected size"];
+    NSData *body = [NSData dataWithContentsOfFile:[[NSBundle bundleForClass:[self class]] pathForResource:@"TestImageLarge" ofType:@"jpg"]];
+    SDMockURLProtocol.responseHandler = ^SDMockURLResponse *(NSURLRequest *request) {
+        return [SDMockURLResponse responseWithStatusCode:200 headerFields:@{@"Content-Type" : @"image/jpeg"} body:body];
+    };
+    SDWebImageDownloader *unknownLengthDownloader = [[SDWebImageDownloader alloc] initWithSessionConfiguration:[SDMockURLProtocol sessionConfiguration]];
+    unknownLengthDownloader.minimumProgressInterval = 1000;
+    lastReceivedSize = 0;
+    lastExpectedSize = -1;
+    [unknownLengthDownloader downloadImageWithURL:[NSURL URLWithString:@"http://sdwebimage.mock/UnknownLength.jpg"] options:0 progress:^(NSInteger receivedSize, NSInteger expectedSize, NSURL * _Nullable targetURL) {
+        lastReceivedSize = receivedSize;
+        lastExpectedSize = expectedSize;
+    } completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(image).toNot.beNil();
+        expect(lastExpectedSize).to.equal(0);
+        expect(lastReceivedSize).to.equal(body.length);
+        [unknownLengthExpectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [unknownLengthDownloader invalidateSessionAndCancel:YES];
+    [SDMockURLProtocol reset];
+}
+
+- (void)test35ThatProbingReadsTheMetadataAndCachesIt {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Probe reads the metadata"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] init];
+    NSURL *url = [NSURL URLWithString:kTestJpegURL];
+    id<SDWebImageOperation> operation = [downloader probeImageWithURL:url completed:^(SDWebImageMetadata * _Nullable metadata, NSError * _Nullable error) {
+        expect(error).to.beNil();
+        expect(metadata.format).to.equal(SDImageFormatJPEG);
+        expect(metadata.pixelSize).to.equal(CGSizeMake(50, 50));
+        expect(metadata.isAnimated).to.beFalsy();
+        // Probing again does not hit the network
+        id<SDWebImageOperation> cachedOperation = [downloader probeImageWithURL:url completed:^(SDWebImageMetadata * _Nullable cachedMetadata, NSError * _Nullable cachedError) {
+            expect(cachedMetadata).to.equal(metadata);
+            [expectation fulfill];
+        }];
+        expect(cachedOperation).to.beNil();
+    }];
+    expect(operation).toNot.beNil();
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+}
+
+- (void)test36ThatDownloadsWithDifferentPixelBudgetsAreNotCoalesced {
+    XCTestExpectation *abortedExpectation = [self expectationWithDescription:@"Download over its budget is aborted"];
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Download without budget completes"];
+    NSData *body = [NSData dataWithContentsOfFile:[[NSBundle bundleForClass:[self class]] pathForResource:@"TestImageLarge" ofType:@"jpg"]];
+    SDMockURLProtocol.responseHandler = ^SDMockURLResponse *(NSURLRequest *request) {
+        return [SDMockURLResponse responseWithStatusCode:200 headerFields:@{@"Content-Type" : @"image/jpeg", @"Content-Length" : @(body.length).stringValue} body:body];
+    };
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] initWithSessionConfiguration:[SDMockURLProtocol sessionConfiguration]];
+    NSURL *imageURL = [NSURL URLWithString:@"http://sdwebimage.mock/PixelBudget.jpg"];
+    
+    [downloader downloadImageWithURL:imageURL options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(error.code).to.equal(SDWebImageErrorPixelBudgetExceeded);
+        [abortedExpectation fulfill];
+    } context:@{SDWebImageContextImagePixelBudget : @(1000)}];
+    // The budget of the first request does not apply to this one
+    [downloader downloadImageWithURL:imageURL options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, BOOL finished) {
+        expect(error).to.beNil();
+        expect(image).toNot.beNil();
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    expect(SDMockURLProtocol.receivedRequests.count).to.equal(2);
+    [downloader invalidateSessionAndCancel:YES];
+    [SDMockURLProtocol reset];
+}
+
+- (void)test37ThatProbingWaitsForTheAnimationToBeKnown {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Probe reads the animation"];
+    // A comment extension after the global color table puts the looping extension past the first chunk of the body, well after the pixel size
+    NSMutableData *body = [[NSData dataWithContentsOfFile:[[NSBundle bundleForClass:[self class]] pathForResource:@"TestImage" ofType:@"gif"]] mutableCopy];
+    uint8_t flags = ((const uint8_t *)body.bytes)[10];
+    NSUInteger headerLength = 13 + ((flags & 0x80) ? 3 << ((flags & 0x07) + 1) : 0);
+    NSMutableData *comment = [NSMutableData dataWithBytes:(uint8_t[]){0x21, 0xFE} length:2];
+    for (NSUInteger i = 0; i < 32; i++) {
+        uint8_t size = 255;
+        [comment appendBytes:&size length:1];
+        [comment increaseLengthBy:size];
+    }
+    [comment increaseLengthBy:1];
+    [body replaceBytesInRange:NSMakeRange(headerLength, 0) withBytes:comment.bytes length:comment.length];
+    SDMockURLProtocol.responseHandler = ^SDMockURLResponse *(NSURLRequest *request) {
+        return [SDMockURLResponse responseWithStatusCode:200 headerFields:@{@"Content-Type" : @"image/gif", @"Content-Length" : @(body.length).stringValue} body:body];
+    };
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] initWithSessionConfiguration:[SDMockURLProtocol sessionConfiguration]];
+    [downloader probeImageWithURL:[NSURL URLWithString:@"http://sdwebimage.mock/Animated.gif"] completed:^(SDWebImageMetadata * _Nullable metadata, NSError * _Nullable error) {
+        expect(error).to.beNil();
+        expect(metadata.format).to.equal(SDImageFormatGIF);
+        expect(metadata.isAnimated).to.beTruthy();
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+    [SDMockURLProtocol reset];
+}
+
 @end
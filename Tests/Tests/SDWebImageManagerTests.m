@@ -8,11 +8,33 @@
 
 #import "SDTestCase.h"
 #import <SDWebImage/SDWebImageManager.h>
+#import "SDMockURLProtocol.h"
 
 @interface SDWebImageManagerTests : SDTestCase
 
 @end
 
+@interface SDWebImageTestLoader : NSObject <SDWebImageLoader>
+
+@property (strong, nonatomic, nullable) UIImage *image;
+
+@end
+
+@implementation SDWebImageTestLoader
+
+- (BOOL)canLoadWithURL:(nullable NSURL *)url {
+    return YES;
+}
+
+- (nullable id<SDWebImageOperation>)loadImageWithURL:(nullable NSURL *)url options:(SDWebImageDownloaderOptions)options context:(nullable SDWebImageContext *)context progress:(nullable SDWebImageDownloaderProgressBlock)progressBlock completed:(nullable SDWebImageDownloaderCompletedBlock)completedBlock {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        completedBlock(self.image, nil, nil, YES);
+    });
+    return nil;
+}
+
+@end
+
 @implementation SDWebImageManagerTests
 
 - (void)test01ThatSharedManagerIsNotEqualToInitManager {
@@ -127,4 +149,279 @@
     [self waitForExpectationsWithCommonTimeout];
 }
 
+- (void)test08ThatFailedURLIsBlacklistedUntilItsRetryInterval {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Failed URL is retried once its interval has elapsed"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:[SDImageCache sharedImageCache] downloader:[SDWebImageDownloader sharedDownloader]];
+    NSURL *url = [NSURL URLWithString:@"unsupported://www.example.com/image.png"];
+    
+    [manager loadImageWithURL:url options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        expect(error.code).to.equal(NSURLErrorUnsupportedURL);
+        // Blacklisted, fails at once without downloading
+        [manager loadImageWithURL:url options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+            expect(error.code).to.equal(NSURLErrorFileDoesNotExist);
+            // Downloaded again once the URL is forgotten
+            [manager removeFailedURL:url];
+            [manager loadImageWithURL:url options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+                expect(error.code).to.equal(NSURLErrorUnsupportedURL);
+                [expectation fulfill];
+            }];
+        }];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test09ThatFileURLsAndDataURIsAreLoadedWithoutTheDownloader {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"File URL and data URI are loaded"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"LoaderTests"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:[SDWebImageDownloader sharedDownloader]];
+    NSString *testImagePath = [[NSBundle bundleForClass:[self class]] pathForResource:@"TestImage" ofType:@"png"];
+    NSURL *fileURL = [NSURL fileURLWithPath:testImagePath];
+    NSString *base64String = [[NSData dataWithContentsOfFile:testImagePath] base64EncodedStringWithOptions:0];
+    NSURL *dataURI = [NSURL URLWithString:[@"data:image/png;base64," stringByAppendingString:base64String]];
+    expect([manager imageLoaderForURLScheme:@"FILE"]).to.equal([SDWebImageFileLoader sharedLoader]);
+    
+    [manager loadImageWithURL:fileURL options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        expect(image).toNot.beNil();
+        expect(cacheType).to.equal(SDImageCacheTypeNone);
+        [manager loadImageWithURL:dataURI options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+            expect(image).toNot.beNil();
+            expect(cacheType).to.equal(SDImageCacheTypeNone);
+            [cache clearMemory];
+            [expectation fulfill];
+        }];
+    }];
+    expect([SDWebImageDownloader sharedDownloader].currentDownloadCount).to.equal(0);
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test10ThatACustomLoaderIsUsedForItsScheme {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Custom loader gives the image"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"LoaderTests"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:[SDWebImageDownloader sharedDownloader]];
+    SDWebImageTestLoader *loader = [SDWebImageTestLoader new];
+    NSString *testImagePath = [[NSBundle bundleForClass:[self class]] pathForResource:@"TestImage" ofType:@"png"];
+    loader.image = [UIImage imageWithContentsOfFile:testImagePath];
+    [manager setImageLoader:loader forURLScheme:@"test"];
+    
+    [manager loadImageWithURL:[NSURL URLWithString:@"test://image"] options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        expect(image).to.equal(loader.image);
+        [cache clearMemory];
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test11ThatAPipelineStageRunsItsTasksWithinItsLimit {
+    SDWebImagePipelineStage *stage = [[SDWebImagePipelineStage alloc] initWithName:@"test" queue:nil maxConcurrentTaskCount:1];
+    NSMutableArray<SDWebImagePipelineStageDoneBlock> *doneBlocks = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 3; i++) {
+        [stage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull done) {
+            [doneBlocks addObject:done];
+        }];
+    }
+    expect(doneBlocks.count).to.equal(1);
+    expect(stage.runningTaskCount).to.equal(1);
+    expect(stage.pendingTaskCount).to.equal(2);
+    expect(stage.peakPendingTaskCount).to.equal(2);
+    
+    // Calling done twice frees one slot only
+    doneBlocks[0]();
+    doneBlocks[0]();
+    expect(doneBlocks.count).to.equal(2);
+    expect(stage.pendingTaskCount).to.equal(1);
+    
+    stage.maxConcurrentTaskCount = 0;
+    expect(doneBlocks.count).to.equal(3);
+    doneBlocks[1]();
+    doneBlocks[2]();
+    expect(stage.runningTaskCount).to.equal(0);
+    expect(stage.completedTaskCount).to.equal(3);
+}
+
+- (void)test12ThatALoadGoesThroughTheStages {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Load goes through the stages"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"StageTests"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:[SDWebImageDownloader sharedDownloader]];
+    NSURL *originalImageURL = [NSURL URLWithString:kTestJpegURL];
+    
+    [manager loadImageWithURL:originalImageURL options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        expect(image).toNot.beNil();
+        expect(manager.cacheQueryStage.completedTaskCount).to.equal(1);
+        expect(manager.fetchStage.completedTaskCount).to.equal(1);
+        expect(manager.storeStage.completedTaskCount + manager.storeStage.runningTaskCount).to.equal(1);
+        expect(manager.deliveryStage.runningTaskCount).to.equal(1);
+        [cache clearMemory];
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test13ThatATransformedImageIsCachedUnderItsOwnKey {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Transformed image is cached under its own key"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TransformerTests"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:[SDWebImageDownloader sharedDownloader]];
+    NSURL *originalImageURL = [NSURL URLWithString:kTestJpegURL];
+    NSString *key = [manager cacheKeyForURL:originalImageURL];
+    __block NSUInteger transformCount = 0;
+    __block UIImage *transformedImage;
+    SDWebImageBlockTransformer *transformer = [SDWebImageBlockTransformer transformerWithKey:@"Test" block:^UIImage * _Nullable(UIImage * _Nonnull image, NSString * _Nonnull imageKey) {
+        transformCount++;
+        transformedImage = [[UIImage alloc] initWithCGImage:image.CGImage];
+        return transformedImage;
+    }];
+    SDWebImageContext *context = @{SDWebImageContextImageTransformer : transformer};
+    
+    [manager loadImageWithURL:originalImageURL options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        expect(image).to.equal(transformedImage);
+        expect([cache imageFromMemoryCacheForKey:SDTransformedKeyForKey(key, @"Test")]).to.equal(transformedImage);
+        expect([cache imageFromMemoryCacheForKey:key]).to.beNil();
+        [manager loadImageWithURL:originalImageURL options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image2, NSData * _Nullable data2, NSError * _Nullable error2, SDImageCacheType cacheType2, BOOL finished2, NSURL * _Nullable imageURL2) {
+            expect(image2).to.equal(transformedImage);
+            expect(cacheType2).to.equal(SDImageCacheTypeMemory);
+            expect(transformCount).to.equal(1);
+            [cache clearMemory];
+            [expectation fulfill];
+        } context:context];
+    } context:context];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test14ThatCancellingAGroupKeepsTheOtherOperations {
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"GroupTests"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:[SDWebImageDownloader sharedDownloader]];
+    NSURL *originalImageURL = [NSURL URLWithString:kTestJpegURL];
+    
+    id<SDWebImageOperation> groupedOperation = [manager loadImageWithURL:originalImageURL options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        XCTFail(@"Shouldn't have completed here.");
+    } context:@{SDWebImageContextOperationGroup : @"Group"}];
+    id<SDWebImageOperation> operation = [manager loadImageWithURL:originalImageURL options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        XCTFail(@"Shouldn't have completed here.");
+    }];
+    
+    [manager cancelOperationsInGroup:@"Group"];
+    expect([(NSObject *)groupedOperation valueForKey:@"cancelled"]).to.equal(@YES);
+    expect([(NSObject *)operation valueForKey:@"cancelled"]).to.equal(@NO);
+    expect([manager isRunning]).to.equal(YES);
+    
+    [manager cancelAll];
+    expect([(NSObject *)operation valueForKey:@"cancelled"]).to.equal(@YES);
+    expect([manager isRunning]).to.equal(NO);
+}
+
+- (void)test15ThatConcurrentLoadsOfAKeyShareOneCacheQuery {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Concurrent loads share one cache query"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"SingleFlightTests"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:[SDWebImageDownloader sharedDownloader]];
+    NSURL *imageURL = [NSURL URLWithString:@"http://via.placeholder.com/SingleFlight.png"];
+    NSString *testImagePath = [[NSBundle bundleForClass:[self class]] pathForResource:@"TestImage" ofType:@"png"];
+    [cache storeImageDataToDisk:[NSData dataWithContentsOfFile:testImagePath] forKey:[manager cacheKeyForURL:imageURL] error:nil];
+    [cache clearMemory];
+    
+    __block UIImage *firstImage;
+    [manager loadImageWithURL:imageURL options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable url) {
+        expect(cacheType).to.equal(SDImageCacheTypeDisk);
+        firstImage = image;
+    }];
+    // Cancelling one of the loads keeps the query of the others
+    [[manager loadImageWithURL:imageURL options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable url) {
+        XCTFail(@"Shouldn't have completed here.");
+    }] cancel];
+    [manager loadImageWithURL:imageURL options:0 progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable url) {
+        expect(cacheType).to.equal(SDImageCacheTypeDisk);
+        expect(image).toNot.beNil();
+        expect(image).to.beIdenticalTo(firstImage);
+        [cache clearDiskOnCompletion:^{
+            [expectation fulfill];
+        }];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test16ThatATracedLoadIsExportedAsChromeTrace {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Traced load is exported"];
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"TracerTests"];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:[SDWebImageDownloader sharedDownloader]];
+    NSURL *originalImageURL = [NSURL URLWithString:kTestJpegURL];
+    SDWebImageTracer *tracer = [SDWebImageTracer sharedTracer];
+    [tracer removeAllEvents];
+    tracer.enabled = YES;
+    
+    [manager loadImageWithURL:originalImageURL options:SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        tracer.enabled = NO;
+        NSDictionary *trace = [NSJSONSerialization JSONObjectWithData:[tracer chromeTraceData] options:0 error:nil];
+        NSArray<NSDictionary *> *events = trace[@"traceEvents"];
+        NSArray<NSString *> *names = [events valueForKey:@"name"];
+        expect(names).to.contain(@"enqueue");
+        expect(names).to.contain(@"cache query wait");
+        expect(names).to.contain(@"memory lookup");
+        expect(names).to.contain(@"fetch");
+        expect(names).to.contain(@"network");
+        // from the metrics of the task
+        expect(names).to.contain(@"request");
+        expect(names).to.contain(@"decode");
+        // one timeline for the load
+        expect([NSSet setWithArray:[events valueForKey:@"id"]].count).to.equal(1);
+        [tracer removeAllEvents];
+        [cache clearMemory];
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithCommonTimeout];
+}
+
+- (void)test17ThatProgressiveImagesOfAThumbnailLoadAreThumbnails {
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Progressive images of a thumbnail load are thumbnails"];
+    NSData *body = [NSData dataWithContentsOfFile:[[NSBundle bundleForClass:[self class]] pathForResource:@"TestImageLarge" ofType:@"jpg"]];
+    SDMockURLProtocol.responseHandler = ^SDMockURLResponse *(NSURLRequest *request) {
+        return [SDMockURLResponse responseWithStatusCode:200 headerFields:@{@"Content-Type" : @"image/jpeg", @"Content-Length" : @(body.length).stringValue} body:body];
+    };
+    SDImageCache *cache = [[SDImageCache alloc] initWithNamespace:@"ProgressiveThumbnailTests"];
+    SDWebImageDownloader *downloader = [[SDWebImageDownloader alloc] initWithSessionConfiguration:[SDMockURLProtocol sessionConfiguration]];
+    SDWebImageManager *manager = [[SDWebImageManager alloc] initWithCache:cache downloader:downloader];
+    CGSize thumbnailPixelSize = CGSizeMake(100, 100);
+    SDWebImageContext *context = @{SDWebImageContextImageThumbnailPixelSize : [NSValue valueWithBytes:&thumbnailPixelSize objCType:@encode(CGSize)]};
+    
+    [manager loadImageWithURL:[NSURL URLWithString:@"http://sdwebimage.mock/ProgressiveThumbnail.jpg"] options:SDWebImageProgressiveDownload | SDWebImageCacheMemoryOnly progress:nil completed:^(UIImage * _Nullable image, NSData * _Nullable data, NSError * _Nullable error, SDImageCacheType cacheType, BOOL finished, NSURL * _Nullable imageURL) {
+        expect(image).toNot.beNil();
+        // The partial images too
+        expect(image.size.width * image.scale).to.beLessThanOrEqualTo(thumbnailPixelSize.width);
+        expect(image.size.height * image.scale).to.beLessThanOrEqualTo(thumbnailPixelSize.height);
+        if (finished) {
+            [cache clearMemory];
+            [expectation fulfill];
+        }
+    } context:context];
+    
+    [self waitForExpectationsWithCommonTimeout];
+    [downloader invalidateSessionAndCancel:YES];
+    [SDMockURLProtocol reset];
+}
+
+- (void)test18ThatSynchronousTasksOfAPipelineStageRunInALoop {
+    SDWebImagePipelineStage *stage = [[SDWebImagePipelineStage alloc] initWithName:@"test" queue:nil maxConcurrentTaskCount:1];
+    __block SDWebImagePipelineStageDoneBlock firstDone;
+    [stage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull done) {
+        firstDone = done;
+    }];
+    // Each task finishing synchronously would start the next one a few frames deeper if they recursed
+    const NSUInteger taskCount = 100000;
+    for (NSUInteger i = 0; i < taskCount; i++) {
+        [stage addTask:^(SDWebImagePipelineStageDoneBlock _Nonnull done) {
+            done();
+        }];
+    }
+    expect(stage.pendingTaskCount).to.equal(taskCount);
+    
+    firstDone();
+    expect(stage.pendingTaskCount).to.equal(0);
+    expect(stage.runningTaskCount).to.equal(0);
+    expect(stage.completedTaskCount).to.equal(taskCount + 1);
+}
+
 @end
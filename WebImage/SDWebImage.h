@@ -35,6 +35,12 @@ FOUNDATION_EXPORT const unsigned char WebImageVersionString[];
 #import <SDWebImage/UIImage+MultiFormat.h>
 #import <SDWebImage/SDWebImageOperation.h>
 #import <SDWebImage/SDWebImageDownloader.h>
+#import <SDWebImage/SDWebImageDownloaderConcurrencyController.h>
+#import <SDWebImage/SDWebImageLoader.h>
+#import <SDWebImage/SDWebImageMetadata.h>
+#import <SDWebImage/SDWebImagePipelineStage.h>
+#import <SDWebImage/SDWebImageTransformer.h>
+#import <SDWebImage/SDWebImageTracer.h>
 #import <SDWebImage/SDWebImageTransition.h>
 #import <SDWebImage/SDWebImageIndicator.h>
 